@@ -26,6 +26,7 @@ newAddr  = 0x02
 gotFrame = 0x04  //set on first received frame
 mcstOK   = 0x08  //accept multicast packets
 mcst     = 0x10  //incoming packet is multicast
+rxSlotLines = 64 //cache lines per buffer in a receive ring (2048 bytes)
 MAChigh = $11
 MAClow  = $12
 Temp   = $13
@@ -450,12 +451,15 @@ txInitLoop:
    ld      TxHead, 256
    ld      TxTail, 256
 
-//initialize the 32 word RxAddr array
+//initialize the 32 word RxAddr array, and the 32 word RxRing array at 160
+//(ring base and end for each core; an end of 0 means no ring)
    ld      count, 30  //array starts at 128. We go backwards
    ld      Addr, 128
 rxAddrLoop:
    sub      wq, zero, 1  //entry is -1
    aqw_add  void, Addr, count
+   ld       wq, zero     //ring end is 0
+   aqw_add  void, count, 161
    sub      count, count, 2
    jnm      rxAddrLoop
    ld       RxHdrPtr, 768
@@ -524,7 +528,11 @@ getSourceAddr:
    or     SMAC0, SMAC0, Temp2     //OR EtherType and bytes 0,1 of source MAC address
      
    aqr_add void, Index, 128      //read the DMA address
+   aqr_add void, Index, 129      //and the DMA limit
    ld     FrameAddr, rq           //save FrameAddr until packet is complete
+   sub    void, rq, FrameAddr     //drop if at the limit (ring full)
+   jz     dropFrame
+   ld     void, FrameAddr
    jm     dropFrame               //drop if DMA address negative
    ld     wq, FrameAddr     
    or     Eflags, Eflags, arriving
@@ -553,6 +561,16 @@ doReceiveCompletion:
 noExtras:
    and    void, Eflags, newAddr     //check whether a new address came in during reception
    jnz     sendRxMsg                //it did.  Don't update the DMA address
+   aqr_add void, Index, 161         //read the ring end
+   ld      Addr, rq
+   jz      notRing
+   add     Temp2, FrameAddr, rxSlotLines  //next buffer in the ring
+   sub     void, Temp2, Addr
+   jnz     update
+   aqr_add void, Index, 160         //past the end.  Back to the ring base
+   ld      Temp2, rq
+   j       update
+notRing:
    aqr_add void, Index, 129         //read DMA limit
    add     Temp2, FrameAddr, Temp2  //next DMA address
    sub     void, rq, Temp2          //limit - new address
@@ -578,21 +596,31 @@ sendRxMsg:
 doProcessMsg:
 //MsgHdr has the length in bits 5:0 and the source core in bits 13:10.
 //If the message length is 1, it is a MAC address request.
-//If it is 2, it is a receive buffer allocation,
-//otherwise it is a transmit message.
+//If it is 2, it is a receive buffer allocation, if 3 a receive ring,
+//otherwise it is a transmit message: payload address, lengths and core,
+//destination MAC address and EtherType (two words), and a tag.  The tag
+//goes back to the originating core when the frame is sent, or negated
+//if the request is rejected, so the core can tell which request it was.
    and   Temp, MsgHdr, 0x3f //get the length
    lsr   MsgHdr, MsgHdr, 10 
    and   MsgHdr, MsgHdr, 0xf //source core
    sub   void, Temp, 1
    jz    sendMACaddress
+   sub   void, Temp, 3
+   jz    rxRingMsg
    sub   void, Temp, 2
    jnz   txMsgRcvd
 
 //message is a buffer allocation
    lsl   Temp, MsgHdr, 1     // 2 * source core
-   aqw_add void, Temp, 128   //Rx DMA start address. Negative means drop later frames
-   ld    wq, rq
-   ld    Temp2, rq           //DMA limit
+   aqw_add void, Temp, 161   //not a ring
+   ld    wq, zero
+   ld    Addr, rq            //Rx DMA start address. Negative means drop later frames
+rxStart:
+   aqw_add void, Temp, 128
+   ld    wq, Addr
+rxLimit:
+   ld    Temp2, rq           //DMA limit (exclusive)
    sub   void, MsgHdr, 1     //did the message come from core 1?
    jnz   writeLimit          //no.
    ld    void, Temp2
@@ -604,6 +632,8 @@ writeLimit:
    lsl   Temp2, Temp2, 1        //remove msb
    lsr   wq, Temp2, 1
    aqw_add void, Temp, 129  //Rx DMA limit.
+   ld    void, Addr          //a ring release doesn't change the DMA address
+   jz    checkSendReady
 
 //if the source core is one for which a frame is currently arriving, we must set Eflags.newAddr so
 //that the DMA address isn't updated when the frame ends.
@@ -615,6 +645,23 @@ writeLimit:
    or    Eflags, Eflags, newAddr //yes 
    j     checkSendReady
 
+//message is a receive ring: base, end and limit, as cache line addresses.
+//The ring is a sequence of rxSlotLines buffers, used in order, and a frame
+//is dropped when the next buffer is the limit.  A zero base leaves the
+//ring as it is and just moves the limit, as the core releases buffers.
+rxRingMsg:
+   lsl   Temp, MsgHdr, 1     // 2 * source core
+   ld    Addr, rq            //ring base
+   jnz   rxRingStart
+   ld    void, rq            //release.  Ignore the end
+   j     rxLimit
+rxRingStart:
+   aqw_add void, Temp, 160
+   ld    wq, Addr
+   aqw_add void, Temp, 161   //ring end
+   ld    wq, rq
+   j     rxStart
+
 sendMACaddress:
    ld    void, rq             //remove (and drop) one word from rq
    ld    wq, MAChigh
@@ -643,9 +690,10 @@ txCopy:
    jz  acceptFrame
 
 rejectFrame:
+   aqr_add void, TxTail, 5   //fetch the request's tag
    lsl   MsgHdr, MsgHdr, 3   //Yes; reject Tx request. Originating core into bits 6:3
    or    MsgHdr, MsgHdr, 0x84
-   ld    wq, zero           //zero message => reject
+   sub   wq, zero, rq       //negated tag => reject
    aqw_add void, IObase, MsgHdr
    j     checkSendReady
 
@@ -660,9 +708,10 @@ doSend:
   aqr_add void, TxHead, 2    //fetch the lengths and initiating core (in bits 23:4) bits 3:0 == 1
   or      Temp, rq, Temp     //or in DMbase and send to aq
   aqw_add void, IObase, Temp
+  aqr_add void, TxHead, 5    //fetch the request's tag
   aqr_ld  void, TxHead       //advance TxHead
 
-  ld      wq, Temp           //send a message back to the originating core to indicate the frame was sent. 
+  ld      wq, rq             //send the tag back to the originating core to indicate the frame was sent.
   lsr     Temp, Temp, 12     //originating core in bits 6:3
   and     Temp, Temp, 0x78   //mask
   or      Temp, Temp, 0x84   //length = 1, I/O device 4 (messenger)
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "shared/intercore.h"
+#include "lib/lib.h"
+#include "lib/msg.h"
+#include "lib/chan.h"
+
+/*
+ * Descriptor message word: channel id, a flag set when the buffer starts
+ * back at the beginning of the ring, and the length in bytes.
+ */
+#define CHAN_MAX            256
+#define CHAN_MAXLEN         (1 << 23)
+#define chan_desc(id, w, n) (((id) << 24) | ((w) << 23) | (n))
+#define chan_desc_id(d)     ((d) >> 24)
+#define chan_desc_wrap(d)   (((d) >> 23) & 1)
+#define chan_desc_len(d)    ((d) & (CHAN_MAXLEN - 1))
+
+/* Descriptors a consumer can hold for channels it isn't receiving on */
+#define CHAN_STASH          64
+
+/*
+ * Ring positions count bytes since the channel was created, modulo 2^32;
+ * the ring size is a power of two, so a position's offset in the ring is
+ * just its low bits.  Each group of fields has a cache line to itself,
+ * and after creation is written by one core only.
+ */
+struct Chan {
+  struct {
+    unsigned int id;
+    unsigned int src;
+    unsigned int dst;
+    unsigned int size;
+    char *ring;
+  } __mcalign__ config;       /* fixed at creation */
+  struct {
+    unsigned int head;        /* end of the last buffer sent */
+    unsigned int alloc;       /* start of the buffer from chan_alloc */
+    unsigned int released;    /* last value seen of shared.released */
+  } __mcalign__ producer;
+  struct {
+    unsigned int received;    /* end of the last buffer received */
+  } __mcalign__ consumer;
+  struct {
+    unsigned int released;    /* end of the last buffer released */
+  } __mcalign__ shared;       /* written by the consumer */
+};
+
+typedef struct ChanCore {
+  unsigned int opened[CHAN_MAX / 32]; /* channels this core has used */
+  unsigned int stash[CHAN_STASH];     /* descriptors for other channels */
+  unsigned int stashed;
+} ChanCore;
+
+DEFINE_PER_CORE(ChanCore, chanCore);
+
+static unsigned int chanNext CACHELINE;   /* next channel id */
+
+/*
+ * Called on each use.  The first time this core uses a channel, discard
+ * anything it still has cached from the memory before the channel was
+ * created.
+ */
+static void chan_open(Chan c)
+{
+  cache_invalidateMem(&c->config, sizeof(c->config));
+  unsigned int id = c->config.id;
+  unsigned int *opened = &my(chanCore).opened[id / 32];
+  if (!(*opened & (1 << (id % 32)))) {
+    cache_invalidateMem(c, sizeof(struct Chan));
+    *opened |= 1 << (id % 32);
+  }
+}
+
+/*
+ * Spin for the next descriptor for channel 'id', keeping any for other
+ * channels that arrive first.
+ */
+static unsigned int chan_nextDesc(unsigned int id)
+{
+  ChanCore *me = &my(chanCore);
+  for (unsigned int i = 0; i < me->stashed; i++) {
+    unsigned int d = me->stash[i];
+    if (chan_desc_id(d) == id) {
+      me->stashed--;
+      memmove(&me->stash[i], &me->stash[i + 1],
+              (me->stashed - i) * sizeof(unsigned int));
+      return d;
+    }
+  }
+  IntercoreMessage msg;
+  for (;;) {
+    unsigned int status = message_recv(&msg);
+    if (status == 0) continue;
+    if (message_type(status) != msgTypeChan) {
+      xprintf("[%02u]: chan: dropped message type %u from core %u\n",
+              corenum(), message_type(status), message_srce(status));
+      continue;
+    }
+    if (chan_desc_id(msg[0]) == id) return msg[0];
+    if (me->stashed == CHAN_STASH) die("chan: too many descriptors waiting");
+    me->stash[me->stashed++] = msg[0];
+  }
+}
+
+Chan chan_create(unsigned int src, unsigned int dst, unsigned int bytes)
+{
+  assert(src != dst && src < 16 && dst < 16);
+  unsigned int size = MCPAD;
+  while (size < bytes) size <<= 1;
+  Chan c = cacheAlign(malloc(sizeof(struct Chan) + MCPAD - 1));
+  char *ring = cacheAlign(malloc(size + MCPAD - 1));
+  if (!c || !ring) die("chan_create: out of memory");
+
+  icSema_P(sem_chan);
+  cache_invalidateMem(&chanNext, sizeof(chanNext));
+  unsigned int id = chanNext++;
+  cache_flushMem(&chanNext, sizeof(chanNext));
+  icSema_V(sem_chan);
+  if (id >= CHAN_MAX) die("chan_create: too many channels");
+
+  memset(c, 0, sizeof(struct Chan));
+  c->config.id = id;
+  c->config.src = src;
+  c->config.dst = dst;
+  c->config.size = size;
+  c->config.ring = ring;
+  cache_flushMem(c, sizeof(struct Chan));
+  return c;
+}
+
+void *chan_alloc(Chan c, unsigned int len)
+{
+  chan_open(c);
+  unsigned int size = c->config.size;
+  unsigned int rlen = cacheMultiple(len);
+  assert(corenum() == c->config.src && rlen <= size && len < CHAN_MAXLEN);
+
+  unsigned int pos = c->producer.head;
+  unsigned int off = pos & (size - 1);
+  if (off + rlen > size) pos += size - off;   /* start again at the front */
+  /* An empty ring always has room, even counting the space skipped */
+  while (c->producer.released != c->producer.head &&
+         pos + rlen - c->producer.released > size) {
+    cache_invalidateMem(&c->shared, sizeof(c->shared));
+    c->producer.released = c->shared.released;
+  }
+  c->producer.alloc = pos;
+  return c->config.ring + (pos & (size - 1));
+}
+
+void chan_send(Chan c, void *ptr, unsigned int len)
+{
+  unsigned int pos = c->producer.alloc;
+  assert(ptr == c->config.ring + (pos & (c->config.size - 1)));
+  cache_flushMem(ptr, len);
+
+  IntercoreMessage desc;
+  desc[0] = chan_desc(c->config.id, (pos != c->producer.head), len);
+  message_send(c->config.dst, msgTypeChan, &desc, 1);
+  c->producer.head = pos + cacheMultiple(len);
+}
+
+void chan_recv(Chan c, void **ptr, unsigned int *len)
+{
+  chan_open(c);
+  assert(corenum() == c->config.dst);
+  unsigned int d = chan_nextDesc(c->config.id);
+  unsigned int size = c->config.size;
+  unsigned int pos = c->consumer.received;
+  if (chan_desc_wrap(d)) pos += size - (pos & (size - 1));
+
+  *len = chan_desc_len(d);
+  *ptr = c->config.ring + (pos & (size - 1));
+  cache_invalidateMem(*ptr, *len);
+  c->consumer.received = pos + cacheMultiple(*len);
+}
+
+void chan_release(Chan c)
+{
+  c->shared.released = c->consumer.received;
+  cache_flushMem(&c->shared, sizeof(c->shared));
+}
@@ -0,0 +1,51 @@
+#ifndef _CHAN_H_
+#define _CHAN_H_
+
+/*
+ * Channels: one-way bulk transfer from one core to another through a
+ * ring buffer in shared DDR.  The producer writes the data in place,
+ * chan_send flushes it from the producer's cache and sends the consumer
+ * a one-word descriptor message (type msgTypeChan); the consumer
+ * invalidates the data in its own cache and reads it in place, so the
+ * data itself never goes through the message queue.
+ *
+ * A core receiving on channels must not receive other message types
+ * itself: chan_recv drains the hardware queue, and discards (with a
+ * warning) anything that isn't a descriptor.
+ */
+
+typedef struct Chan *Chan;
+
+/*
+ * Create a channel from core 'src' to core 'dst' with a ring of 'bytes'
+ * bytes, rounded up to a power of two.  Any core may create it and pass
+ * it to the producer and consumer through shared memory.  At most 256
+ * channels can be created.
+ */
+Chan chan_create(unsigned int src, unsigned int dst, unsigned int bytes);
+
+/*
+ * Producer: return space for 'len' bytes in the ring, cache-line aligned,
+ * spinning until the consumer has released enough.
+ */
+void *chan_alloc(Chan c, unsigned int len);
+
+/*
+ * Producer: pass 'len' bytes at 'ptr', the result of the last chan_alloc
+ * and no more than was asked of it, to the consumer.
+ */
+void chan_send(Chan c, void *ptr, unsigned int len);
+
+/*
+ * Consumer: spin until the next buffer sent on 'c' arrives, and set
+ * '*ptr' and '*len' to it.  The buffer stays valid until chan_release,
+ * and must not be written.
+ */
+void chan_recv(Chan c, void **ptr, unsigned int *len);
+
+/*
+ * Consumer: return every buffer received so far on 'c' to the producer.
+ */
+void chan_release(Chan c);
+
+#endif
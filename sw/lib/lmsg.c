@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "shared/intercore.h"
+#include "lib/lib.h"
+#include "lib/msg.h"
+#include "lib/lmsg.h"
+
+/*
+ * Frame header word: sequence number within the message, the sender's
+ * type, a flag on the last frame, and the count of data bytes that follow.
+ */
+#define LF_DATA             (sizeof(IntercoreMessage) - 4)
+#define lf_header(s, t, l, n) (((s) << 13) | ((t) << 9) | ((l) << 8) | (n))
+#define lf_seq(h)           ((h) >> 13)
+#define lf_type(h)          (((h) >> 9) & 15)
+#define lf_last(h)          (((h) >> 8) & 1)
+#define lf_bytes(h)         ((h) & 255)
+
+/* Words in each core's hardware message queue, and the part of it kept
+ * back for credits, which aren't themselves flow controlled */
+#define LMSG_QUEUE_WORDS    1024
+#define LMSG_CREDIT_WORDS   64
+
+typedef struct LFrame {
+  struct LFrame *next;
+  unsigned int status;
+  IntercoreMessage msg;
+} LFrame;
+
+typedef struct LState {
+  unsigned int outstanding[16]; /* frames sent to each core, not credited */
+  LFrame *head[16];             /* frames taken from the queue, by source */
+  LFrame *tail[16];
+  LFrame *spare;                /* free frames */
+} LState;
+
+DEFINE_PER_CORE(LState, lstate);
+
+unsigned int lmsg_window(void)
+{
+  unsigned int others = (nCores() > 1 ? nCores() - 1 : 1);
+  unsigned int w = (LMSG_QUEUE_WORDS - LMSG_CREDIT_WORDS) / 64 / others;
+  return (w ? w : 1);
+}
+
+static LFrame *lframe_get(void)
+{
+  LState *s = &my(lstate);
+  LFrame *f = s->spare;
+  if (f) {
+    s->spare = f->next;
+    return f;
+  }
+  f = malloc(sizeof(LFrame));
+  if (!f) die("lmsg: out of memory");
+  return f;
+}
+
+static void lframe_put(LFrame *f)
+{
+  LState *s = &my(lstate);
+  f->next = s->spare;
+  s->spare = f;
+}
+
+/*
+ * Take one message out of the hardware queue, spinning until there is
+ * one.  A frame is credited to its sender straight away and returned;
+ * credits are applied, and anything else dropped, returning NULL.
+ */
+static LFrame *lmsg_pull(void)
+{
+  LState *s = &my(lstate);
+  LFrame *f = lframe_get();
+  unsigned int status;
+  while ((status = message_recv(&f->msg)) == 0) ;
+  unsigned int srce = message_srce(status);
+  if (message_type(status) == msgTypeLFrame) {
+    IntercoreMessage credit;
+    credit[0] = 1;
+    message_send(srce, msgTypeLCredit, &credit, 1);
+    f->status = status;
+    f->next = NULL;
+    return f;
+  }
+  if (message_type(status) == msgTypeLCredit) {
+    s->outstanding[srce] -= f->msg[0];
+  } else {
+    xprintf("[%02u]: lmsg: dropped message type %u from core %u\n",
+            corenum(), message_type(status), srce);
+  }
+  lframe_put(f);
+  return NULL;
+}
+
+static void lmsg_stash(LFrame *f)
+{
+  LState *s = &my(lstate);
+  unsigned int srce = message_srce(f->status);
+  if (s->head[srce]) {
+    s->tail[srce]->next = f;
+  } else {
+    s->head[srce] = f;
+  }
+  s->tail[srce] = f;
+}
+
+/*
+ * The next frame from core 'from', or from any core for lmsgAny: frames
+ * already taken from the queue first, in arrival order per core.
+ */
+static LFrame *lmsg_next(unsigned int from)
+{
+  LState *s = &my(lstate);
+  for (unsigned int i = 1; i < 16; i++) {
+    unsigned int c = (from == lmsgAny ? i : from);
+    LFrame *f = s->head[c];
+    if (f) {
+      s->head[c] = f->next;
+      return f;
+    }
+    if (from != lmsgAny) break;
+  }
+  for (;;) {
+    LFrame *f = lmsg_pull();
+    if (!f) continue;
+    if (from == lmsgAny || message_srce(f->status) == from) return f;
+    lmsg_stash(f);
+  }
+}
+
+void lmsg_send(unsigned int dest,
+               unsigned int type,
+               const void *buf,
+               unsigned int len)
+{
+  assert(dest != corenum() && dest < 16 && type < 16);
+  LState *s = &my(lstate);
+  unsigned int window = lmsg_window();
+  const char *p = buf;
+  IntercoreMessage frame;
+
+  for (unsigned int seq = 0; ; seq++) {
+    unsigned int n = (len < LF_DATA ? len : LF_DATA);
+    unsigned int last = (n == len);
+    while (s->outstanding[dest] >= window) {
+      LFrame *f = lmsg_pull();
+      if (f) lmsg_stash(f);
+    }
+    frame[0] = lf_header(seq, type, last, n);
+    memcpy(&frame[1], p, n);
+    message_send(dest, msgTypeLFrame, &frame, 1 + (n + 3) / 4);
+    s->outstanding[dest]++;
+    if (last) break;
+    p += n;
+    len -= n;
+  }
+}
+
+unsigned int lmsg_recv(unsigned int *src,
+                       unsigned int *type,
+                       void *buf,
+                       unsigned int maxlen)
+{
+  LFrame *f = lmsg_next(*src);
+  unsigned int from = message_srce(f->status);
+  unsigned int got = 0;
+  char *p = buf;
+
+  for (unsigned int seq = 0; ; seq++) {
+    unsigned int h = f->msg[0];
+    if (lf_seq(h) != seq) {
+      die("lmsg: frame %u from core %u, expected %u", lf_seq(h), from, seq);
+    }
+    unsigned int n = lf_bytes(h);
+    if (got < maxlen) {
+      memcpy(p + got, &f->msg[1], (n < maxlen - got ? n : maxlen - got));
+    }
+    got += n;
+    *type = lf_type(h);
+    lframe_put(f);
+    if (lf_last(h)) break;
+    f = lmsg_next(from);
+  }
+  *src = from;
+  return got;
+}
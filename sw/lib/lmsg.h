@@ -0,0 +1,50 @@
+#ifndef _LMSG_H_
+#define _LMSG_H_
+
+/*
+ * Large messages: arbitrary-length payloads carried over intercore
+ * messages, for the cores that run mc_main (2..n).
+ *
+ * A payload is cut into frames of up to 62 words of data plus one header
+ * word, sent with message type msgTypeLFrame.  Each receiving core returns
+ * a credit (type msgTypeLCredit) for every frame as it takes the frame out
+ * of its hardware queue, and a sender keeps no more than lmsg_window()
+ * frames outstanding to any one core, so the receiver's queue can't
+ * overflow however many cores send to it at once.
+ *
+ * A core using this library must not receive other message types itself:
+ * lmsg drains the hardware queue, and discards (with a warning) anything
+ * that isn't a frame or a credit.
+ */
+
+#define lmsgAny 0
+
+/*
+ * Send 'len' bytes at 'buf' to core 'dest'.  'type' (0 - 15) is passed
+ * through to the receiver.  Spins while waiting for credits, buffering
+ * frames that arrive from other cores in the meantime.
+ */
+void lmsg_send(unsigned int dest,
+               unsigned int type,
+               const void *buf,
+               unsigned int len);
+
+/*
+ * Receive the next message from core '*src', or from any core if '*src'
+ * is lmsgAny, copying at most 'maxlen' bytes of it into 'buf'.  Sets
+ * '*src' to the sender and '*type' to the sender's type, and returns the
+ * full length of the message; bytes beyond 'maxlen' are discarded.
+ * Messages from any one core are received in the order they were sent.
+ * Spins until a message is available.
+ */
+unsigned int lmsg_recv(unsigned int *src,
+                       unsigned int *type,
+                       void *buf,
+                       unsigned int maxlen);
+
+/*
+ * Frames that may be outstanding from one core to another
+ */
+unsigned int lmsg_window(void);
+
+#endif
@@ -11,6 +11,9 @@ enum {
   sem_barrier_mutex,
   sem_barrier_wait0,
   sem_barrier_wait1,
+  sem_malloc,
+  sem_chan,
+  sem_enet,
   
   sem_user = 32,
 };
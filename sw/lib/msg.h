@@ -8,6 +8,10 @@
  */
 enum {
   msgTypeRPC = 1,
+  msgTypeLFrame = 2,   /* lib/lmsg.c */
+  msgTypeLCredit = 3,
+  msgTypeChan = 4,     /* lib/chan.c */
+  msgTypeEnet = 5,     /* shared/enet.c */
   /* ... */
   msgTypeDefault = 8,
 };
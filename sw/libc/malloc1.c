@@ -37,6 +37,18 @@
 
 
 
+/* ----------------------------------------------------------------------
+ * Free chunk bins.  Chunks with a system size of up to NSMALL * SYSQUANT
+ * bytes each have an exact-fit bin.  Larger chunks go in one bin per
+ * power of two of system size.  A bitmap records which bins are non-empty.
+ * ---------------------------------------------------------------------- */
+#define NSMALL 64                /* exact-fit bins: 32 .. 2048 bytes */
+#define LOG2SMALLMAX 11          /* log2(NSMALL * SYSQUANT) */
+#define NBINS (NSMALL + 32 - LOG2SMALLMAX)
+#define NBINWORDS ((NBINS + 31) / 32)
+
+
+
 
 
 /* ----------------------------------------------------------------------
@@ -91,7 +103,8 @@ struct memarea
  * Global state of the memory allocator.
  * ---------------------------------------------------------------------- */
 static int initflag = 0;            /* flag if we have been initialized */
-static struct chunk freering [1];   /* free ring header */
+static struct chunk bins [NBINS];   /* free ring headers, by size */
+static unsigned int binmap [NBINWORDS]; /* bit set iff bin is non-empty */
 
 static int memareacnt = 0;
 static struct memarea memarea [10];
@@ -176,13 +189,49 @@ static size_t syssizeofc(struct chunk * c)
 
 
 /* ----------------------------------------------------------------------
- * Link an in use chunk into the free ring and mark it as MAGIC_CFREE.
+ * Compute the bin for chunks of a given system size.
+ * ---------------------------------------------------------------------- */
+extern int ffo(unsigned int value);   /* count of leading zeros */
+
+static int binof(size_t syssize)
+{
+  if (syssize <= NSMALL * SYSQUANT) return syssize / SYSQUANT - 1;
+  return NSMALL + (31 - ffo(syssize)) - LOG2SMALLMAX;
+}
+
+
+
+
+/* ----------------------------------------------------------------------
+ * Find the first non-empty bin at or after bin b.  Return -1 if none.
+ * ---------------------------------------------------------------------- */
+static int nextbin(int b)
+{
+  if (b >= NBINS) return -1;
+
+  int w = b >> 5;
+  unsigned int bits = binmap[w] & (~0u << (b & 31));
+
+  while (bits == 0) {
+    if (++w >= NBINWORDS) return -1;
+    bits = binmap[w];
+  }
+
+  return (w << 5) + 31 - ffo(bits & -bits);
+}
+
+
+
+
+/* ----------------------------------------------------------------------
+ * Link an in use chunk into its bin's free ring and mark it as MAGIC_CFREE.
  * ---------------------------------------------------------------------- */
 static void linkfreec(struct chunk * c)
 {
   if (c->magic != MAGIC_INUSE) abort();
 
-  struct chunk * p = freering;
+  int b = binof(syssizeofc(c));
+  struct chunk * p = &bins[b];
   struct chunk * n = p->nextfree;
 
   c->nextfree = n;
@@ -191,12 +240,15 @@ static void linkfreec(struct chunk * c)
 
   p->nextfree = c;
   n->prevfree = c;
+
+  binmap[b >> 5] |= 1u << (b & 31);
 }
 
 
 
 /* ----------------------------------------------------------------------
- * Unlink a free chunk from the free ring and mark it as MAGIC_INUSE.
+ * Unlink a free chunk from its free ring and mark it as MAGIC_INUSE.
+ * The chunk's size must not have changed since it was linked.
  * ---------------------------------------------------------------------- */
 static void unlinkfreec(struct chunk * c)
 {
@@ -211,6 +263,12 @@ static void unlinkfreec(struct chunk * c)
 
   p->nextfree = n;
   n->prevfree = p;
+
+  if (p == n) {
+    /* only the ring header is left */
+    int b = p - bins;
+    binmap[b >> 5] &= ~(1u << (b & 31));
+  }
 }
 
 /* ----------------------------------------------------------------------
@@ -250,15 +308,19 @@ static void addmemarea(char * start,char * after)
 
 
 /* ----------------------------------------------------------------------
- * Initialize the freering and add a memory area.
+ * Initialize the free bins and add a memory area.
  * ---------------------------------------------------------------------- */
 static void initialize (void)
 {
-  freering->prevmem = 0;
-  freering->nextmem = 0;
-  freering->magic = MAGIC_FRING;
-  freering->prevfree = freering;
-  freering->nextfree = freering;
+  for (int b = 0;  b < NBINS;  b++) {
+    struct chunk * r = &bins[b];
+    r->prevmem = 0;
+    r->nextmem = 0;
+    r->magic = MAGIC_FRING;
+    r->prevfree = r;
+    r->nextfree = r;
+  }
+  for (int w = 0;  w < NBINWORDS;  w++) binmap[w] = 0;
 
   extern int _data_iafter;
   char * start = (char *)(4 * (int)&_data_iafter);
@@ -367,6 +429,24 @@ void malloc1_validate (void)
     }
   }
 
+  for (int b = 0;  b < NBINS;  b++) {
+    struct chunk * r = &bins[b];
+    int nonempty = (binmap[b >> 5] >> (b & 31)) & 1;
+
+    if ((r->nextfree != r) != nonempty) {
+      printf("\nmalloc_validate: bin %d bad binmap %d\n",b,nonempty);
+      abort();
+    }
+
+    for (struct chunk * c = r->nextfree;  c != r;  c = c->nextfree) {
+      if (c->magic != MAGIC_CFREE || binof(syssizeofc(c)) != b) {
+	printf("\nmalloc_validate: chunk %08x bad in bin %d\n",c,b);
+	dump_chunk(c);
+	abort();
+      }
+    }
+  }
+
 #endif /* MALLOC_VALIDATE */
 }
 
@@ -394,26 +474,38 @@ void * malloc1 (size_t size)
 
 
   /*
-   * Find the smallest free chunk of at least the size we want.
+   * Find a free chunk of at least the size we want.  A small size's own
+   * bin is an exact fit.  A large size's own bin holds chunks on either
+   * side of it, so take the smallest that fits.  Otherwise, any chunk in
+   * the first non-empty bin beyond will do.
    */
   struct chunk * bestc = 0;
   size_t bestcsyssize = 0;
-  
-  for (struct chunk * c = freering->nextfree;
-       c->magic == MAGIC_CFREE;
-       c = c->nextfree) {
+  int b = binof(syssize);
+
+  if (b >= NSMALL) {
+    for (struct chunk * c = bins[b].nextfree;
+	 c->magic == MAGIC_CFREE;
+	 c = c->nextfree) {
 
-    size_t csyssize = syssizeofc(c);
+      size_t csyssize = syssizeofc(c);
 
-    if (csyssize >= syssize) {
-      if (bestc == 0 || csyssize < bestcsyssize) {
-	bestc = c;
-	bestcsyssize = csyssize;
+      if (csyssize >= syssize) {
+	if (bestc == 0 || csyssize < bestcsyssize) {
+	  bestc = c;
+	  bestcsyssize = csyssize;
+	}
       }
     }
+    if (bestc == 0) b++;
   }
 
-  if (bestc == 0) return 0;
+  if (bestc == 0) {
+    b = nextbin(b);
+    if (b < 0) return 0;
+    bestc = bins[b].nextfree;
+    bestcsyssize = syssizeofc(bestc);
+  }
 
 
   /*
@@ -474,11 +566,12 @@ void free1 (void * addr)
   malloc1_validate();
 
   struct chunk * c = cfromaddr(addr);
-  linkfreec(c);
+  if (c->magic != MAGIC_INUSE) abort();
 
 
   /*
-   * Compact with prevmem if possible.
+   * Compact with prevmem if possible.  A free neighbour is taken out of
+   * its bin first, since its size (and so its bin) is about to change.
    */
   struct chunk * p = c->prevmem;
   if (p->magic == MAGIC_CFREE) { 
@@ -486,14 +579,12 @@ void free1 (void * addr)
     printf("compact %08x %08x\n",p,c);
 #endif
 
-    unlinkfreec(c);
+    unlinkfreec(p);
     struct chunk * n = c->nextmem;
     p->nextmem = n;
     n->prevmem = p;
 
     c = p;
-
-    malloc1_validate();
   }
 
 
@@ -511,11 +602,10 @@ void free1 (void * addr)
     struct chunk * n = c->nextmem;
     p->nextmem = n;
     n->prevmem = p;
-
-    c = p;
-
-    malloc1_validate();
   }
+
+  linkfreec(p);
+  malloc1_validate();
 }
 
 
@@ -12,44 +12,82 @@
 #include <stdio.h>
 #include "intercore.h"
 #include "network.h"
+#include "lib/msg.h"
+#include "lib/locks.h"
 
 
 // NOTE: the Ethernet controller has a few peculiarites.
 //   A) A transmit request can be rejected (because the controller's
-//      4K transmit FIFO is full), in which case it needs to be retried.
-//      This is determined only on receiving an ACK/NAK message from the
-//      controller, asynchronously.  It's important to avoid problems
-//      that could be caused by this message getting queued after incoming
-//      "packet received" messages.  We don't suffer from this, because we
-//      offload actual packet delivery to our "enetDeliver" thread.
-//      We also need to know which packet has been acked, which we achieve
-//      by only having one waiting for the ack at a time ("sendInProgress").
-//      Usually, the ACK arrives very rapidly, so this isn't a performance
-//      issue.  Having only one packet waiting for an ACK also limits how
-//      much bigger enetSendBuf must be than the 4K FIFO size.
+//      request queue or its 4K transmit FIFO is full), in which case it
+//      needs to be retried.  This is determined only on receiving an
+//      ACK/NAK message from the controller, asynchronously.  It's
+//      important to avoid problems that could be caused by this message
+//      getting queued after incoming "packet received" messages.  We don't
+//      suffer from this, because we offload actual packet delivery to our
+//      "enetDeliver" thread.
+//      We also need to know which packet has been acked.  Each request
+//      carries a tag, its index in "txRing" plus one, which the controller
+//      returns in the ACK, or negated in the NAK.  So we can have up to
+//      enetTxMax requests outstanding.  ACKs arrive in the order the
+//      controller accepted the requests, but a NAK can overtake them.
 //   B) The transmit ACK/NAK doesn't imply the packet has actually been
 //      transmitted, only that it will be.  The controller will still be
 //      doing DMA from the packet memory, and indeed it gives us no
 //      notification of when it's done.  Hence the copy into enetSendBuf,
-//      and a requirement that enetSendBuf can store more data than the
-//      controller's transmit FIFO size (4K bytes), and that we can't
-//      recycle enetSendBuf until 4K+1500 bytes have been accepted by the
-//      controller.
-//   C) Even after we've told the controller to shift to new receive memory
-//      the message queue can still deliver packets in the old memory,
-//      limited only by the amount of memory it has left.  Hence the
-//      "enetRecvBufReset" machinery.
+//      which has a buffer for each descriptor in txRing, and we retire
+//      descriptors (oldest first) only when 4K+1500 more bytes have been
+//      acked, or when there has been time for the controller to transmit
+//      that much (enetTxDrainCycles).  That time depends on the link rate,
+//      and on whether the link can be paused: hwv51's MAC.v fixes the
+//      EMAC at 1 Gb/s with flow control off, so by default we assume that,
+//      unless enet_setLinkRate says otherwise, and a pausable link adds
+//      the longest pause a single frame can ask for.  enet_sendNoCopy
+//      skips the copy by handing the client's buffer to the controller;
+//      it's then busy until its descriptor retires, and enet_free of a
+//      busy buffer is deferred until then.
+//   C) Received packets go into "rxRing", a ring of enetRxSlots buffers
+//      that the controller fills in order.  We tell it how far it may go
+//      (the "limit"), and it drops packets rather than overrun a buffer
+//      we still have.  A buffer is ours from its receive message until
+//      its up-call returns, or longer if the up-call used enet_recvHold.
+//      Buffers are released in any order, but the limit only moves past
+//      the oldest buffer once that's released, so we post it in batches
+//      of enetRxBatch, or sooner if the controller is running short.
+//      Only the lines of the received packet are invalidated, when the
+//      buffer is released and before the controller can reuse it.
 //
 // Separately, our threading machinery is non-preemptive, and incoming
 // packets can queue up while the MQ receive thread isn't executing (or is
-// doing other things).  The value of "enetRecvBufMargin" controls how much
-// can be received during this latency.  50K bytes corresponds to 500 usec
-// latency on a 1 Gb/s Ethernet delivering data continuously at full speed.
+// doing other things).  enetRxSlots controls how many can be received
+// during this latency.
 //
 // Finally, using a separate "enetDeliver" thread for delivering packets by
 // up-calls avoids the possibility of deadlock when a higher layer (e.g.
 // TCP) has called enet_send with a lock held, and ends up blocked waiting
-// for the MQ receive thread to receive its transmit ACK.
+// for the MQ receive thread to receive its transmit ACK.  The MQ thread
+// hands packets over through "pendingRing": it alone advances the tail,
+// and enetDeliver alone advances the head, so neither takes enetMutex.
+// Since threads are non-preemptive, that's all the synchronization
+// needed.  enetDeliver empties the ring before blocking on "deliverIdle",
+// so a burst of packets costs one wakeup.
+//
+// Buffers come from a pool with a pair of "magazines" of free buffers for
+// each core, as in Bonwick's slab allocator, and a depot of full and
+// empty magazines shared by all cores, under the sem_enet semaphore.  So
+// enet_alloc and enet_free lock nothing unless a core's magazines are
+// both empty or both full.  A magazine put into the depot may be taken by
+// another core, so its buffers are first flushed and invalidated.  The
+// pool grows a magazine at a time, and never shrinks.
+//
+// Application cores (2..n) can use the controller too, through
+// enet_coreInit and friends.  The controller gives each core its own MAC
+// address, differing in the low 4 bits, and puts frames addressed to it in
+// that core's own receive ring; acks for a core's transmit requests go
+// back to that core.  The controller sees only the Ethernet header, so
+// fan-out by IP addresses and ports (udp_fanOut) is done here on core 1,
+// by lending the core the buffer in rxRing with enet_forward.  The
+// application cores have no threads, so everything happens when they call
+// enet_corePoll or enet_coreSend, which drain the core's message queue.
 
 
 typedef struct EnetPending { // incoming packet delayed pending transmit ack
@@ -58,13 +96,13 @@ typedef struct EnetPending { // incoming packet delayed pending transmit ack
   Enet *buf;
   Uint32 len;
   int broadcast;
-  struct EnetPending *next;
-} *EnetPending;
+  unsigned int slot;         // index of "buf" in rxRing
+  unsigned int arrived;      // cycle counter on entry to enetReceiver
+  unsigned int queued;       // cycle counter when put on pendingRing
+} EnetPending;
 
 static Mutex enetMutex = NULL;
 static Condition enetSendCond = NULL;
-static Condition enetRecvCond = NULL;
-static Enet *enetFreeList = NULL;
 static unsigned int enetCore = 999;
 static MAC myMAC;
 static int macKnown = 0;
@@ -72,20 +110,112 @@ static Thread mqThread = NULL;
 static unsigned int enetSeed;       // current seed for enet_random
 
 // Transmission
-#define enetSendBufSize 8000
-static Octet *enetSendBuf;
-static unsigned int enetSendPos;    // next free position in enetSendBuf
-static int sendInProgress;          // waiting for a transmit ack
-IntercoreMessage sending;           // request message waiting transmit ack
+#define enetTxWords 5               // words in a transmit request
+#define enetTxDrainBytes (4096 + 1500)
+#define enetPauseBitTimes (65535 * 512) // longest pause, in bit times
+
+typedef struct EnetTx {             // transmit descriptor
+  Uint32 req[enetTxWords];          // request message, resent if rejected
+  Enet *buf;                        // client's buffer, if not copied
+  int release;                      // enet_free "buf" on retirement
+  int acked;
+  Uint32 ackedBytes;                // value of txAckedBytes after the ack
+  unsigned int ackTime;             // cycle counter at the ack
+} EnetTx;
+
+static Octet *enetSendBuf;          // a buffer for each descriptor
+static EnetTx txRing[enetTxMax];
+static unsigned int txHead;         // next descriptor to use
+static unsigned int txTail;         // oldest descriptor not yet retired
+static unsigned int txDepth;        // limit on txHead - txTail
+static int txWaiting;               // senders waiting for a descriptor
+static Uint32 txAckedBytes;         // bytes acked, ever
+static unsigned int txRejects;      // requests rejected by the controller
+static unsigned int txLinkMbps = 1000; // link rate, as set in MAC.v
+static int txPausable = 0;          // link honours pause frames
+
+// Buffer pool
+#define enetMagSize 14              // buffers per magazine
+
+typedef struct EnetMag {            // 64 bytes
+  struct EnetMag *next;             // in the depot
+  unsigned int count;
+  Enet *bufs[enetMagSize];
+} EnetMag;
+
+typedef struct EnetPool {           // a core's magazines
+  EnetMag *loaded;
+  EnetMag *previous;
+  EnetPoolStats stats;
+} __attribute__((aligned(32))) EnetPool;
+
+static EnetPool enetPools[16];      // each core touches only its own
+
+static struct {
+  EnetMag *full;
+  EnetMag *empty;
+  Uint32 buffers;                   // created, on all cores
+  Uint32 limit;                     // on "buffers"; 0 for none
+} enetDepot CACHELINE;
 
 // Reception
-#define enetRecvBufSize 100000
-#define enetRecvBufMargin 50000
-static EnetPending pendingHead = NULL;
-static EnetPending pendingTail = NULL;
-static EnetReceiver* enetProtocols; // receivers, indexed by protocol
-static Octet *enetRecvBuf;          // cache aligned
-static int enetRecvBufReset = 0;    // told controller about new memory
+#define enetRxSlots 256             // buffers in rxRing
+#define enetRxSlotSize 2048         // bytes; rxSlotLines in the controller
+#define enetRxBatch (enetRxSlots / 8) // releases posted to the controller
+#define enetRxHoldMax (enetRxSlots / 2) // held in place, not copied
+#define enetPendingSlots 512
+static EnetPending pendingRing[enetPendingSlots];
+static unsigned int pendingHead;    // next to deliver; only enetDeliver
+static unsigned int pendingTail;    // next to fill; only the MQ thread
+static struct Queue deliverIdle;    // enetDeliver, while the ring is empty
+static EnetRecvStats recvStats;
+#define enetMaxProtocols 8
+typedef struct EnetProtocol {
+  Uint16 type;
+  EnetReceiver receiver;
+} EnetProtocol;
+static EnetProtocol enetProtocols[enetMaxProtocols]; // registered receivers
+static unsigned int enetProtocolCount;
+static Octet *rxRing;               // cache aligned
+static Octet rxRefs[enetRxSlots];   // 1 until the up-call returns, + holds
+static Uint16 rxLen[enetRxSlots];   // bytes received into each buffer
+static unsigned int rxNext;         // buffer the controller fills next
+static unsigned int rxOldest;       // oldest buffer not yet released
+static unsigned int rxPosted;       // rxOldest, as last told to controller
+static unsigned int rxHeld;         // buffers held by enet_recvHold
+static EnetPending *delivering;     // frame whose up-call is in progress
+
+// Buffers lent by enet_lend
+#define enetLoansMax 64
+static Enet *loans[enetLoansMax];   // NULL if unused
+static Octet loanRelease[enetLoansMax]; // enet_free called while lent
+
+// Application cores
+#define enetCoreRxSlots 64          // buffers in each core's receive ring
+#define enetCoreFrames 64           // frames waiting for enet_corePoll
+
+typedef struct EnetCore {           // state of an application core
+  int ready;                        // enet_coreInit has been called
+  MAC mac;
+  int macKnown;
+  Octet *rxRing;                    // cache aligned
+  Octet rxBusy[enetCoreRxSlots];    // received, not yet released
+  Uint16 rxLen[enetCoreRxSlots];
+  unsigned int rxNext;              // as for core 1
+  unsigned int rxOldest;
+  unsigned int rxPosted;
+  EnetFrame frames[enetCoreFrames]; // received, for enet_corePoll
+  unsigned int frameHead;
+  unsigned int frameTail;
+  unsigned int dropped;             // frames dropped: "frames" full
+  Octet *sendBuf;                   // a buffer for each descriptor
+  EnetTx tx[enetTxMax];
+  unsigned int txHead;
+  unsigned int txTail;
+  Uint32 txAckedBytes;
+} __attribute__((aligned(32))) EnetCore;
+
+static EnetCore enetCores[16];      // each core touches only its own
 
 MAC broadcastMAC() {
   MAC res;
@@ -94,30 +224,261 @@ MAC broadcastMAC() {
   return res;
 };
 
-Enet *enet_alloc() {
-  enet_init();
-  mutex_acquire(enetMutex);
-  if (!enetFreeList) {
-    Enet *new = cacheAlign(malloc(100 * sizeof(Enet) + 31));
-    for (int i = 0; i < 100; i++) {
-      new->next = enetFreeList;
-      enetFreeList = new;
-      new++;
+static void enetDepotLock() {
+  // Private: acquire the depot, and see other cores' changes to it
+  icSema_P(sem_enet);
+  cache_invalidateMem(&enetDepot, sizeof(enetDepot));
+}
+
+static void enetDepotUnlock() {
+  // Private: publish our changes to the depot, and release it
+  cache_flushMem(&enetDepot, sizeof(enetDepot));
+  icSema_V(sem_enet);
+}
+
+static EnetMag *enetDepotTake(EnetMag **list) {
+  // Private: take a magazine from a depot list, or NULL.  Assumes the
+  // depot is locked
+  EnetMag *mag = *list;
+  if (mag) {
+    cache_invalidateMem(mag, sizeof(EnetMag));
+    *list = mag->next;
+  }
+  return mag;
+}
+
+static void enetDepotPut(EnetMag **list, EnetMag *mag) {
+  // Private: put a magazine on a depot list, first writing back and
+  // discarding its buffers and itself.  Assumes the depot is locked
+  for (unsigned int i = 0; i < mag->count; i++) {
+    cache_invalidateMem(mag->bufs[i], sizeof(Enet));
+  }
+  mag->next = *list;
+  cache_invalidateMem(mag, sizeof(EnetMag));
+  *list = mag;
+}
+
+static EnetMag *enetMagNew() {
+  // Private: an empty magazine, or NULL.  Assumes the depot is locked
+  EnetMag *mag = enetDepotTake(&enetDepot.empty);
+  if (!mag) mag = cacheAlign(malloc(sizeof(EnetMag) + 31));
+  if (mag) mag->count = 0;
+  return mag;
+}
+
+static EnetMag *enetMagGrow(unsigned int n) {
+  // Private: a magazine of "n" new buffers, or NULL if that would exceed
+  // the limit or memory is exhausted.  Assumes the depot is locked
+  if (enetDepot.limit && enetDepot.buffers + n > enetDepot.limit) return NULL;
+  Enet *new = malloc(n * sizeof(Enet) + 31);
+  if (!new) return NULL;
+  EnetMag *mag = enetMagNew();
+  if (!mag) {
+    free(new);
+    return NULL;
+  }
+  new = cacheAlign(new);
+  for (unsigned int i = 0; i < n; i++) mag->bufs[i] = &new[i];
+  mag->count = n;
+  enetDepot.buffers += n;
+  return mag;
+}
+
+static Enet *enetPoolGet() {
+  // Private: a buffer from this core's magazines, refilled from the depot
+  // or by growing the pool; NULL on failure
+  EnetPool *me = &enetPools[corenum()];
+  if (!me->loaded || me->loaded->count == 0) {
+    if (me->previous && me->previous->count > 0) {
+      EnetMag *t = me->loaded;
+      me->loaded = me->previous;
+      me->previous = t;
+    } else {
+      enetDepotLock();
+      EnetMag *mag = enetDepotTake(&enetDepot.full);
+      if (!mag) mag = enetMagGrow(enetMagSize);
+      if (mag) {
+        if (me->previous) enetDepotPut(&enetDepot.empty, me->previous);
+        me->previous = me->loaded;
+        me->loaded = mag;
+      }
+      me->stats.buffers = enetDepot.buffers;
+      enetDepotUnlock();
+      if (!mag) {
+        me->stats.failures++;
+        return NULL;
+      }
     }
   }
-  Enet *buf = enetFreeList;
-  enetFreeList = enetFreeList->next;
-  buf->next = NULL;
-  mutex_release(enetMutex);
+  Enet *buf = me->loaded->bufs[--me->loaded->count];
+  me->stats.allocs++;
+  me->stats.inUse++;
+  if (me->stats.inUse > me->stats.highWater) {
+    me->stats.highWater = me->stats.inUse;
+  }
   return buf;
 }
 
+static void enetPoolPut(Enet *buf) {
+  // Private: return a buffer to this core's magazines, passing a full one
+  // to the depot if need be.  If there's no memory for a new magazine, the
+  // buffer itself becomes one, and the pool is a buffer smaller.
+  EnetPool *me = &enetPools[corenum()];
+  if (!me->loaded || me->loaded->count == enetMagSize) {
+    if (me->previous && me->previous->count < enetMagSize) {
+      EnetMag *t = me->loaded;
+      me->loaded = me->previous;
+      me->previous = t;
+    } else {
+      enetDepotLock();
+      EnetMag *mag = enetMagNew();
+      if (!mag) {
+        mag = (EnetMag *)buf; // buffers are cache-aligned, and big enough
+        mag->count = 0;
+        enetDepot.buffers--;
+        buf = NULL;
+      }
+      if (me->previous) enetDepotPut(&enetDepot.full, me->previous);
+      me->previous = me->loaded;
+      me->loaded = mag;
+      enetDepotUnlock();
+    }
+  }
+  if (buf) me->loaded->bufs[me->loaded->count++] = buf;
+  me->stats.frees++;
+  me->stats.inUse--;
+}
+
+static EnetTx *enetTxFind(Enet *buf) {
+  // Private: return the oldest unretired descriptor sending "buf" without
+  // a copy, or NULL.  Assumes enetMutex is held
+  for (unsigned int i = txTail; i != txHead; i++) {
+    if (txRing[i % enetTxMax].buf == buf) return &txRing[i % enetTxMax];
+  }
+  return NULL;
+}
+
+static unsigned int enetTxDrainCycles() {
+  // Private: the time, in cycles, for the controller to transmit
+  // enetTxDrainBytes, allowing for a pause if the link can be paused
+  unsigned int micros = enetTxDrainBytes * 8 / txLinkMbps + 1;
+  if (txPausable) micros += enetPauseBitTimes / txLinkMbps + 1;
+  return micros * clockFrequency();
+}
+
+static Microsecs enetTxRetire() {
+  // Private: retire transmit descriptors, oldest first, once the
+  // controller must have finished reading their buffers (see note B).
+  // Returns the time until the oldest remaining one can be retired, or 0
+  // if it hasn't been acked (or there isn't one).
+  unsigned int drainCycles = enetTxDrainCycles();
+  while (txTail != txHead) {
+    EnetTx *tx = &txRing[txTail % enetTxMax];
+    if (!tx->acked) return 0;
+    unsigned int age = *cycleCounter - tx->ackTime;
+    if (txAckedBytes - tx->ackedBytes < enetTxDrainBytes &&
+  age < drainCycles) {
+      return (drainCycles - age) / clockFrequency() + 1;
+    }
+    txTail++;
+    if (tx->release) {
+      // Free the buffer, unless a later descriptor is also sending it
+      EnetTx *later = enetTxFind(tx->buf);
+      if (later) {
+        later->release = 1;
+      } else {
+        enetPoolPut(tx->buf);
+      }
+    }
+    tx->buf = NULL;
+    tx->release = 0;
+  }
+  return 0;
+}
+
+Enet *enet_alloc() {
+  Enet *buf = enetPoolGet();
+  if (buf) buf->next = NULL;
+  return buf;
+}
+
+static int enetLoanFind(Enet *buf) {
+  // Private: index of "buf" in loans, or -1.  Assumes enetMutex is held
+  for (int i = 0; i < enetLoansMax; i++) {
+    if (loans[i] == buf) return i;
+  }
+  return -1;
+}
+
 void enet_free(Enet *buf) {
+  if (corenum() == 1 && enetMutex) {
+    mutex_acquire(enetMutex);
+    EnetTx *tx = enetTxFind(buf);
+    if (tx) {
+      tx->release = 1; // still being sent; freed when tx retires
+      mutex_release(enetMutex);
+      return;
+    }
+    int loan = enetLoanFind(buf);
+    if (loan >= 0) {
+      loanRelease[loan] = 1; // freed by enet_return
+      mutex_release(enetMutex);
+      return;
+    }
+    mutex_release(enetMutex);
+  }
+  enetPoolPut(buf);
+}
+
+int enet_lend(Enet *buf) {
+  // Mark "buf" in use, as enet_busy sees it, until enet_return
   enet_init();
   mutex_acquire(enetMutex);
-  buf->next = enetFreeList;
-  enetFreeList = buf;
+  int loan = enetLoanFind(NULL);
+  if (loan >= 0) {
+    loans[loan] = buf;
+    loanRelease[loan] = 0;
+  }
+  mutex_release(enetMutex);
+  return (loan >= 0);
+}
+
+void enet_return(Enet *buf) {
+  // End a loan from enet_lend, freeing "buf" if enet_free was called.
+  // Ignored if "buf" isn't on loan.
+  mutex_acquire(enetMutex);
+  int loan = enetLoanFind(buf);
+  if (loan < 0) {
+    mutex_release(enetMutex);
+    return;
+  }
+  int release = loanRelease[loan];
+  loans[loan] = NULL;
   mutex_release(enetMutex);
+  if (release) enetPoolPut(buf);
+}
+
+void enet_setPool(unsigned int reserve, unsigned int limit) {
+  // Set the limit on buffers, and create enough to have "reserve" free
+  enetDepotLock();
+  enetDepot.limit = limit;
+  while (reserve > 0) {
+    unsigned int n = (reserve < enetMagSize ? reserve : enetMagSize);
+    EnetMag *mag = enetMagGrow(n);
+    if (!mag) break;
+    enetDepotPut(&enetDepot.full, mag);
+    reserve -= n;
+  }
+  enetDepotUnlock();
+}
+
+void enet_poolStats(EnetPoolStats *stats) {
+  // This core's pool statistics
+  EnetPool *me = &enetPools[corenum()];
+  enetDepotLock();
+  me->stats.buffers = enetDepot.buffers;
+  enetDepotUnlock();
+  *stats = me->stats;
 }
 
 MAC enet_localMAC() {
@@ -134,14 +495,73 @@ unsigned int enet_random() {
   return res;
 }
   
-static void enetReceiveRequest() {
-  // Set up a receive request for the Ethernet controller
+static int enetRxSlot(Enet *buf) {
+  // Private: index in rxRing of buffer "buf", or -1 if it isn't one
+  Octet *p = (Octet *)buf;
+  if (p < rxRing || p >= rxRing + enetRxSlots * enetRxSlotSize) return -1;
+  if ((p - rxRing) % enetRxSlotSize != 0) return -1;
+  return (p - rxRing) / enetRxSlotSize;
+}
+
+static void enetRingPost(Octet *ring, unsigned int slots,
+       unsigned int oldest, int setup) {
+  // Private: tell the controller it may fill this core's buffers in "ring"
+  // up to, but not including, the one before "oldest".  If "setup", it's
+  // the whole ring, starting from its base.
   IntercoreMessage msg;
-  msg[0] = cacheLineAddress(enetRecvBuf);
-  msg[1] = cacheLineAddress(enetRecvBuf + enetRecvBufSize - 1500 - 31) |
-    (1 << 31); // limit, and allow multicast
-  message_send(enetCore, 0, &msg, 2);
-  enetRecvBufReset = 1;
+  unsigned int limit = (oldest + slots - 1) % slots;
+  msg[0] = (setup ? cacheLineAddress(ring) : 0);
+  msg[1] = (setup ? cacheLineAddress(ring + slots * enetRxSlotSize) : 0);
+  msg[2] = cacheLineAddress(ring + limit * enetRxSlotSize) |
+    (1 << 31); // and allow multicast, if we're core 1
+  message_send(enetCorenum(), 0, &msg, 3);
+}
+
+static void enetRxPost(int setup) {
+  // Private: post core 1's ring, up to rxOldest
+  enetRingPost(rxRing, enetRxSlots, rxOldest, setup);
+  rxPosted = rxOldest;
+}
+
+static MAC enetRecvMAC(IntercoreMessage *msg) {
+  // Private: the source MAC address in a receive complete message
+  MAC res;
+  res.bytes[0] = ((*msg)[1] >> 8) & 255;
+  res.bytes[1] = (*msg)[1] & 255;
+  res.bytes[2] = ((*msg)[2] >> 24) & 255;
+  res.bytes[3] = ((*msg)[2] >> 16) & 255;
+  res.bytes[4] = ((*msg)[2] >> 8) & 255;
+  res.bytes[5] = (*msg)[2] & 255;
+  return res;
+}
+
+static void enetTxRequest(EnetTx *tx, Octet *data, MAC dest, Uint16 type,
+        Uint32 len, unsigned int tag) {
+  // Private: fill in the request message to transmit "len" bytes from
+  // "data", which the caller has flushed from the data cache
+  tx->req[0] = cacheLineAddress(data);
+  tx->req[1] = (2 << 19) | (corenum() << 15) | (len << 4) | 1;
+  tx->req[2] = (dest.bytes[0] << 24) | (dest.bytes[1] << 16) |
+    (dest.bytes[2] << 8) | dest.bytes[3];
+  tx->req[3] = (dest.bytes[4] << 24) | (dest.bytes[5] << 16) |
+    (type & 65535);
+  tx->req[4] = tag;
+}
+
+static void enetRxRelease(unsigned int slot) {
+  // Private: drop a reference to a receive buffer, and when the oldest
+  // buffers are free tell the controller, if a batch is ready or it's
+  // running short.  Called only by core 1 threads, and doesn't block.
+  if (--rxRefs[slot] > 0) return;
+  cache_invalidateMem(rxRing + slot * enetRxSlotSize, rxLen[slot]);
+  while (rxOldest != rxNext && rxRefs[rxOldest] == 0) {
+    rxOldest = (rxOldest + 1) % enetRxSlots;
+  }
+  unsigned int ready = (rxOldest + enetRxSlots - rxPosted) % enetRxSlots;
+  unsigned int room = (rxPosted + enetRxSlots - 1 - rxNext) % enetRxSlots;
+  if (ready >= enetRxBatch || (ready > 0 && room < enetRxBatch)) {
+    enetRxPost(0);
+  }
 }
 
 static void enetDiscard(MAC srce, Uint16 type, Enet *buf, Uint32 len,
@@ -150,21 +570,38 @@ static void enetDiscard(MAC srce, Uint16 type, Enet *buf, Uint32 len,
   // Note: 0 to 0x05DC are 802.3 length fields.  We don't do 802.3
 }
 
+static EnetReceiver enetLookup(Uint16 type) {
+  // Private: receiver for an Ethernet protocol.  There are only a few
+  // (ARP and IP, usually), so a scan beats any table.
+  for (unsigned int i = 0; i < enetProtocolCount; i++) {
+    if (enetProtocols[i].type == type) return enetProtocols[i].receiver;
+  }
+  return enetDiscard;
+}
+
 static void enetDeliver(void * arg) {
   // Our forked thread for deliverng packets by up-calls.
   //
   // Necessary to avoid deadlocks related to MQ thread and packet
   // transmission acks.
   for (;;) {
-    mutex_acquire(enetMutex);
-    while (!pendingHead) condition_wait(enetRecvCond, enetMutex);
-    EnetPending this = pendingHead;
-    pendingHead = pendingHead->next;
-    EnetReceiver r = enetProtocols[this->type];
-    mutex_release(enetMutex);
-    if (r) r(this->fromMAC, this->type, this->buf, this->len,
-       this->broadcast);
-    free(this);
+    while (pendingHead != pendingTail) {
+      EnetPending *this = &pendingRing[pendingHead % enetPendingSlots];
+      unsigned int start = *cycleCounter;
+      EnetReceiver r = enetLookup(this->type);
+      delivering = this;
+      if (r) r(this->fromMAC, this->type, this->buf, this->len,
+         this->broadcast);
+      delivering = NULL;
+      recvStats.upcallCycles += *cycleCounter - start;
+      recvStats.receiveCycles += this->queued - this->arrived;
+      recvStats.handoffCycles += start - this->queued;
+      recvStats.packets++;
+      enetRxRelease(this->slot);
+      pendingHead++;
+    }
+    if (rxOldest != rxPosted) enetRxPost(0);
+    queue_block(&deliverIdle, 0);
   }
 }
 
@@ -175,16 +612,60 @@ static void enetReceiver(unsigned int srce, unsigned int type,
   // Note that calling enet_send from this thread can deadlock (which we
   // detect).
   //
-  mutex_acquire(enetMutex);
   if (!mqThread) mqThread = thread_self();
+  if (len == 4) {
+    // Receive complete.  Only this thread touches pendingTail and
+    // rxNext, so this doesn't need enetMutex.
+    unsigned int arrived = *cycleCounter;
+    enetSeed += arrived;
+    Enet *buf = (Enet *)((*msg)[3] << 5);
+    Uint32 pktLen = (*msg)[0];
+    int slot = enetRxSlot(buf);
+    if (slot < 0) {
+      printf("Unexpected receive buffer %08x\n", (unsigned int)buf);
+      return;
+    }
+    rxNext = (slot + 1) % enetRxSlots;
+    rxRefs[slot] = 1;
+    rxLen[slot] = pktLen;
+    if (pendingTail - pendingHead == enetPendingSlots) {
+      recvStats.dropped++;
+      enetRxRelease(slot);
+      return;
+    }
+    EnetPending *recvdPkt = &pendingRing[pendingTail % enetPendingSlots];
+    recvdPkt->fromMAC = enetRecvMAC(msg);
+    recvdPkt->type = (*msg)[1] >> 16;
+    recvdPkt->buf = buf;
+    recvdPkt->len = pktLen;
+    recvdPkt->broadcast = (*msg)[3] >> 31;
+    recvdPkt->slot = slot;
+    recvdPkt->arrived = arrived;
+    recvdPkt->queued = *cycleCounter;
+    pendingTail++;
+    if (!queue_isEmpty(&deliverIdle)) queue_unblock(&deliverIdle);
+    return;
+  }
+  mutex_acquire(enetMutex);
   if (len == 1) {
-    // Transmit ack
-    if ((*msg)[0] == 0) {
-      printf("Send failed\n");
-      message_send(enetCore, 0, &sending, 4);
+    // Transmit ack, or negated if the request was rejected
+    int tag = (*msg)[0];
+    int index = (tag < 0 ? -tag : tag) - 1;
+    if (index < 0 || index >= enetTxMax) {
+      printf("Unexpected transmit ack %d\n", tag);
+    } else if (tag < 0) {
+      txRejects++;
+      message_send(enetCore, 0, (IntercoreMessage *)txRing[index].req,
+       enetTxWords);
     } else {
-      sendInProgress = 0;
-      condition_signal(enetSendCond);
+      EnetTx *tx = &txRing[index];
+      txAckedBytes += (tx->req[1] >> 4) & 2047;
+      tx->acked = 1;
+      tx->ackedBytes = txAckedBytes;
+      tx->ackTime = *cycleCounter;
+      unsigned int oldTail = txTail;
+      enetTxRetire();
+      if (txTail != oldTail && txWaiting) condition_broadcast(enetSendCond);
     }
   } else if (len == 2) {
     // MAC response
@@ -196,40 +677,6 @@ static void enetReceiver(unsigned int srce, unsigned int type,
     myMAC.bytes[5] = (*msg)[1] & 255;
     macKnown = 1;
     condition_signal(enetSendCond);
-  } else if (len == 4) {
-    // Receive complete
-    enetSeed += *cycleCounter;
-    EnetPending recvdPkt = malloc(sizeof(struct EnetPending));
-    // TEMP: should avoid the malloc in the common case
-    recvdPkt->fromMAC.bytes[0] = ((*msg)[1] >> 8) & 255;
-    recvdPkt->fromMAC.bytes[1] = (*msg)[1] & 255;
-    recvdPkt->fromMAC.bytes[2] = ((*msg)[2] >> 24) & 255;
-    recvdPkt->fromMAC.bytes[3] = ((*msg)[2] >> 16) & 255;
-    recvdPkt->fromMAC.bytes[4] = ((*msg)[2] >> 8) & 255;
-    recvdPkt->fromMAC.bytes[5] = (*msg)[2] & 255;
-    recvdPkt->type = (*msg)[1] >> 16;
-    recvdPkt->buf = (Enet *)((*msg)[3] << 5);
-    recvdPkt->len = (*msg)[0];
-    recvdPkt->broadcast = (*msg)[3] >> 31;
-    recvdPkt->next = NULL;
-    if ((Octet *)recvdPkt->buf == enetRecvBuf) {
-      enetRecvBufReset = 0;
-      cache_invalidateMem(enetRecvBuf, enetRecvBufSize);
-      // The invalidate is more efficient done all at once, since
-      // enetRecvBuf is much larger than the data cache.
-    }
-    if ((unsigned int)(recvdPkt->buf) + recvdPkt->len -
-  (unsigned int)enetRecvBuf > enetRecvBufSize - enetRecvBufMargin &&
-  !enetRecvBufReset) {
-      enetReceiveRequest();
-    }
-    if (pendingHead) {
-      pendingTail->next = recvdPkt;
-    } else {
-      pendingHead = recvdPkt;
-    }
-    pendingTail = recvdPkt;
-    condition_signal(enetRecvCond);
   } else {
     printf("Unexpected Enet message length %d\n", len);
   }
@@ -240,37 +687,163 @@ void enet_register(Uint16 protocol, EnetReceiver receiver) {
 // Register up-call handler for an Ethernet protocol; NULL to disable
   enet_init();
   mutex_acquire(enetMutex);
-  enetProtocols[protocol] = (receiver ? receiver : enetDiscard);
+  unsigned int i = 0;
+  while (i < enetProtocolCount && enetProtocols[i].type != protocol) i++;
+  if (receiver) {
+    if (i == enetMaxProtocols) {
+      printf("Too many Ethernet protocols\n");
+    } else {
+      if (i == enetProtocolCount) enetProtocolCount++;
+      enetProtocols[i].type = protocol;
+      enetProtocols[i].receiver = receiver;
+    }
+  } else if (i < enetProtocolCount) {
+    enetProtocolCount--;
+    enetProtocols[i] = enetProtocols[enetProtocolCount];
+  }
   mutex_release(enetMutex);
 }
 
-void enet_send(MAC dest, Uint16 type, Enet *buf, Uint32 len) {
-  // Send a raw Ethernet packet
+static void enetTransmit(MAC dest, Uint16 type, Enet *buf, Uint32 len,
+       int copy) {
+  // Private: queue a transmit request for the controller, sending from
+  // "buf" itself unless "copy".
+  //
+  // Blocks only while txDepth requests are outstanding.
   //
   if (len < 60) len = 60;
-  enet_init();
-  Octet *mySendBuf;
   mutex_acquire(enetMutex);
-  while (sendInProgress) {
+  for (;;) {
+    Microsecs wait = enetTxRetire();
+    if (txHead - txTail < txDepth) break;
     if (thread_self() == mqThread) {
       printf("Blocking enet_send from MQ thread.  Deadlock\n");
     }
-    condition_wait(enetSendCond, enetMutex);
+    txWaiting++;
+    if (wait) {
+      condition_timedWait(enetSendCond, enetMutex, wait);
+    } else {
+      condition_wait(enetSendCond, enetMutex);
+    }
+    txWaiting--;
   }
-  sendInProgress = 1;
-  mySendBuf = &(enetSendBuf[enetSendPos]);
-  enetSendPos = cacheMultiple(enetSendPos + len);
-  if (enetSendPos + sizeof(Enet) > enetSendBufSize) enetSendPos = 0;
+  unsigned int index = txHead % enetTxMax;
+  txHead++;
+  EnetTx *tx = &txRing[index];
+  tx->acked = 0;
+  tx->buf = (copy ? NULL : buf);
   mutex_release(enetMutex);
-  bcopy(buf, mySendBuf, len);
+  Octet *mySendBuf = (Octet *)buf;
+  if (copy) {
+    mySendBuf = &(enetSendBuf[index * sizeof(Enet)]);
+    bcopy(buf, mySendBuf, len);
+  }
   cache_flushMem(mySendBuf, len);
-  sending[0] = cacheLineAddress(mySendBuf);
-  sending[1] = (2 << 19) | (corenum() << 15) | (len << 4) | 1;
-  sending[2] = (dest.bytes[0] << 24) | (dest.bytes[1] << 16) |
-    (dest.bytes[2] << 8) | dest.bytes[3];
-  sending[3] = (dest.bytes[4] << 24) | (dest.bytes[5] << 16) |
-    (type & 65535);
-  message_send(enetCore, 0, &sending, 4);
+  enetTxRequest(tx, mySendBuf, dest, type, len, index + 1);
+  message_send(enetCore, 0, (IntercoreMessage *)tx->req, enetTxWords);
+}
+
+void enet_send(MAC dest, Uint16 type, Enet *buf, Uint32 len) {
+  // Send a raw Ethernet packet
+  enet_init();
+  enetTransmit(dest, type, buf, len, 1);
+}
+
+void enet_sendNoCopy(MAC dest, Uint16 type, Enet *buf, Uint32 len) {
+  // Send a raw Ethernet packet directly from "buf", if it's cache aligned
+  enet_init();
+  enetTransmit(dest, type, buf, len, ((Uint32)buf & 31) != 0);
+}
+
+int enet_busy(Enet *buf) {
+  // Return true iff "buf" is still being sent by enet_sendNoCopy
+  enet_init();
+  mutex_acquire(enetMutex);
+  enetTxRetire();
+  int res = (enetTxFind(buf) != NULL || enetLoanFind(buf) >= 0);
+  mutex_release(enetMutex);
+  return res;
+}
+
+void enet_setTxDepth(int depth) {
+  // Limit the transmit requests outstanding to "depth"
+  enet_init();
+  mutex_acquire(enetMutex);
+  txDepth = (depth < 1 ? 1 : (depth > enetTxMax ? enetTxMax : depth));
+  if (txWaiting) condition_broadcast(enetSendCond);
+  mutex_release(enetMutex);
+}
+
+void enet_setLinkRate(unsigned int mbps, int pausable) {
+  // Set the link rate and pause capability assumed by enetTxDrainCycles
+  txLinkMbps = (mbps < 10 ? 10 : (mbps > 10000 ? 10000 : mbps));
+  txPausable = pausable;
+}
+
+Enet *enet_recvHold(Enet *buf, Uint32 len) {
+  // Keep a received buffer after its up-call returns.  Too many held in
+  // place would leave the controller short, so beyond that we copy.
+  enet_init();
+  int slot = enetRxSlot(buf);
+  if (slot >= 0 && rxHeld < enetRxHoldMax) {
+    rxRefs[slot]++;
+    rxHeld++;
+    return buf;
+  }
+  Enet *copy = enet_alloc();
+  if (copy) bcopy(buf, copy, len);
+  return copy;
+}
+
+void enet_recvRelease(Enet *buf) {
+  // Give back a buffer from enet_recvHold
+  enet_init();
+  int slot = enetRxSlot(buf);
+  if (slot < 0) {
+    enet_free(buf);
+  } else {
+    rxHeld--;
+    enetRxRelease(slot);
+  }
+}
+
+static void enetForwardDone(unsigned int srce, unsigned int type,
+          IntercoreMessage *msg, unsigned int len) {
+  // Up-call when an application core gives back a frame from enet_forward
+  enet_recvRelease((Enet *)(*msg)[0]);
+}
+
+void enet_forward(unsigned int core, Enet *buf) {
+  // Lend the frame being delivered in "buf" to an application core
+  EnetPending *p = delivering;
+  if (!p || p->buf != buf) {
+    printf("enet_forward outside the frame's up-call\n");
+    return;
+  }
+  Enet *lent = enet_recvHold(buf, p->len);
+  if (!lent) return; // no buffer for a copy: dropped
+  cache_flushMem(lent, p->len);
+  IntercoreMessage msg;
+  msg[0] = p->len;
+  msg[1] = (p->type << 16) | (p->fromMAC.bytes[0] << 8) |
+    p->fromMAC.bytes[1];
+  msg[2] = (p->fromMAC.bytes[2] << 24) | (p->fromMAC.bytes[3] << 16) |
+    (p->fromMAC.bytes[4] << 8) | p->fromMAC.bytes[5];
+  msg[3] = cacheLineAddress(lent) | (p->broadcast << 31);
+  message_send(core, msgTypeEnet, &msg, 4);
+}
+
+void enet_recvStats(EnetRecvStats *stats, int reset) {
+  // Copy out the receive path statistics, then maybe reset them
+  enet_init();
+  *stats = recvStats;
+  if (reset) memset(&recvStats, 0, sizeof(recvStats));
+}
+
+unsigned int enet_txRejects() {
+  // Count of transmit requests rejected by the controller, and retried
+  enet_init();
+  return txRejects;
 }
 
 void enet_init() {
@@ -278,21 +851,35 @@ void enet_init() {
   if (!enetMutex) {
     enetMutex = mutex_create();
     enetSendCond = condition_create();
-    enetRecvCond = condition_create();
     mutex_acquire(enetMutex);
-    enetFreeList = NULL;
     enetSeed = *cycleCounter;
     enetCore = enetCorenum();
-    enetProtocols = malloc(65536 * sizeof(EnetReceiver));
-    for (int i = 0; i < 65535; i++) enetProtocols[i] = enetDiscard;
+    enetProtocolCount = 0;
     mq_register(enetCore, enetReceiver);
-    enetSendBuf = cacheAlign(malloc(enetSendBufSize + 31));
-    enetSendPos = 0;
-    sendInProgress = 0;
-    pendingHead = NULL;
-    pendingTail = NULL;
-    enetRecvBuf = cacheAlign(malloc(enetRecvBufSize + 31));
-    enetReceiveRequest();
+    for (unsigned int i = 2; i < enetCore; i++) {
+      mq_registerType(i, msgTypeEnet, enetForwardDone);
+    }
+    enetSendBuf = cacheAlign(malloc(enetTxMax * sizeof(Enet) + 31));
+    txHead = 0;
+    txTail = 0;
+    txDepth = enetTxMax;
+    txWaiting = 0;
+    txAckedBytes = 0;
+    txRejects = 0;
+    for (int i = 0; i < enetTxMax; i++) {
+      txRing[i].buf = NULL;
+      txRing[i].release = 0;
+    }
+    pendingHead = 0;
+    pendingTail = 0;
+    queue_init(&deliverIdle);
+    rxRing = cacheAlign(malloc(enetRxSlots * enetRxSlotSize + 31));
+    cache_invalidateMem(rxRing, enetRxSlots * enetRxSlotSize);
+    for (int i = 0; i < enetRxSlots; i++) rxRefs[i] = 0;
+    rxNext = 0;
+    rxOldest = 0;
+    rxHeld = 0;
+    enetRxPost(1);
     thread_fork(enetDeliver, NULL);
     IntercoreMessage msg;
     message_send(enetCore, 0, &msg, 1);
@@ -300,3 +887,183 @@ void enet_init() {
     mutex_release(enetMutex);
   }
 }
+
+
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+// Application cores                                                      //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+static void enetCoreKeep(EnetCore *me, EnetFrame *f) {
+  // Private: keep a received frame for enet_corePoll, or drop it
+  if (me->frameTail - me->frameHead == enetCoreFrames) {
+    me->dropped++;
+    enet_coreRelease(f);
+  } else {
+    me->frames[me->frameTail % enetCoreFrames] = *f;
+    me->frameTail++;
+  }
+}
+
+static void enetCoreRetire(EnetCore *me) {
+  // Private: retire transmit descriptors, as enetTxRetire does
+  unsigned int drainCycles = enetTxDrainCycles();
+  while (me->txTail != me->txHead) {
+    EnetTx *tx = &me->tx[me->txTail % enetTxMax];
+    if (!tx->acked) return;
+    if (me->txAckedBytes - tx->ackedBytes < enetTxDrainBytes &&
+  *cycleCounter - tx->ackTime < drainCycles) return;
+    me->txTail++;
+  }
+}
+
+static void enetCoreDrain(EnetCore *me) {
+  // Private: process every message waiting for this core.  Anything that
+  // isn't from the controller or a frame from core 1 is dropped.
+  IntercoreMessage msg;
+  unsigned int status;
+  while ((status = message_recv(&msg)) != 0) {
+    unsigned int srce = message_srce(status);
+    unsigned int len = message_len(status);
+    if (len == 4 && (srce == enetCorenum() ||
+         (srce == 1 && message_type(status) == msgTypeEnet))) {
+      // Receive complete, or a frame lent by core 1
+      EnetFrame f;
+      f.srce = enetRecvMAC(&msg);
+      f.type = msg[1] >> 16;
+      f.buf = (Enet *)(msg[3] << 5);
+      f.len = msg[0];
+      f.broadcast = msg[3] >> 31;
+      f.from = srce;
+      if (srce == 1) {
+        cache_invalidateMem(f.buf, f.len);
+      } else {
+        unsigned int slot = ((Octet *)f.buf - me->rxRing) / enetRxSlotSize;
+        me->rxNext = (slot + 1) % enetCoreRxSlots;
+        me->rxBusy[slot] = 1;
+        me->rxLen[slot] = f.len;
+      }
+      enetCoreKeep(me, &f);
+    } else if (srce != enetCorenum()) {
+      printf("[%02u]: enet: dropped message type %u from core %u\n",
+       corenum(), message_type(status), srce);
+    } else if (len == 1) {
+      // Transmit ack, or negated if the request was rejected
+      int tag = msg[0];
+      int index = (tag < 0 ? -tag : tag) - 1;
+      if (index < 0 || index >= enetTxMax) {
+  printf("[%02u]: unexpected transmit ack %d\n", corenum(), tag);
+      } else if (tag < 0) {
+  message_send(srce, 0, (IntercoreMessage *)me->tx[index].req,
+         enetTxWords);
+      } else {
+  EnetTx *tx = &me->tx[index];
+  me->txAckedBytes += (tx->req[1] >> 4) & 2047;
+  tx->acked = 1;
+  tx->ackedBytes = me->txAckedBytes;
+  tx->ackTime = *cycleCounter;
+      }
+    } else if (len == 2) {
+      // MAC response
+      me->mac.bytes[0] = msg[0] >> 24;
+      me->mac.bytes[1] = (msg[0] >> 16) & 255;
+      me->mac.bytes[2] = (msg[0] >> 8) & 255;
+      me->mac.bytes[3] = msg[0] & 255;
+      me->mac.bytes[4] = (msg[1] >> 8) & 255;
+      me->mac.bytes[5] = msg[1] & 255;
+      me->macKnown = 1;
+    } else {
+      printf("[%02u]: unexpected Enet message length %d\n", corenum(), len);
+    }
+  }
+}
+
+void enet_coreInit() {
+  // Set up this application core's receive ring, and get its MAC address
+  EnetCore *me = &enetCores[corenum()];
+  if (me->ready) return;
+  me->rxRing = cacheAlign(malloc(enetCoreRxSlots * enetRxSlotSize + 31));
+  me->sendBuf = cacheAlign(malloc(enetTxMax * sizeof(Enet) + 31));
+  cache_invalidateMem(me->rxRing, enetCoreRxSlots * enetRxSlotSize);
+  for (int i = 0; i < enetCoreRxSlots; i++) me->rxBusy[i] = 0;
+  me->rxNext = 0;
+  me->rxOldest = 0;
+  me->rxPosted = 0;
+  me->frameHead = 0;
+  me->frameTail = 0;
+  me->dropped = 0;
+  me->txHead = 0;
+  me->txTail = 0;
+  me->txAckedBytes = 0;
+  me->macKnown = 0;
+  me->ready = 1;
+  enetRingPost(me->rxRing, enetCoreRxSlots, 0, 1);
+  IntercoreMessage msg;
+  message_send(enetCorenum(), 0, &msg, 1);
+  while (!me->macKnown) enetCoreDrain(me);
+}
+
+MAC enet_coreMAC() {
+  // This application core's MAC address
+  enet_coreInit();
+  return enetCores[corenum()].mac;
+}
+
+int enet_corePoll(EnetFrame *f) {
+  // Take the next received frame, if there is one
+  enet_coreInit();
+  EnetCore *me = &enetCores[corenum()];
+  enetCoreDrain(me);
+  if (me->frameHead == me->frameTail) return 0;
+  *f = me->frames[me->frameHead % enetCoreFrames];
+  me->frameHead++;
+  return 1;
+}
+
+void enet_coreRelease(EnetFrame *f) {
+  // Give back a frame's buffer: to core 1 if it was lent, else to the
+  // controller, in batches as for core 1's ring
+  EnetCore *me = &enetCores[corenum()];
+  cache_invalidateMem(f->buf, f->len);
+  if (f->from == 1) {
+    IntercoreMessage msg;
+    msg[0] = (Uint32)f->buf;
+    message_send(1, msgTypeEnet, &msg, 1);
+    return;
+  }
+  me->rxBusy[((Octet *)f->buf - me->rxRing) / enetRxSlotSize] = 0;
+  while (me->rxOldest != me->rxNext && !me->rxBusy[me->rxOldest]) {
+    me->rxOldest = (me->rxOldest + 1) % enetCoreRxSlots;
+  }
+  unsigned int ready =
+    (me->rxOldest + enetCoreRxSlots - me->rxPosted) % enetCoreRxSlots;
+  unsigned int room =
+    (me->rxPosted + enetCoreRxSlots - 1 - me->rxNext) % enetCoreRxSlots;
+  if (ready >= enetCoreRxSlots / 8 ||
+      (ready > 0 && room < enetCoreRxSlots / 8)) {
+    enetRingPost(me->rxRing, enetCoreRxSlots, me->rxOldest, 0);
+    me->rxPosted = me->rxOldest;
+  }
+}
+
+void enet_coreSend(MAC dest, Uint16 type, Enet *buf, Uint32 len) {
+  // Send a raw Ethernet packet from this application core, copying it
+  enet_coreInit();
+  EnetCore *me = &enetCores[corenum()];
+  if (len < 60) len = 60;
+  for (;;) {
+    enetCoreDrain(me);
+    enetCoreRetire(me);
+    if (me->txHead - me->txTail < enetTxMax) break;
+  }
+  unsigned int index = me->txHead % enetTxMax;
+  me->txHead++;
+  EnetTx *tx = &me->tx[index];
+  tx->acked = 0;
+  Octet *data = me->sendBuf + index * sizeof(Enet);
+  bcopy(buf, data, len);
+  cache_flushMem(data, len);
+  enetTxRequest(tx, data, dest, type, len, index + 1);
+  message_send(enetCorenum(), 0, (IntercoreMessage *)tx->req, enetTxWords);
+}
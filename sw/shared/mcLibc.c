@@ -3,7 +3,8 @@
 // mcLib.c                                                                //
 //                                                                        //
 // This module provides other cores with access to putchar on the RS232   //
-// line, and "malloc" and "free", by inter-core messaging to core #1.     //
+// line, by inter-core messaging to core #1, and "malloc" and "free",     //
+// from a per-core arena or by messaging to core #1.                      //
 //                                                                        //
 ////////////////////////////////////////////////////////////////////////////
 
@@ -13,6 +14,7 @@
 #include <string.h>
 #include "shared/intercore.h"
 #include "shared/network.h"
+#include "lib/locks.h"
 #include "lib/msg.h"
 
 //
@@ -66,36 +68,37 @@ static void setResponse(int core, int n) {
 
 static void rpcServer(unsigned int core, unsigned int type,
     MQMessage *msg, unsigned int len) {
-  // Handler for messages at core #1
-  if (type == msgTypeRPC) {
-    int id = (*msg)[0];
-    switch (id) {
-    case mcPutchar:
-      putchar((*msg)[1]);
-      setResponse(core, 0);
-      break;
-    case mcMalloc: {
-      size_t size = (*msg)[1];
-      void *res = malloc(size);
-      if (res) cache_flushMem(res, size);
-      setResponse(core, (unsigned int)(res));
-      break;
-    }
-    case mcFree:
-      free((void *)((*msg)[1]));
-      setResponse(core, 0);
-      break;
-    }
+  // Handler for msgTypeRPC messages at core #1
+  int id = (*msg)[0];
+  switch (id) {
+  case mcPutchar:
+    putchar((*msg)[1]);
+    setResponse(core, 0);
+    break;
+  case mcMalloc: {
+    size_t size = (*msg)[1];
+    void *res = malloc(size);
+    if (res) cache_flushMem(res, size);
+    setResponse(core, (unsigned int)(res));
+    break;
+  }
+  case mcFree:
+    free((void *)((*msg)[1]));
+    setResponse(core, 0);
+    break;
   }
 }
 
+static void initArenas();
+
 void mc_initRPC() {
   int nCores = enetCorenum();
+  initArenas();
   responseAreas = malloc(nCores * sizeof(int *));
   cache_flushMem(&responseAreas, sizeof(int **));
   for (int core = 2; core < nCores; core++) {
     responseAreas[core] = malloc(sizeof(int));
-    mq_register(core, rpcServer);
+    mq_registerType(core, msgTypeRPC, rpcServer);
   }
   cache_flushMem(responseAreas, nCores * sizeof(int *));
 }
@@ -128,30 +131,239 @@ int putchar(int c) {
 void *malloc1(size_t size);
 void free1(void *ptr);
 
-void *malloc(size_t size) {
+void *mc_rpcMalloc(size_t size) {
+  // Allocate from core #1's heap, by RPC if necessary
+  if (corenum() == 1) return malloc(size);
+  clearResponse();
+  IntercoreMessage msg;
+  msg[0] = mcMalloc;
+  msg[1] = size;
+  message_send(1, msgTypeRPC, &msg, 2);
+  void *res = (void *)getResponse();
+  if (res) cache_invalidateMem(res, size);
+  return res;
+}
+
+void mc_rpcFree(void *ptr) {
+  // Free to core #1's heap, by RPC if necessary
   if (corenum() == 1) {
-    return (void *) ((int) malloc1(5*4 + size) + 5*4);
+    free(ptr);
   } else {
     clearResponse();
     IntercoreMessage msg;
-    msg[0] = mcMalloc;
-    msg[1] = size;
+    msg[0] = mcFree;
+    msg[1] = (unsigned int)ptr;
     message_send(1, msgTypeRPC, &msg, 2);
-    void *res = (void *)getResponse();
-    if (res) cache_invalidateMem(res, size);
+    getResponse();
+  }
+}
+
+
+//
+// Per-core heap arenas
+//
+
+// Each of cores 2..n owns an arena of mcArenaSize bytes, carved from core
+// #1's heap by mc_initRPC.  The arena is divided into pages of mcPageSize
+// bytes, each holding blocks of a single power-of-two size class from 32
+// to 2048 bytes, so blocks are always cache line aligned.  Larger requests,
+// and requests once the arena is used up, go to core #1 by RPC.
+//
+// A block freed by a core other than its owner (core #1 for blocks outside
+// the arenas) is pushed onto the owner's "remoteFrees" list, under the
+// sem_malloc inter-core semaphore.  The owner takes the whole list when it
+// next runs out of blocks in some class (core #1: on each malloc).  The
+// list is linked through the first word of each block.  The freeing core
+// flushes the whole block first, so none of its dirty lines can later be
+// written back over the next owner's data; it finds the size from the
+// page's class, or for core #1's blocks from the word before the block.
+//
+// Only the owner ever writes its Arena structure, so that needs no
+// locking, and no cache flushing except where blocks are handed out and
+// where a page's class is set.
+
+#define mcArenaSize (2 << 20)
+#define mcPageSize 4096
+#define mcArenaPages (mcArenaSize / mcPageSize)
+#define mcMinShift 5
+#define mcClasses 7
+#define mcMaxSmall (1 << (mcMinShift + mcClasses - 1))
+#define mcHeapOffset (5*4)
+
+typedef struct Arena {
+  void *freeLists[mcClasses];             // free blocks, by size class
+  char *nextPage;                         // first page never used
+  unsigned char pageClass[mcArenaPages];  // size class of each used page
+} Arena;
+
+typedef struct RemoteFree {
+  void *head;                             // blocks freed by other cores
+  unsigned int pad[7];                    // one per cache line
+} RemoteFree;
+
+static char *arenaBase CACHELINE = NULL;  // arena for core 2
+static char *arenaLimit CACHELINE = NULL; // end of arena for core n
+static RemoteFree remoteFrees[16] CACHELINE;
+
+static void initArenas() {
+  // Carve the arenas for cores 2..n from our heap.  Called in core #1
+  // before the other cores start.
+  int nCores = enetCorenum();
+  for (int core = 0; core < 16; core++) remoteFrees[core].head = NULL;
+  cache_flushMem(remoteFrees, sizeof(remoteFrees));
+  char *base = malloc((nCores - 2) * mcArenaSize + 31);
+  if (base) {
+    base = cacheAlign(base);
+    for (int core = 2; core < nCores; core++) {
+      Arena *a = (Arena *)(base + (core - 2) * mcArenaSize);
+      for (int i = 0; i < mcClasses; i++) a->freeLists[i] = NULL;
+      a->nextPage = (char *)a +
+        (sizeof(Arena) + mcPageSize - 1) / mcPageSize * mcPageSize;
+      cache_flushMem(a, sizeof(Arena));
+    }
+    arenaBase = base;
+    arenaLimit = base + (nCores - 2) * mcArenaSize;
+  }
+  cache_flushMem(&arenaBase, sizeof(char *));
+  cache_flushMem(&arenaLimit, sizeof(char *));
+}
+
+static int arenaOwner(void *ptr) {
+  // Return the core that owns the block at ptr
+  if ((char *)ptr >= arenaBase && (char *)ptr < arenaLimit) {
+    return 2 + ((char *)ptr - arenaBase) / mcArenaSize;
+  }
+  return 1;
+}
+
+static Arena *myArena() {
+  return (Arena *)(arenaBase + (corenum() - 2) * mcArenaSize);
+}
+
+static size_t blockSize(int owner, void *ptr) {
+  // Return the size of the block at ptr, owned by "owner"
+  if (owner == 1) {
+    size_t *size = (size_t *)ptr - 1;
+    cache_invalidateMem(size, sizeof(size_t));
+    return *size;
+  }
+  char *a = arenaBase + (owner - 2) * mcArenaSize;
+  unsigned char *class =
+    &((Arena *)a)->pageClass[((char *)ptr - a) / mcPageSize];
+  cache_invalidateMem(class, 1);
+  return 1 << (*class + mcMinShift);
+}
+
+static void remoteFree(int owner, void *ptr) {
+  // Push ptr onto the owner's remote free list
+  RemoteFree *rf = &remoteFrees[owner];
+  size_t size = blockSize(owner, ptr);
+  icSema_P(sem_malloc);
+  cache_invalidateMem(rf, sizeof(void *));
+  *(void **)ptr = rf->head;
+  cache_flushMem(ptr, size);
+  rf->head = ptr;
+  cache_flushMem(rf, sizeof(void *));
+  icSema_V(sem_malloc);
+}
+
+static void *takeRemoteFrees() {
+  // Remove and return the list of blocks other cores have freed for us
+  RemoteFree *rf = &remoteFrees[corenum()];
+  cache_invalidateMem(rf, sizeof(void *));
+  if (!rf->head) return NULL;
+  icSema_P(sem_malloc);
+  cache_invalidateMem(rf, sizeof(void *));
+  void *list = rf->head;
+  rf->head = NULL;
+  cache_flushMem(rf, sizeof(void *));
+  icSema_V(sem_malloc);
+  return list;
+}
+
+static void *nextRemoteFree(void *ptr) {
+  // Return the block after ptr on a list from takeRemoteFrees
+  cache_invalidateMem(ptr, sizeof(void *));
+  return *(void **)ptr;
+}
+
+static void arenaFree(Arena *a, void *ptr) {
+  // Return one of our own blocks to its free list
+  int class = a->pageClass[((char *)ptr - (char *)a) / mcPageSize];
+  *(void **)ptr = a->freeLists[class];
+  a->freeLists[class] = ptr;
+}
+
+static void arenaRefill(Arena *a, int class) {
+  // Find some free blocks of the given class: first from the remote free
+  // list, then by carving a fresh page.
+  void *next;
+  for (void *ptr = takeRemoteFrees(); ptr; ptr = next) {
+    next = nextRemoteFree(ptr);
+    arenaFree(a, ptr);
+  }
+  if (a->freeLists[class]) return;
+  if (a->nextPage + mcPageSize > (char *)a + mcArenaSize) return;
+  char *page = a->nextPage;
+  a->nextPage += mcPageSize;
+  unsigned char *pageClass = &a->pageClass[(page - (char *)a) / mcPageSize];
+  *pageClass = class;
+  cache_flushMem(pageClass, 1); // for blockSize on other cores
+  unsigned int blockSize = 1 << (class + mcMinShift);
+  for (char *block = page; block < page + mcPageSize; block += blockSize) {
+    *(void **)block = a->freeLists[class];
+    a->freeLists[class] = block;
+  }
+}
+
+static void *arenaMalloc(size_t size) {
+  // Allocate from this core's arena; NULL if we can't
+  Arena *a = myArena();
+  int class = 0;
+  while ((1 << (class + mcMinShift)) < size) class++;
+  if (!a->freeLists[class]) arenaRefill(a, class);
+  void *res = a->freeLists[class];
+  if (res) {
+    a->freeLists[class] = *(void **)res;
+    // Drop our stale or dirty lines: our link, or another core's data
+    cache_invalidateMem(res, 1 << (class + mcMinShift));
+  }
+  return res;
+}
+
+void *malloc(size_t size) {
+  if (corenum() == 1) {
+    void *next;
+    for (void *ptr = takeRemoteFrees(); ptr; ptr = next) {
+      next = nextRemoteFree(ptr);
+      free1(ptr - mcHeapOffset);
+    }
+    // Room for the remote free link; result is cache line aligned, and
+    // preceded by its size, for blockSize on other cores
+    if (size < sizeof(void *)) size = sizeof(void *);
+    void *res = malloc1(mcHeapOffset + size);
+    if (!res) return NULL;
+    res += mcHeapOffset;
+    ((size_t *)res)[-1] = size;
+    cache_flushMem((size_t *)res - 1, sizeof(size_t));
     return res;
+  } else {
+    if (arenaBase && size <= mcMaxSmall) {
+      void *res = arenaMalloc(size);
+      if (res) return res;
+    }
+    return mc_rpcMalloc(size);
   }
 }
 
 void free(void *ptr) {
-  if (corenum() == 1) {
-    free1(ptr);
+  if (!ptr) return;
+  int owner = arenaOwner(ptr);
+  if (owner != corenum()) {
+    remoteFree(owner, ptr);
+  } else if (owner == 1) {
+    free1(ptr - mcHeapOffset);
   } else {
-    clearResponse();
-    IntercoreMessage msg;
-    msg[0] = mcFree;
-    msg[1] = (unsigned int)ptr;
-    message_send(1, msgTypeRPC, &msg, 2);
-    getResponse();
+    arenaFree(myArena(), ptr);
   }
 }
@@ -35,6 +35,10 @@ void mc_main();
 //
 void mc_initRPC();
 
+// Size of the stack for "mc_main" in each of the other cores
+//
+#define coreStackSize 100000
+
 static void mc_exit() {
   // This is reached on return from mc_main (by "jump", not "call")
   //
@@ -48,7 +52,7 @@ static void forkee(void *arg) {
   int nCores = enetCorenum();
   for (int core = 2; core < nCores; core++) {
     SaveArea *save = getSaveArea(core);
-    save->sp = malloc(100000) + 100000;
+    save->sp = malloc(coreStackSize) + coreStackSize;
     save->link = (unsigned int)mc_exit;
     save->pc = (unsigned int)mc_main;
     cache_flushMem(save, sizeof(SaveArea));
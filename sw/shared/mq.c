@@ -13,8 +13,37 @@
 #include "intercore.h"
 #include "network.h"
 
-static Mutex mqMutex = NULL;
-static MQReceiver *mqHandlers;
+// The receive thread dispatches messages until the hardware queue is
+// empty, then blocks on "mqIdle".  While it's blocked the scheduler's
+// poller, "mqPoll", reads the hardware queue; when a message arrives it
+// leaves it in "mqMsg" and wakes the receive thread ahead of any other
+// ready threads.
+//
+// A message matching a thread blocked in mq_wait goes to that thread.
+// Otherwise it goes to the handler registered for its source and type.
+// Handlers are changed only by single stores from core 1's non-preemptive
+// threads, so the dispatch path reads the table without locking.
+
+typedef struct MQWaiter {   // a thread blocked in mq_wait
+  int srce;                 // core to wait for, or mqAny
+  int type;                 // message type to wait for, or mqAny
+  MQMessage *msg;           // where to put the message
+  unsigned int status;      // status word of the message; 0 if none yet
+  struct Queue q;           // the waiting thread
+  struct MQWaiter *next;
+} *MQWaiter;
+
+#define mqCores 16
+#define mqTypes 16
+#define mqBatch 8           // messages dispatched between yields
+
+static int mqInitialized = 0;
+static MQReceiver mqHandlers[mqCores][mqTypes]; // by source, type
+static MQWaiter mqWaiters = NULL;   // in order of arrival
+static struct Queue mqIdle;         // receive thread, when idle
+static IntercoreMessage mqMsg;      // message being dispatched
+static unsigned int mqPolled = 0;   // status of message left by mqPoll
+static int mqBusyPolling = 0;       // old-style receive loop, for testing
 
 static void mqInit();
 
@@ -26,40 +55,126 @@ static void mqDiscard(unsigned int srce, unsigned int type,
    printf("\n");
 }
 
+static void mqDispatch(unsigned int status, MQMessage *msg) {
+  // Deliver a message to a waiting thread or to its source's handler
+  unsigned int srce = message_srce(status);
+  unsigned int type = message_type(status);
+  unsigned int len = message_len(status);
+  MQWaiter *prev = &mqWaiters;
+  for (MQWaiter w = mqWaiters; w; w = w->next) {
+    // A waiter whose queue is empty has timed out, and will take itself
+    // off the list when its thread next runs
+    if (!queue_isEmpty(&w->q) &&
+        (w->srce == mqAny || w->srce == srce) &&
+        (w->type == mqAny || w->type == type)) {
+      *prev = w->next;
+      bcopy(msg, w->msg, len * sizeof(unsigned int));
+      w->status = status;
+      queue_unblock(&w->q);
+      return;
+    }
+    prev = &w->next;
+  }
+  mqHandlers[srce][type](srce, type, msg, len);
+}
+
 static void mqReceiver(void * arg) {
   // Root message queue dispatcher, forked by "mqInit"
   for (;;) {
-    IntercoreMessage msg;
-    unsigned int status;
-    while ((status = message_recv(&msg)) == 0) thread_yield();
-    unsigned int srce = message_srce(status);
-    unsigned int type = message_type(status);
-    unsigned int len = message_len(status);
-    MQReceiver r;
-    mutex_acquire(mqMutex);
-    r = mqHandlers[srce];
-    mutex_release(mqMutex);
-    r(srce, type, &msg, len);
-    thread_yield();
+    unsigned int status = mqPolled;
+    mqPolled = 0;
+    if (!status) status = message_recv(&mqMsg);
+    if (status) {
+      // Dispatch a batch before letting other threads run
+      for (int n = 1; ; n++) {
+        mqDispatch(status, &mqMsg);
+        if (n == mqBatch) break;
+        status = message_recv(&mqMsg);
+        if (!status) break;
+      }
+      thread_yield();
+    } else if (mqBusyPolling) {
+      thread_yield();
+    } else {
+      queue_block(&mqIdle, 0);
+    }
+  }
+}
+
+static void mqPoll() {
+  // Scheduler poller: if the receive thread is idle, look for a message
+  // and, if there is one, wake the receive thread to dispatch it.
+  if (!queue_isEmpty(&mqIdle)) {
+    unsigned int status = message_recv(&mqMsg);
+    if (status) {
+      mqPolled = status;
+      queue_unblockFirst(&mqIdle);
+    }
+  }
+}
+
+unsigned int mq_wait(int srce, int type, MQMessage *msg,
+                     Microsecs microsecs) {
+  // Block until a message from "srce" of type "type" arrives, or timeout
+  mqInit();
+  struct MQWaiter w;
+  w.srce = srce;
+  w.type = type;
+  w.msg = msg;
+  w.status = 0;
+  w.next = NULL;
+  queue_init(&w.q);
+  MQWaiter *tail = &mqWaiters;
+  while (*tail) tail = &((*tail)->next);
+  *tail = &w;
+  queue_block(&w.q, microsecs);
+  if (!w.status) {
+    // Timed out: we're still on the list, but mqDispatch has passed us by
+    // since the timeout made our queue empty
+    MQWaiter *prev = &mqWaiters;
+    while (*prev != &w) prev = &((*prev)->next);
+    *prev = w.next;
   }
+  return w.status;
+}
+
+void mq_busyPoll(int busy) {
+  // Select old-style busy polling by the receive thread
+  mqInit();
+  mqBusyPolling = busy;
+  if (busy && !queue_isEmpty(&mqIdle)) queue_unblock(&mqIdle);
 }
 
 void mq_register(unsigned int core, MQReceiver receiver) {
-  // Register up-call handler for messages from a core; NULL to disable
+  // Register up-call handler for all messages from a core; NULL to disable
+  mqInit();
+  if (core < mqCores) {
+    for (int type = 0; type < mqTypes; type++) {
+      mqHandlers[core][type] = (receiver ? receiver : mqDiscard);
+    }
+  }
+}
+
+void mq_registerType(unsigned int core, unsigned int type,
+                     MQReceiver receiver) {
+  // Register up-call handler for messages of one type from a core
   mqInit();
-  if (core < 64) {
-    mutex_acquire(mqMutex);
-    mqHandlers[core] = (receiver ? receiver : mqDiscard);
-    mutex_release(mqMutex);
+  if (core < mqCores && type < mqTypes) {
+    mqHandlers[core][type] = (receiver ? receiver : mqDiscard);
   }
 }
 
 static void mqInit() {
   // Initialize MQ globals and fork the message receiver thread
-  if (!mqMutex) {
-    mqMutex = mutex_create();
-    mqHandlers = malloc(64 * sizeof(MQReceiver));
-    for (int i = 0; i < 64; i++) mqHandlers[i] = mqDiscard;
+  if (!mqInitialized) {
+    mqInitialized = 1;
+    for (int core = 0; core < mqCores; core++) {
+      for (int type = 0; type < mqTypes; type++) {
+        mqHandlers[core][type] = mqDiscard;
+      }
+    }
+    queue_init(&mqIdle);
+    thread_setPoller(mqPoll);
     thread_fork(mqReceiver, NULL);
     printf("[%02u]: mqInit\n", corenum());
   }
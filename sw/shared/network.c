@@ -12,6 +12,8 @@
 #include <stdio.h>
 #include "intercore.h"
 #include "network.h"
+#include "slab.h"
+#include "portmap.h"
 
 static void networkInit();
 // Initialize IP state from DHCP
@@ -39,31 +41,51 @@ typedef struct ARPPacket {
   Octet targetIP[4];
 } ARPPacket;
 
-#define arpCacheSize 1023
+#define arpCacheSets 256          // a power of 2
+#define arpCacheWays 4
+#define arpQueueMax 4             // packets held for an unresolved address
+#define arpTries 5                // requests before giving up
+#define arpRetryInterval 50000    // microsecs between requests
+#define arpLifetime (60 * 1000000) // microsecs before an entry is stale
+
+#define arpStateFree 0
+#define arpStateIncomplete 1      // request sent, no reply yet
+#define arpStateReachable 2       // confirmed within arpLifetime
+#define arpStateStale 3           // still used, while being re-confirmed
 
 typedef struct ARPCacheEntry {
   IPAddr addr;
   MAC mac;
-  Microsecs time;
+  int state;
+  Microsecs time;                 // when confirmed, or if incomplete, when
+                                  // last requested
+  int tries;                      // requests sent, while incomplete
+  Enet *queue;                    // IP packets waiting for "mac", oldest
+                                  // first, linked through "next"
+  int queued;                     // length of "queue"
 } ARPCacheEntry;
 
 static Mutex arpMutex;
-static Condition arpCond;
+static Condition arpCond;         // an entry has become incomplete
 static IPAddr myIP = 0;
 static IPAddr mySubnetMask;
 static IPAddr myRouter;
-static ARPCacheEntry *arpCache;
+static ARPCacheEntry *arpCache;   // arpCacheSets sets of arpCacheWays
+static int arpIncomplete;         // entries in arpStateIncomplete
+static ARPStats arpStats;
 
 static void arpInit();
 
 static int ipHash(IPAddr addr) {
   // Return hash of addr for indexing arpCache
-  return addr % arpCacheSize;
+  return (addr ^ (addr >> 8)) & (arpCacheSets - 1);
 }
 
 static void arpSend(int op, MAC targetMAC, IPAddr targetIP) {
-  // Transmit an ARP request or reply
+  // Transmit an ARP request or reply.  Call this without arpMutex held,
+  // since enet_send can block waiting for a transmit descriptor.
   Enet *buf = enet_alloc();
+  if (!buf) return;
   ARPPacket *pkt = (ARPPacket *)buf;
   pkt->hardwareType = htons(arpTypeEnet);
   pkt->protocolType = htons(enetTypeIP);
@@ -79,57 +101,242 @@ static void arpSend(int op, MAC targetMAC, IPAddr targetIP) {
   enet_free(buf);
 }
 
-int arp_getMAC(IPAddr addr, MAC *res) {
-  // Find MAC address for given IP address.  Handles ARP and subnet mask.
-  // Returns 1 on success, 0 on failure.
+static IPAddr arpNextHop(IPAddr addr) {
+  // Return the address whose MAC is used to reach "addr".
   //
   // TEMP: for off-network addresses, we always use our default gateway;
   // we make no attempt to discover other gateways (e.g. we ignore ICMP
   // redirect messages).
   //
-  // Broadcast and multicast should be handled elsewhere.
-  //
+  if (myIP && mySubnetMask && myRouter &&
+      (addr & mySubnetMask) != (myIP & mySubnetMask)) return myRouter;
+  return addr;
+}
+
+static ARPCacheEntry *arpFind(IPAddr addr) {
+  // Return the entry for "addr", or NULL.  Assumes arpMutex is held
+  ARPCacheEntry *set = &arpCache[ipHash(addr) * arpCacheWays];
+  for (int i = 0; i < arpCacheWays; i++) {
+    if (set[i].state != arpStateFree && set[i].addr == addr) return &set[i];
+  }
+  return NULL;
+}
+
+static Enet *arpClear(ARPCacheEntry *entry) {
+  // Free "entry", returning its queue.  Assumes arpMutex is held
+  Enet *queue = entry->queue;
+  if (entry->state == arpStateIncomplete) arpIncomplete--;
+  entry->state = arpStateFree;
+  entry->queue = NULL;
+  entry->queued = 0;
+  return queue;
+}
+
+static void arpFreeQueue(Enet *queue) {
+  // Discard packets that were waiting for an address
+  while (queue) {
+    Enet *next = queue->next;
+    enet_free(queue);
+    queue = next;
+  }
+}
+
+static ARPCacheEntry *arpCreate(IPAddr addr, int evictIncomplete) {
+  // Return an entry for "addr" in its set: a free one if there is one,
+  // else the least recently confirmed.  Incomplete entries are evicted,
+  // dropping their queues, only if "evictIncomplete" and there's nothing
+  // else.  NULL if nothing can be evicted.  Assumes arpMutex is held.
+  ARPCacheEntry *set = &arpCache[ipHash(addr) * arpCacheWays];
+  ARPCacheEntry *victim = NULL;
+  for (int i = 0; i < arpCacheWays; i++) {
+    if (set[i].state == arpStateFree) {
+      victim = &set[i];
+      break;
+    }
+    if (set[i].state != arpStateIncomplete &&
+        (!victim || set[i].time < victim->time)) victim = &set[i];
+  }
+  if (!victim && evictIncomplete) {
+    victim = &set[0];
+    for (int i = 1; i < arpCacheWays; i++) {
+      if (set[i].time < victim->time) victim = &set[i];
+    }
+  }
+  if (victim) {
+    arpStats.dropped += victim->queued;
+    arpFreeQueue(arpClear(victim));
+    victim->addr = addr;
+  }
+  return victim;
+}
+
+static void arpQueue(ARPCacheEntry *entry, Enet *buf, Uint32 len) {
+  // Hold a copy of IP packet "buf" until entry's MAC address is known,
+  // dropping the oldest if too many are already held.
+  // Assumes arpMutex is held.
+  Enet *copy = enet_alloc();
+  if (!copy) {
+    arpStats.dropped++;
+    return;
+  }
+  bcopy(buf, copy, len);
+  copy->next = NULL;
+  if (entry->queued == arpQueueMax) {
+    Enet *oldest = entry->queue;
+    entry->queue = oldest->next;
+    entry->queued--;
+    enet_free(oldest);
+    arpStats.dropped++;
+  }
+  Enet **tail = &entry->queue;
+  while (*tail) tail = &(*tail)->next;
+  *tail = copy;
+  entry->queued++;
+  arpStats.queued++;
+}
+
+static int arpResolve(IPAddr addr, MAC *res, Enet *buf, Uint32 len) {
+  // Find the MAC address for "addr", without blocking.  Returns 1 and
+  // assigns to *res if it's known.  Otherwise returns 0 and starts
+  // resolving it, if that isn't under way already; a copy of IP packet
+  // "buf" of "len" bytes, if not NULL, is then sent when it's resolved.
   arpInit();
   mutex_acquire(arpMutex);
-  if (myIP && mySubnetMask && myRouter &&
-      (addr & mySubnetMask) != (myIP & mySubnetMask)) addr = myRouter;
+  addr = arpNextHop(addr);
+  ARPCacheEntry *entry = arpFind(addr);
+  Microsecs now = thread_now();
   int found = 0;
-  for (int i = 0; i < 5; i++) {
-    ARPCacheEntry entry = arpCache[ipHash(addr)];
-    if (entry.addr == addr && thread_now() - entry.time < 60 * 1000000) {
-      *res = entry.mac;
+  int query = 0; // send a request once arpMutex is released
+  if (entry && entry->state != arpStateIncomplete) {
+    Microsecs age = now - entry->time;
+    if (entry->state == arpStateReachable && age > arpLifetime) {
+      // Keep using it, but ask again
+      entry->state = arpStateStale;
+      query = 1;
+    }
+    if (entry->state == arpStateReachable || age <= 2 * arpLifetime) {
+      *res = entry->mac;
       found = 1;
-      break;
+    } else {
+      // No answer to the re-confirmation: resolve it afresh
+      entry->state = arpStateIncomplete;
+      entry->tries = 0;
+      arpIncomplete++;
+    }
+  } else if (!entry) {
+    entry = arpCreate(addr, 1);
+    if (entry) {
+      entry->state = arpStateIncomplete;
+      entry->tries = 0;
+      arpIncomplete++;
+    }
+  }
+  if (found) {
+    arpStats.hits++;
+  } else {
+    arpStats.misses++;
+    if (!entry) {
+      arpStats.dropped++;
+    } else {
+      if (buf) arpQueue(entry, buf, len);
+      if (entry->tries == 0) {
+        query = 1;
+        entry->tries = 1;
+        entry->time = now;
+        condition_signal(arpCond);
+      }
     }
-    arpSend(arpOpcodeRequest, broadcastMAC(), addr);
-    condition_timedWait(arpCond, arpMutex, 50000);
   }
+  if (query) arpStats.requests++;
   mutex_release(arpMutex);
+  if (query) arpSend(arpOpcodeRequest, broadcastMAC(), addr);
   return found;
 }
 
+int arp_getMAC(IPAddr addr, MAC *res) {
+  // Find MAC address for given IP address.  Handles ARP and subnet mask.
+  // Returns 1 on success, 0 if it's not yet known.
+  //
+  // Broadcast and multicast should be handled elsewhere.
+  //
+  return arpResolve(addr, res, NULL, 0);
+}
+
 void arp_insert(IPAddr addr, MAC mac) {
-  // Record an entry in the ARP cache
+  // Record an entry in the ARP cache, and send anything waiting for it
   arpInit();
   mutex_acquire(arpMutex);
-  if (myIP && mySubnetMask && myRouter &&
-      (addr & mySubnetMask) != (myIP & mySubnetMask)) addr = myRouter;
-  ARPCacheEntry *entry = &(arpCache[ipHash(addr)]);
-  entry->addr = addr;
-  entry->mac = mac;
-  entry->time = thread_now();
+  addr = arpNextHop(addr);
+  ARPCacheEntry *entry = arpFind(addr);
+  if (!entry) entry = arpCreate(addr, 0);
+  Enet *queue = NULL;
+  if (entry) {
+    if (entry->state == arpStateIncomplete) {
+      queue = entry->queue;
+      entry->queue = NULL;
+      entry->queued = 0;
+      arpIncomplete--;
+    }
+    entry->mac = mac;
+    entry->state = arpStateReachable;
+    entry->time = thread_now();
+  }
   mutex_release(arpMutex);
-  condition_broadcast(arpCond);
+  // Send outside arpMutex, since enet_send can block
+  while (queue) {
+    Enet *next = queue->next;
+    enet_send(mac, enetTypeIP, queue, ntohs(((IP *)queue)->ip.len));
+    enet_free(queue);
+    queue = next;
+  }
 }
 
 void arp_remove(IPAddr addr) {
   // Remove any existing entry for addr from the ARP cache
   arpInit();
   mutex_acquire(arpMutex);
-  if (myIP && mySubnetMask && myRouter &&
-      (addr & mySubnetMask) != (myIP & mySubnetMask)) addr = myRouter;
-  ARPCacheEntry *entry = &(arpCache[ipHash(addr)]);
-  entry->addr = 0;
+  ARPCacheEntry *entry = arpFind(arpNextHop(addr));
+  Enet *queue = (entry ? arpClear(entry) : NULL);
+  mutex_release(arpMutex);
+  arpFreeQueue(queue);
+}
+
+void arp_stats(ARPStats *stats, int reset) {
+  arpInit();
+  mutex_acquire(arpMutex);
+  *stats = arpStats;
+  if (reset) memset(&arpStats, 0, sizeof(arpStats));
+  mutex_release(arpMutex);
+}
+
+static void arpRetransmitter(void *arg) {
+  // Our thread for repeating ARP requests for incomplete entries, and
+  // giving up on them after arpTries
+  mutex_acquire(arpMutex);
+  for (;;) {
+    while (arpIncomplete == 0) condition_wait(arpCond, arpMutex);
+    condition_timedWait(arpCond, arpMutex, arpRetryInterval);
+    Microsecs now = thread_now();
+    for (int i = 0; i < arpCacheSets * arpCacheWays; i++) {
+      ARPCacheEntry *entry = &arpCache[i];
+      if (entry->state != arpStateIncomplete ||
+          now - entry->time < arpRetryInterval) continue;
+      if (entry->tries < arpTries) {
+        IPAddr addr = entry->addr;
+        entry->tries++;
+        entry->time = now;
+        arpStats.requests++;
+        // Send outside arpMutex; the scan carries on from here after
+        mutex_release(arpMutex);
+        arpSend(arpOpcodeRequest, broadcastMAC(), addr);
+        mutex_acquire(arpMutex);
+      } else {
+        printf("No MAC address for %08x\n", entry->addr);
+        arpStats.dropped += entry->queued;
+        arpFreeQueue(arpClear(entry));
+      }
+    }
+  }
   mutex_release(arpMutex);
 }
 
@@ -159,9 +366,16 @@ static void arpInit() {
   if (!arpMutex) {
     arpMutex = mutex_create();
     arpCond = condition_create();
-    arpCache = malloc(arpCacheSize * sizeof(ARPCacheEntry));
-    for (int i = 0; i < arpCacheSize; i++) arpCache[i].addr = 0;
+    arpCache = malloc(arpCacheSets * arpCacheWays * sizeof(ARPCacheEntry));
+    for (int i = 0; i < arpCacheSets * arpCacheWays; i++) {
+      arpCache[i].state = arpStateFree;
+      arpCache[i].queue = NULL;
+      arpCache[i].queued = 0;
+    }
+    arpIncomplete = 0;
+    memset(&arpStats, 0, sizeof(arpStats));
     enet_register(enetTypeARP, arpReceiver);
+    thread_fork(arpRetransmitter, NULL);
   }
 }
 
@@ -176,6 +390,20 @@ static Mutex ipMutex = NULL;
 static IPAddr ipBroadcast;      // 255.255.255.255
 static IPReceiver *ipProtocols; // receivers, indexed by protocol
 
+#define ipLoopSlots 512         // room for a delayed window in flight
+typedef struct IPLoop {         // a packet sent to 127.x.x.x
+  IP *buf;
+  int lent;                     // the sender's own buffer, by enet_lend
+  Microsecs due;                // when to deliver it, or 0 for now
+} IPLoop;
+static IPLoop ipLoopRing[ipLoopSlots];
+static unsigned int ipLoopHead; // next to deliver
+static unsigned int ipLoopTail; // next to fill
+static Condition ipLoopCond;    // ipLoopRing is no longer empty
+static IP *ipLooped;            // loopback packet whose up-call is running
+static Uint32 ipLoopLoss;       // packets dropped per million, for testing
+static Microsecs ipLoopDelay;   // delay before delivery, for testing
+
 static void ipDiscard(IP *buf, Uint32 len, int broadcast) {
   // Default handler for an unsupported IP protocols
   icmp_bounce(buf, broadcast,
@@ -183,40 +411,122 @@ static void ipDiscard(IP *buf, Uint32 len, int broadcast) {
         icmpCodeProtocolUnreachable);
 }
 
-static Uint16 ipChecksum(Uint32 res, Octet *buf, Uint32 len) {
-  // Return the ip checksum for "len" bytes of data in "buf", plus
-  // previously accumulated "res" (for the TCP/UDP pseudo-header)
-  // We perform everything in network byte order.
-  for (int i = 0; (i < (len >> 2) << 2); i += 4) {
-    Uint32 w = *(Uint32 *)(buf+i);
-    res += (w & 65535) + (w >> 16);
-  }
-  // fix up odd bytes, if any
-  if ((len & 3) != 0) {
-    Uint32 lastW = *(Uint32 *)(buf+((len>>2)<<2));
-    if ((len & 3) == 1) {
-      res += lastW & 255;
-    } else {
-      res += lastW & 65535;
-      if ((len & 3) == 3) {
-  res += (lastW >> 16) & 255;
-      }
+static Uint32 csumReduce(Uint32 res) {
+  // Fold a sum of at most 2^31 to 16 bits, with end-around carry
+  res = (res & 65535) + (res >> 16);
+  return (res & 65535) + (res >> 16);
+}
+
+static Uint32 csumSwap(Uint32 res) {
+  // Move a folded partial sum one byte along the data
+  return ((res & 255) << 8) | (res >> 8);
+}
+
+#define csumWord(res, w) ((res) += ((w) & 65535) + ((w) >> 16))
+
+static Uint32 csumRun(Octet *dst, const Octet *src, Uint32 len) {
+  // Private: partial sum of "len" bytes at "src", each byte placed by the
+  // parity of its address, copying them to "dst" unless it's NULL.  Assumes
+  // "dst" is aligned as "src" is, modulo 4.
+  //
+  // Whole cache lines are summed 8 words at a time.  The halves of each
+  // word are added separately, so there's no carry to lose; 64 KB can't
+  // overflow the accumulator.
+  //
+  Uint32 res = 0;
+  if (((Uint32)src & 1) && len >= 1) {
+    Octet b = *src++;
+    if (dst) *dst++ = b;
+    res += b << 8;
+    len--;
+  }
+  if (((Uint32)src & 2) && len >= 2) {
+    Uint16 h = *(const Uint16 *)src;
+    if (dst) {
+      *(Uint16 *)dst = h;
+      dst += 2;
     }
+    res += h;
+    src += 2;
+    len -= 2;
   }
-  res = (res & 65535) + (res >> 16);
-  res = (res & 65535) + (res >> 16);
-  if (res == 65535) return 65535;
-  return ~(Uint16)res;
+  const Uint32 *s = (const Uint32 *)src;
+  Uint32 n = len >> 2;
+  if (dst) {
+    Uint32 *d = (Uint32 *)dst;
+    for (; n >= 8; n -= 8) {
+      Uint32 w0 = s[0], w1 = s[1], w2 = s[2], w3 = s[3];
+      Uint32 w4 = s[4], w5 = s[5], w6 = s[6], w7 = s[7];
+      d[0] = w0; d[1] = w1; d[2] = w2; d[3] = w3;
+      d[4] = w4; d[5] = w5; d[6] = w6; d[7] = w7;
+      csumWord(res, w0); csumWord(res, w1);
+      csumWord(res, w2); csumWord(res, w3);
+      csumWord(res, w4); csumWord(res, w5);
+      csumWord(res, w6); csumWord(res, w7);
+      s += 8;
+      d += 8;
+    }
+    for (; n > 0; n--) {
+      Uint32 w = *s++;
+      *d++ = w;
+      csumWord(res, w);
+    }
+    dst = (Octet *)d;
+  } else {
+    for (; n >= 8; n -= 8) {
+      csumWord(res, s[0]); csumWord(res, s[1]);
+      csumWord(res, s[2]); csumWord(res, s[3]);
+      csumWord(res, s[4]); csumWord(res, s[5]);
+      csumWord(res, s[6]); csumWord(res, s[7]);
+      s += 8;
+    }
+    for (; n > 0; n--) {
+      csumWord(res, *s);
+      s++;
+    }
+  }
+  src = (const Octet *)s;
+  if (len & 2) {
+    Uint16 h = *(const Uint16 *)src;
+    if (dst) {
+      *(Uint16 *)dst = h;
+      dst += 2;
+    }
+    res += h;
+    src += 2;
+  }
+  if (len & 1) {
+    if (dst) *dst = *src;
+    res += *src;
+  }
+  return csumReduce(res);
 }
 
-static Uint16 ipHeaderChecksum(IP *buf) {
-  return ipChecksum(0, (Octet *)buf, ip_headerSize(buf));
+Uint32 csum_partial(const void *buf, Uint32 len, Uint32 sum) {
+  Uint32 res = csumRun(NULL, buf, len);
+  // csumRun placed the bytes by address, but the block starts at an even
+  // offset in the data
+  if ((Uint32)buf & 1) res = csumSwap(res);
+  return csumReduce(sum + res);
 }
 
-Uint16 payloadChecksum(IP *buf, Uint32 len) {
-  // Return the UDP/TCP checksum for packet with given UDP/TCP length.
-  // "len" includes UDP/TCP header, but not IP header.
-  // Result includes the "pseudo-header" additions.
+Uint32 csum_copy(void *dst, const void *src, Uint32 len, Uint32 sum) {
+  if ((((Uint32)dst ^ (Uint32)src) & 3) != 0) {
+    // Word copies would need shifting; copy, then sum the copy
+    bcopy(src, dst, len);
+    return csum_partial(dst, len, sum);
+  }
+  Uint32 res = csumRun(dst, src, len);
+  if ((Uint32)src & 1) res = csumSwap(res);
+  return csumReduce(sum + res);
+}
+
+Uint32 csum_add(Uint32 sum, Uint32 block, Uint32 offset) {
+  if (offset & 1) block = csumSwap(block);
+  return csumReduce(sum + block);
+}
+
+Uint32 csum_pseudo(IP *buf, Uint32 len) {
   // We perform everything in network byte order.
   Uint32 res = (buf->ip.protocol << 8);
   res += htons(len);
@@ -224,7 +534,36 @@ Uint16 payloadChecksum(IP *buf, Uint32 len) {
   res += (w & 65535) + (w >> 16);
   w = buf->ip.dest;
   res += (w & 65535) + (w >> 16);
-  return ipChecksum(res, (Octet *)buf + ip_headerSize(buf), len);
+  return csumReduce(res);
+}
+
+Uint16 csum_fold(Uint32 sum) {
+  sum = csumReduce(sum);
+  if (sum == 65535) return 65535;
+  return ~(Uint16)sum;
+}
+
+Uint16 csum_update(Uint16 check, Uint16 old, Uint16 new) {
+  // RFC 1624, equation 3: HC' = ~(~HC + ~m + m')
+  return csum_fold((Uint16)~check + (Uint16)~old + new);
+}
+
+static Uint16 ipChecksum(Uint32 res, Octet *buf, Uint32 len) {
+  // Return the ip checksum for "len" bytes of data in "buf", plus
+  // previously accumulated "res" (for the TCP/UDP pseudo-header)
+  return csum_fold(csum_partial(buf, len, res));
+}
+
+static Uint16 ipHeaderChecksum(IP *buf) {
+  return ipChecksum(0, (Octet *)buf, ip_headerSize(buf));
+}
+
+Uint16 payloadChecksum(IP *buf, Uint32 len) {
+  // Return the UDP/TCP checksum for packet with given UDP/TCP length.
+  // "len" includes UDP/TCP header, but not IP header.
+  // Result includes the "pseudo-header" additions.
+  return ipChecksum(csum_pseudo(buf, len),
+        (Octet *)buf + ip_headerSize(buf), len);
 }
 
 static IPReceiver ip_getReceiver(Octet protocol) {
@@ -294,12 +633,89 @@ void ip_register(Octet protocol, IPReceiver receiver) {
 void ip_setSrce(IP *buf) {
   // Set srce address in buf, appropriately for dest address.
   networkInit();
+  if (ip_isLoopback(ntoh(buf->ip.dest))) {
+    buf->ip.srce = buf->ip.dest; // so replies loop back too
+    return;
+  }
   mutex_acquire(arpMutex);
   buf->ip.srce = hton(myIP);
   mutex_release(arpMutex);
 }
 
-void ip_send(IP *buf, Uint32 len, Octet ttl, Octet tos) {
+static void ipLoop(IP *buf, Uint32 len, int copy) {
+  // Private: queue an outgoing packet for delivery to ourselves by
+  // ipLoopback.  Unless "copy", the buffer itself is handed across, lent
+  // so that the sender leaves it alone until it's been delivered.
+  IPLoop *this;
+  if (ipLoopLoss && enet_random() % 1000000 < ipLoopLoss) return;
+  mutex_acquire(ipMutex);
+  if (ipLoopTail - ipLoopHead == ipLoopSlots) {
+    mutex_release(ipMutex);
+    return; // dropped, as a full transmit queue would
+  }
+  this = &ipLoopRing[ipLoopTail % ipLoopSlots];
+  this->lent = (!copy && enet_lend((Enet *)buf));
+  if (this->lent) {
+    this->buf = buf;
+  } else {
+    this->buf = (IP *)enet_alloc();
+    if (!this->buf) {
+      mutex_release(ipMutex);
+      return;
+    }
+    bcopy(buf, this->buf, len);
+  }
+  this->due = (ipLoopDelay ? thread_now() + ipLoopDelay : 0);
+  ipLoopTail++;
+  mutex_release(ipMutex);
+  condition_signal(ipLoopCond);
+}
+
+static void ipLoopback(void *arg) {
+  // Our thread for delivering loopback packets by up-call.  The sender may
+  // be holding the lock its own receive path needs (e.g. tcpMutex), so
+  // delivery can't happen within ip_send.  Packets held for
+  // ip_setLoopbackDelay are due in the order they were sent.
+  mutex_acquire(ipMutex);
+  for (;;) {
+    while (ipLoopHead == ipLoopTail) condition_wait(ipLoopCond, ipMutex);
+    IPLoop this = ipLoopRing[ipLoopHead % ipLoopSlots];
+    Microsecs now = (this.due ? thread_now() : 0);
+    if (this.due > now) {
+      condition_timedWait(ipLoopCond, ipMutex, this.due - now);
+      continue;
+    }
+    ipLoopHead++;
+    IPReceiver r = ipProtocols[this.buf->ip.protocol];
+    mutex_release(ipMutex);
+    ipLooped = this.buf;
+    r(this.buf, ip_payloadSize(this.buf), 0);
+    ipLooped = NULL;
+    if (this.lent) {
+      enet_return((Enet *)this.buf);
+    } else {
+      enet_free((Enet *)this.buf);
+    }
+    mutex_acquire(ipMutex);
+  }
+}
+
+int ip_isLooped(IP *buf) {
+  // Return true iff "buf" is a loopback packet being delivered by up-call
+  return (buf != NULL && buf == ipLooped);
+}
+
+void ip_setLoopbackLoss(Uint32 perMillion) {
+  // Public: drop this fraction of loopback packets, at random
+  ipLoopLoss = perMillion;
+}
+
+void ip_setLoopbackDelay(Microsecs delay) {
+  // Public: hold loopback packets this long before delivery
+  ipLoopDelay = delay;
+}
+
+static void ipSend(IP *buf, Uint32 len, Octet ttl, Octet tos, int copy) {
   // Send an IP packet.  Protocol, versionAndLen, srce, and dest are set
   // by caller.  "len" does not include the IP header
   networkInit();
@@ -309,21 +725,36 @@ void ip_send(IP *buf, Uint32 len, Octet ttl, Octet tos) {
   buf->ip.frag = htons(0);
   buf->ip.ttl = (ttl == 0 ? 64 : ttl); // From RFC 1700
   buf->ip.checksum = 0;
-  buf->ip.checksum = ipHeaderChecksum(buf);
   MAC destMAC;
   IPAddr destAddr = ntoh(buf->ip.dest);
+  if (ip_isLoopback(destAddr)) {
+    // No header checksum: nothing on the way can corrupt it
+    ipLoop(buf, len + ip_headerSize(buf), copy);
+    return;
+  }
+  buf->ip.checksum = ipHeaderChecksum(buf);
   if (buf->ip.dest == hton(ipBroadcast)) {
     destMAC = broadcastMAC();
-  } else if ((buf->ip.dest & 255) == 127) {
-    // Local loopback
-    ipReceiver(enet_localMAC(), enetTypeIP,
-         (Enet *)buf, len + ip_headerSize(buf), 0);
-    return;
-  } else if (!arp_getMAC(destAddr, &destMAC)) {
-    printf("No MAC address for %08x\n", destAddr);
+  } else if (!arpResolve(destAddr, &destMAC, (Enet *)buf,
+                         len + ip_headerSize(buf))) {
+    // Held until the address is resolved (or dropped), so as not to
+    // block the sender
     return;
   }
-  enet_send(destMAC, enetTypeIP, (Enet *)buf, len + ip_headerSize(buf));
+  if (copy) {
+    enet_send(destMAC, enetTypeIP, (Enet *)buf, len + ip_headerSize(buf));
+  } else {
+    enet_sendNoCopy(destMAC, enetTypeIP, (Enet *)buf,
+        len + ip_headerSize(buf));
+  }
+}
+
+void ip_send(IP *buf, Uint32 len, Octet ttl, Octet tos) {
+  ipSend(buf, len, ttl, tos, 1);
+}
+
+void ip_sendNoCopy(IP *buf, Uint32 len, Octet ttl, Octet tos) {
+  ipSend(buf, len, ttl, tos, 0);
 }
 
 static void ipInit() {
@@ -332,6 +763,10 @@ static void ipInit() {
   ipMutex = mutex_create();
   ipProtocols = malloc(256 * sizeof(IPReceiver));
   for (int i = 0; i < 256; i++) ipProtocols[i] = ipDiscard;
+  ipLoopHead = 0;
+  ipLoopTail = 0;
+  ipLoopCond = condition_create();
+  thread_fork(ipLoopback, NULL);
   enet_register(enetTypeIP, ipReceiver);
 }
 
@@ -371,9 +806,12 @@ static void icmpEcho(IP *buf, Uint32 len) {
   ICMPHeader *icmpHeader = (ICMPHeader *)ip_payload(buf);
   buf->ip.dest = buf->ip.srce;
   ip_setSrce((IP *)buf);
+  // Only the type changes, so adjust the checksum rather than re-summing
+  // the payload
+  Uint16 old = *(Uint16 *)icmpHeader;
   icmpHeader->type = icmpTypeEchoReply;
-  icmpHeader->checksum = 0;
-  icmpHeader->checksum = icmpChecksum(buf, len);
+  icmpHeader->checksum =
+    csum_update(icmpHeader->checksum, old, *(Uint16 *)icmpHeader);
   ip_send(buf, len, 0, 0);
 }
 
@@ -484,7 +922,15 @@ static Mutex udpMutex = NULL;
 static Condition udpCond = NULL;
 static UDPElem udpHead = NULL;   // head of received UDP packet queue
 static UDPElem udpTail = NULL;   // tail of received UDP packet queue
-static UDPReceiver *udpPorts;    // receivers, indexed by port number
+static Slab udpElemSlab;         // for UDPElem
+static PortMap udpPorts;         // UDPPortEntry, by port number
+static PortSet udpDynamic;       // dynamic ports in use
+static Slab udpPortSlab;         // for UDPPortEntry
+
+typedef struct UDPPortEntry {    // state of a port in use or fanned out
+  UDPReceiver receiver;          // udpDiscard if only fanned out
+  Uint16 fanOut;                 // first core << 8 | cores; 0 if not
+} UDPPortEntry;
 
 static void udpDiscard(IP *buf, int len, int broadcast, UDPPort port) {
   // Default handler for an unused UDP port
@@ -497,12 +943,16 @@ static void udpDiscard(IP *buf, int len, int broadcast, UDPPort port) {
 static void udpEnqueue(IP *buf, int len, int broadcast, UDPPort dest) {
   // Handler for a UDP port set up for blocking receive
   // len is UDP payload length or error code; buf is NULL for error codes.
+  // The datagram is copied rather than held with enet_recvHold: it may
+  // never be read, and a held receive buffer would eventually stop all
+  // reception.
   IP *newBuf = NULL;
   if (buf != NULL) {
     newBuf = (IP *)enet_alloc();
+    if (!newBuf) return; // no buffer for the copy: dropped
     bcopy(buf, newBuf, len + ip_headerSize(buf) + sizeof(UDPHeader));
   }
-  UDPElem this = malloc(sizeof(struct UDPElem));
+  UDPElem this = slab_alloc(udpElemSlab);
   this->next = NULL;
   this->buf = newBuf;
   this->len = len;
@@ -521,12 +971,49 @@ static void udpEnqueue(IP *buf, int len, int broadcast, UDPPort dest) {
   condition_broadcast(udpCond);
 }
 
+static void udpUnlink(UDPElem this) {
+  // Remove "this" from the queue for udp_recv.  Assumes udpMutex is held
+  if (this == udpHead) {
+    udpHead = this->next;
+  } else {
+    this->prev->next = this->next;
+  }
+  if (this == udpTail) {
+    udpTail = this->prev;
+  } else {
+    this->next->prev = this->prev;
+  }
+}
+
+static UDPPortEntry *udpEntry(UDPPort p) {
+  // Return the entry for port "p", creating it if need be.
+  // Assumes udpMutex is held.
+  UDPPortEntry *e = portmap_get(udpPorts, p);
+  if (!e) {
+    e = slab_alloc(udpPortSlab);
+    e->receiver = udpDiscard;
+    e->fanOut = 0;
+    portmap_set(udpPorts, p, e);
+  }
+  return e;
+}
+
+static void udpTrim(UDPPort p, UDPPortEntry *e) {
+  // Remove the entry for port "p" if it no longer does anything.
+  // Assumes udpMutex is held.
+  if (e->receiver == udpDiscard && e->fanOut == 0) {
+    portmap_set(udpPorts, p, NULL);
+    slab_free(udpPortSlab, e);
+  }
+}
+
 static void udpDeliver(IP *buf, int len, int broadcast, UDPPort dest) {
   // Deliver packet or negative result to handler for given UDP port
   // "len" is UDP payload length, or negative return code
   UDPReceiver r;
   mutex_acquire(udpMutex);
-  r = udpPorts[dest];
+  UDPPortEntry *e = portmap_get(udpPorts, dest);
+  r = (e ? e->receiver : udpDiscard);
   mutex_release(udpMutex);
   r(buf, len, broadcast, dest);
 }
@@ -534,6 +1021,7 @@ static void udpDeliver(IP *buf, int len, int broadcast, UDPPort dest) {
 static void udpReceiver(IP *buf, Uint32 len, int broadcast) {
   // Up-call from IP when a UDP or ICMP packet has been received
   UDPHeader *udpHeader = (UDPHeader *)ip_payload(buf);
+  UDPPortEntry *e;
   if (buf->ip.protocol == ipProtocolICMP) {
     ICMPHeader *icmpHeader = (ICMPHeader *)ip_payload(buf);
     IP *bouncedIP = (IP *)(ip_payload(buf) + sizeof(ICMPHeader));
@@ -544,34 +1032,43 @@ static void udpReceiver(IP *buf, Uint32 len, int broadcast) {
   type == icmpTypeTimeExceeded) {
       udpDeliver(NULL, udpRecvPortUnreachable, broadcast, dest);
     } // We ignore Source Quench and Parameter Problem
+  } else if ((e = portmap_get(udpPorts, ntohs(udpHeader->dest))) &&
+      e->fanOut != 0 && !ip_isLooped(buf)) {
+    // Pass it to an application core, by a hash of the addresses and ports.
+    // Loopback packets aren't in an Ethernet up-call, so can't be lent.
+    Uint32 fanOut = e->fanOut;
+    Uint32 hash = buf->ip.srce ^ buf->ip.dest ^ *(Uint32 *)udpHeader;
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+    enet_forward((fanOut >> 8) + (hash & 255) % (fanOut & 255),
+                 (Enet *)buf);
   } else if (udpHeader->checksum != 0 &&
       payloadChecksum(buf, ntohs(udpHeader->len)) != 0xffff) {
     printf("Bad UDP checksum\n");
   } else if (htons(udpHeader->len) != len) {
     printf("Bad UDP length\n");
   } else {
-    // Deliver the packet, by up-call or by blocking receive.
-    UDPPort dest = ntohs(udpHeader->dest);
-    udpDeliver(buf, len - sizeof(UDPHeader), broadcast, dest);
+    // Deliver the packet, by up-call or by blocking receive.  The entry
+    // from the fan-out test is still current: up-calls from IP are not
+    // preempted by other threads.
+    UDPReceiver r = (e ? e->receiver : udpDiscard);
+    r(buf, len - sizeof(UDPHeader), broadcast, ntohs(udpHeader->dest));
   }
 }
 
 void udp_register(UDPPort p, UDPReceiver receiver) {
   networkInit();
   mutex_acquire(udpMutex);
-  udpPorts[p] = (receiver ? receiver : udpEnqueue);
+  udpEntry(p)->receiver = (receiver ? receiver : udpEnqueue);
+  portset_mark(udpDynamic, p, 1);
   mutex_release(udpMutex);
 }
 
 UDPPort udp_allocPort(UDPReceiver receiver) {
   networkInit();
-  UDPPort res;
   mutex_acquire(udpMutex);
-  for (;;) {
-    res = enet_random() & 65535;
-    if (res > 1024 && udpPorts[res] == udpDiscard) break;
-  }
-  udpPorts[res] = (receiver ? receiver : udpEnqueue);
+  UDPPort res = portset_alloc(udpDynamic, enet_random());
+  if (res) udpEntry(res)->receiver = (receiver ? receiver : udpEnqueue);
   mutex_release(udpMutex);
   return res;
 }
@@ -579,7 +1076,23 @@ UDPPort udp_allocPort(UDPReceiver receiver) {
 void udp_freePort(UDPPort p) {
   networkInit();
   mutex_acquire(udpMutex);
-  udpPorts[p] = udpDiscard;
+  UDPPortEntry *e = portmap_get(udpPorts, p);
+  if (e) {
+    e->receiver = udpDiscard;
+    udpTrim(p, e);
+  }
+  portset_mark(udpDynamic, p, 0);
+  // Discard anything still queued for udp_recv
+  UDPElem this = udpHead;
+  while (this != NULL) {
+    UDPElem next = this->next;
+    if (this->dest == p) {
+      udpUnlink(this);
+      if (this->buf) enet_free((Enet *)this->buf);
+      slab_free(udpElemSlab, this);
+    }
+    this = next;
+  }
   mutex_release(udpMutex);
 }
 
@@ -595,19 +1108,10 @@ int udp_recv(IP ** buf, UDPPort p, Microsecs microsecs) {
       this = this->next;
     }
     if (this != NULL) {
-      if (this == udpHead) {
-  udpHead = udpHead->next;
-      } else {
-  this->prev->next = this->next;
-      }
-      if (this == udpTail) {
-  udpTail = NULL;
-      } else {
-  this->next->prev = this->prev;
-      }
+      udpUnlink(this);
       *buf = this->buf;
       len = this->len;
-      free(this);
+      slab_free(udpElemSlab, this);
       break;
     }
     if (condition_timedWait(udpCond, udpMutex, microsecs)) break;
@@ -631,17 +1135,69 @@ void udp_send(UDP *buf, Uint32 len) {
   ip_setSrce((IP *)buf);
   buf->udp.len = htons(len + sizeof(UDPHeader));
   buf->udp.checksum = 0;
-  buf->udp.checksum = payloadChecksum((IP *)buf, len + sizeof(UDPHeader));
+  if (!ip_isLoopback(ntoh(buf->ip.dest))) {
+    buf->udp.checksum = payloadChecksum((IP *)buf, len + sizeof(UDPHeader));
+  }
   ip_send((IP *)buf, len + sizeof(UDPHeader), 0, 0);
 }
 
+void udp_fanOut(UDPPort p, unsigned int firstCore, unsigned int nCores) {
+  networkInit();
+  mutex_acquire(udpMutex);
+  UDPPortEntry *e = udpEntry(p);
+  e->fanOut = (nCores ? (firstCore << 8) | nCores : 0);
+  udpTrim(p, e);
+  mutex_release(udpMutex);
+}
+
+int udp_coreCheck(EnetFrame *f) {
+  // Thread-free: on an application core
+  IP *buf = (IP *)f->buf;
+  if (f->type != enetTypeIP || !ipHeaderValid(buf) ||
+      buf->ip.protocol != ipProtocolUDP) return -1;
+  UDPHeader *udpHeader = (UDPHeader *)ip_payload(buf);
+  Uint32 len = ip_payloadSize(buf);
+  if (ntohs(udpHeader->len) != len) return -1;
+  if (udpHeader->checksum != 0 && payloadChecksum(buf, len) != 0xffff) {
+    return -1;
+  }
+  return len - sizeof(UDPHeader);
+}
+
+void udp_coreReply(EnetFrame *req, UDP *buf, Uint32 len) {
+  // Thread-free: on an application core.  Avoids ARP by replying to the
+  // request's source MAC address.
+  IP *reqIP = (IP *)req->buf;
+  UDPHeader *reqUDP = (UDPHeader *)ip_payload(reqIP);
+  buf->ip.versionAndLen = 0x45; // IPv4, 5 words in header
+  buf->ip.service = 0;
+  buf->ip.len = htons(len + sizeof(UDPHeader) + sizeof(IPHeader));
+  buf->ip.id = htons(*cycleCounter & 65535);
+  buf->ip.frag = htons(0);
+  buf->ip.ttl = 64;
+  buf->ip.protocol = ipProtocolUDP;
+  buf->ip.srce = reqIP->ip.dest;
+  buf->ip.dest = reqIP->ip.srce;
+  buf->ip.checksum = 0;
+  buf->ip.checksum = ipHeaderChecksum((IP *)buf);
+  buf->udp.srce = reqUDP->dest;
+  buf->udp.dest = reqUDP->srce;
+  buf->udp.len = htons(len + sizeof(UDPHeader));
+  buf->udp.checksum = 0;
+  buf->udp.checksum = payloadChecksum((IP *)buf, len + sizeof(UDPHeader));
+  enet_coreSend(req->srce, enetTypeIP, (Enet *)buf,
+    len + sizeof(UDPHeader) + sizeof(IPHeader));
+}
+
 static void udpInit() {
   // Initialize UDP globals and register with IP
   udpMutex = mutex_create();
   udpCond = condition_create();
   udpHead = NULL;
-  udpPorts = malloc(65536 * sizeof(UDPReceiver));
-  for (int i = 0; i < 65536; i++) udpPorts[i] = udpDiscard;
+  udpElemSlab = slab_create(sizeof(struct UDPElem));
+  udpPorts = portmap_create();
+  udpDynamic = portset_create();
+  udpPortSlab = slab_create(sizeof(UDPPortEntry));
   ip_register(ipProtocolUDP, udpReceiver);
 }
 
@@ -691,7 +1247,12 @@ int dns_lookup(char *name, IPAddr *res) {
   if (sizeof(DNSHeader) + strlen(name) + 1 + 2 * 2 >
       udpPayloadSize) return dnsNameTooLong;
   UDP *dnsSendBuf = (UDP *)enet_alloc();
+  if (!dnsSendBuf) return dnsNoBuffer;
   UDPPort local = udp_allocPort(NULL);
+  if (!local) {
+    enet_free((Enet *)dnsSendBuf);
+    return dnsNoPort;
+  }
   DNSHeader * sendHeader = (DNSHeader *)&(dnsSendBuf->data[0]);
   int myReqId;
   myReqId = enet_random() & 65535;
@@ -881,7 +1442,8 @@ static void configInit() {
   //
   // TEMP: never fails, just keeps on trying.
   //
-  UDP *dhcpSendBuf = (UDP *)enet_alloc();
+  UDP *dhcpSendBuf;
+  while (!(dhcpSendBuf = (UDP *)enet_alloc())) thread_sleep(1000000);
   DHCPHeader *dhcp = (DHCPHeader *)&(dhcpSendBuf->data);
   dhcpSendBuf->ip.dest = ipBroadcast;
   dhcpSendBuf->udp.dest = htons(bootpsPort);
@@ -26,9 +26,8 @@
 //     outbound SYN packet).                                              //
 //                                                                        //
 // There are also performance shortcomings (in the TCP layer):            //
-//   - the retransmission strategy is, at best, naive;                    //
-//   - there is no slow-start, nor congestion avoidance algorithms        //
-//     (but Nagle's algorithm is included).                               //
+//   - there are no TCP timestamps (RFC 7323);                            //
+//   - SACK blocks go only on plain ACKs, never on data segments.         //
 //                                                                        //
 // The TCP interface is designed to support blocking receive calls from   //
 // a multi-threaded application, not a non-blocking event-style usage.    //
@@ -138,10 +137,37 @@ typedef void (* MQReceiver)(unsigned int srce, unsigned int type,
 // len is the message payload length.
 
 void mq_register(unsigned int core, MQReceiver receiver);
-// Register up-call handler for messages from a core; NULL to disable
+// Register up-call handler for messages of all types from a core; NULL
+// to disable
 //
 // The system registers an MQReceiver for the Ethernet core.
 
+void mq_registerType(unsigned int core, unsigned int type,
+                     MQReceiver receiver);
+// Register up-call handler for messages of the given type from a core;
+// NULL to disable.  This lets protocols share a source core: e.g. the
+// system registers for msgTypeRPC from each of cores 2..n, leaving other
+// types from those cores to the application.
+
+#define mqAny (-1)
+
+unsigned int mq_wait(int srce, int type, MQMessage *msg,
+                     Microsecs microsecs);
+// Block until a message arrives from core "srce" with message type
+// "type", either of which may be mqAny, then place its body in *msg and
+// return its status word.  Returns 0 if "microsecs" elapse first; 0 means
+// no timeout.
+//
+// Such a message goes to the longest-waiting matching thread instead of
+// the registered MQReceiver.
+//
+// Will cause a context switch.
+
+void mq_busyPoll(int busy);
+// If "busy", have the receive thread poll the message queue by yielding
+// in a loop, as it used to, instead of being woken by the scheduler when
+// a message arrives.  For performance comparisons only.
+
 ////////////////////////////////////////////////////////////////////////////
 //                                                                        //
 // Ethernet                                                               //
@@ -175,7 +201,9 @@ typedef void (* EnetReceiver)(MAC srce, Uint16 type, Enet *buf, Uint32 len,
 // The up-calls execute in the dedicated system message receive
 // thread, and are expected to terminate rapidly.  Buffers are on loan to
 // the handlers for the duration of the up-call, and then revert to the
-// system.  Buffers are data-cache aligned.
+// system, unless the handler keeps one with enet_recvHold.  Buffers are
+// data-cache aligned.  Handlers may write into a buffer, but only within
+// the first "len" bytes.
 
 void enet_init();
 // Initialize globals, and register with MQ
@@ -186,11 +214,47 @@ MAC broadcastMAC();
 
 Enet *enet_alloc();
 // Allocate a buffer from the global pool.
-// The buffer is data-cache aligned.
+// The buffer is data-cache aligned.  Returns NULL only if the pool is at
+// the limit set by enet_setPool, or memory is exhausted.
+//
+// Any core may allocate and free buffers, without locking in the common
+// case.  A buffer passed to another core must be flushed from the data
+// cache by the sender, as for any shared data.
 
 void enet_free(Enet *buf);
 // Free a previously allocated buffer.
 
+typedef struct EnetPoolStats {
+  Uint32 allocs;              // by this core
+  Uint32 frees;               // by this core
+  int inUse;                  // allocs - frees
+  int highWater;              // highest value of inUse
+  Uint32 failures;            // enet_alloc returned NULL
+  Uint32 buffers;             // in the pool, for all cores
+} EnetPoolStats;
+
+void enet_setPool(unsigned int reserve, unsigned int limit);
+// Create buffers now, so that "reserve" more are free, and limit the pool
+// to "limit" buffers in total (0 for no limit).  Without it, the pool
+// grows on demand.  A server image can call this at initialization to
+// avoid growing the pool during a burst of traffic.
+
+void enet_poolStats(EnetPoolStats *stats);
+// Copy this core's buffer pool statistics into *stats.
+
+Enet *enet_recvHold(Enet *buf, Uint32 len);
+// Keep the first "len" bytes of a buffer given to an EnetReceiver (or to
+// the IP, ICMP or UDP receivers above it) beyond the end of the up-call,
+// until enet_recvRelease.  Usually returns "buf" itself, without copying;
+// the result is a copy only if too many buffers are already held, and
+// NULL if a copy was needed but enet_alloc failed.
+//
+// The controller fills its receive buffers in order, and drops packets
+// once it reaches one that's still held, so release promptly.
+
+void enet_recvRelease(Enet *buf);
+// Give back the result of enet_recvHold.
+
 MAC enet_localMAC();
 // Returns this controller's MAC address
 
@@ -208,6 +272,107 @@ void enet_register(Uint16 protocol, EnetReceiver receiver);
 
 void enet_send(MAC dest, Uint16 type, Enet *buf, Uint32 len);
 // Send a raw Ethernet packet
+//
+// Returns once the packet is queued for the controller.  Up to enetTxMax
+// packets can be outstanding; beyond that, this blocks.
+
+void enet_sendNoCopy(MAC dest, Uint16 type, Enet *buf, Uint32 len);
+// Send a raw Ethernet packet directly from "buf", without copying it, if
+// "buf" is data-cache aligned (as from enet_alloc); otherwise as enet_send.
+//
+// The controller reads "buf" some time after this returns, so the caller
+// must not modify it until enet_busy(buf) is false.  The caller may
+// enet_free it at any time: if it's still busy, it returns to the pool
+// when the controller is done with it.
+
+int enet_busy(Enet *buf);
+// Return true iff "buf" is still in use by enet_sendNoCopy, or lent
+
+int enet_lend(Enet *buf);
+// Lend "buf", sent without copying, to a consumer other than the
+// controller (e.g. IP loopback).  Until enet_return(buf), enet_busy(buf)
+// is true and enet_free(buf) is deferred, as if the controller were still
+// sending it.  Returns 0, lending nothing, if too many are on loan.  Core
+// 1 only.
+
+void enet_return(Enet *buf);
+// End the loan of "buf" from enet_lend.  Does nothing if "buf" isn't on
+// loan (e.g. enet_lend returned false for it).
+
+#define enetTxMax (16)
+
+void enet_setTxDepth(int depth);
+// Limit the number of packets outstanding to "depth", in [1..enetTxMax].
+// The default is enetTxMax.
+
+void enet_setLinkRate(unsigned int mbps, int pausable);
+// Set the link rate in Mb/s, in [10..10000], and whether the MAC obeys
+// pause frames.  The controller doesn't say when it has finished reading
+// a transmit buffer, so buffers are reused after the time this implies;
+// the default, 1000 and false, matches the EMAC configuration in MAC.v.
+// Call this before enet_init or enet_coreInit.
+
+unsigned int enet_txRejects();
+// Count of transmit requests rejected by the controller (and retried),
+// because its queue was full
+
+typedef struct EnetRecvStats {
+  Uint32 packets;             // delivered by up-call
+  Uint32 dropped;             // discarded: delivery thread too far behind
+  unsigned long long receiveCycles; // MQ up-call to hand-off
+  unsigned long long handoffCycles; // hand-off to start of delivery
+  unsigned long long upcallCycles;  // in the EnetReceiver up-calls
+} EnetRecvStats;
+
+void enet_recvStats(EnetRecvStats *stats, int reset);
+// Copy the receive path statistics into *stats, then reset them to zero
+// if "reset".  The cycle counts are totals over "packets".
+
+void enet_forward(unsigned int core, Enet *buf);
+// Pass the frame in "buf" to application core "core", where it arrives
+// through enet_corePoll.  Only from within the frame's EnetReceiver
+// up-call (or the IP or UDP ones above it); the buffer is held (see
+// enet_recvHold) until the core releases it.
+
+
+//
+// Access from application cores (2..n)
+//
+// Each core has its own MAC address and receive ring, and sends directly
+// to the controller.  These have no threads: nothing happens on a core
+// except within these calls.  A core using them must not receive other
+// intercore messages itself, since they drain its message queue and
+// discard (with a warning) anything that isn't for the Ethernet.
+//
+
+typedef struct EnetFrame {    // a frame received by an application core
+  MAC srce;
+  Uint16 type;
+  Enet *buf;                  // data-cache aligned
+  Uint32 len;                 // Ethernet payload length
+  int broadcast;
+  unsigned int from;          // 1 if lent by core 1, else the controller
+} EnetFrame;
+
+void enet_coreInit();
+// Set up this core's receive ring and obtain its MAC address.  Called
+// implicitly by the others.
+
+MAC enet_coreMAC();
+// Returns this core's MAC address: the controller's, with the core number
+// in the low 4 bits.  Frames sent to it arrive only at this core.
+
+int enet_corePoll(EnetFrame *f);
+// If a frame has arrived for this core, addressed to its MAC address or
+// passed by enet_forward, fill in *f and return 1.  Otherwise return 0.
+
+void enet_coreRelease(EnetFrame *f);
+// Give back the buffer of a frame from enet_corePoll.  The controller
+// drops frames for this core while too many of its buffers are held.
+
+void enet_coreSend(MAC dest, Uint16 type, Enet *buf, Uint32 len);
+// Send a raw Ethernet packet from this core.  "buf" is copied, and may be
+// reused on return.  Spins while enetTxMax sends are outstanding.
 
 
 ////////////////////////////////////////////////////////////////////////////
@@ -251,13 +416,20 @@ typedef void (* IPReceiver)(IP *buf, Uint32 len, int broadcast);
 // The up-calls execute in the dedicated system message receive
 // thread, and are expected to terminate rapidly.  Buffers are on loan to
 // the handlers for the duration of the up-call, and then revert to the
-// system.  Buffers are data-cache aligned.
+// system, unless the handler keeps one with enet_recvHold.  Buffers are
+// data-cache aligned.  Handlers may write into a buffer, but only within
+// the first "len" bytes.
 
 static IPAddr ip_fromQuad(Octet a, Octet b, Octet c, Octet d) {
   // Returns hardware integer for the address "a.b.c.d"
   return (a << 24) | (b << 16) | (c << 8) | d;
 }
 
+static int ip_isLoopback(IPAddr addr) {
+  // Returns true iff "addr" (in hardware order) is a loopback address
+  return (addr >> 24) == 127;
+}
+
 static Uint32 ip_headerSize(IP *buf) {
   // Return the IP header size of a received packet, in Octets
   return (buf->ip.versionAndLen & 15) << 2;
@@ -289,6 +461,63 @@ void ip_send(IP *buf, Uint32 len, Octet ttl, Octet tos);
 // Send an IP packet.  Protocol, versionAndLen, srce, and dest are set
 // by caller.  "len" does not include the IP header
 
+void ip_sendNoCopy(IP *buf, Uint32 len, Octet ttl, Octet tos);
+// As ip_send, but using enet_sendNoCopy: "buf" mustn't be modified until
+// enet_busy((Enet *)buf) is false
+
+// Packets to 127.x.x.x are delivered by up-call from a loopback thread,
+// not from ip_send itself, so a sender may hold the locks its receive path
+// needs.  They carry no checksums, IP or TCP/UDP: senders that fill in a
+// checksum should skip it for loopback destinations, and receivers skip
+// checking it when ip_isLooped.  ip_sendNoCopy hands its buffer across
+// without a copy (see enet_lend).
+
+int ip_isLooped(IP *buf);
+// Return true iff "buf" is a loopback packet whose up-call is in progress
+
+void ip_setLoopbackLoss(Uint32 perMillion);
+// Discard the given number per million of the packets sent to loopback
+// addresses, chosen at random, to test protocols against a lossy path.
+// The default is 0.
+
+void ip_setLoopbackDelay(Microsecs delay);
+// Deliver each packet sent to a loopback address "delay" microseconds
+// after it was sent, in order, so that loopback has a round trip time
+// (of twice "delay") and a bandwidth-delay product, as a long path would.
+// No more than 512 packets can be in transit at once; more are dropped.
+// The default is 0.
+
+// Internet checksums (RFC 1071), built up from partial sums.  A partial
+// sum is the ones-complement sum of some data as 16-bit words in memory
+// order, folded to 16 bits; start from 0.  Data need not be aligned, but
+// no single call may cover more than 64 KB.
+
+Uint32 csum_partial(const void *buf, Uint32 len, Uint32 sum);
+// Add to partial sum "sum" the "len" bytes at "buf", taken as starting at
+// an even offset in the checksummed data.
+
+Uint32 csum_copy(void *dst, const void *src, Uint32 len, Uint32 sum);
+// Copy "len" bytes from "src" to "dst", as bcopy, and return
+// csum_partial(src, len, sum), reading each byte only once when "src" and
+// "dst" are aligned alike.
+
+Uint32 csum_add(Uint32 sum, Uint32 block, Uint32 offset);
+// Add to "sum" the partial sum "block" of data that starts "offset" bytes
+// into the checksummed data.
+
+Uint32 csum_pseudo(IP *buf, Uint32 len);
+// Partial sum of the TCP/UDP pseudo-header for "buf", with "len" the
+// TCP/UDP length (header and payload)
+
+Uint16 csum_fold(Uint32 sum);
+// The checksum field value for partial sum "sum".  Checking data that
+// includes a correct checksum field gives 0xffff.
+
+Uint16 csum_update(Uint16 check, Uint16 old, Uint16 new);
+// Adjust checksum field "check" for a 16-bit word of the checksummed data
+// changing from "old" to "new", both as in memory (RFC 1624).  Use it
+// twice for a 32-bit field.
+
 
 ////////////////////////////////////////////////////////////////////////////
 //                                                                        //
@@ -296,12 +525,34 @@ void ip_send(IP *buf, Uint32 len, Octet ttl, Octet tos);
 //                                                                        //
 ////////////////////////////////////////////////////////////////////////////
 
+// The ARP cache is set-associative.  ip_send never waits for ARP: a
+// packet for an address not yet resolved is copied and held, a few per
+// address, and sent when the reply arrives, or dropped after 5 requests
+// 50 ms apart go unanswered.  An entry is re-confirmed, while still in
+// use, after 60 seconds.
+
+int arp_getMAC(IPAddr addr, MAC *res);
+// Find MAC address for given IP address, without blocking.  Returns 1 and
+// assigns to *res if it's known; otherwise returns 0 and starts resolving
+// it.
+
 void arp_insert(IPAddr addr, MAC mac);
-// Record an entry in the ARP cache
+// Record an entry in the ARP cache, and send any packets held for it
 
 void arp_remove(IPAddr addr);
 // Remove any existing entry for addr from the ARP cache
 
+typedef struct ARPStats {
+  Uint32 hits;                // lookups answered from the cache
+  Uint32 misses;              // lookups that had to wait for a reply
+  Uint32 requests;            // ARP requests sent
+  Uint32 queued;              // packets held for a reply
+  Uint32 dropped;             // packets discarded unsent
+} ARPStats;
+
+void arp_stats(ARPStats *stats, int reset);
+// Copy the ARP statistics into *stats, then reset them to zero if "reset"
+
 
 ////////////////////////////////////////////////////////////////////////////
 //                                                                        //
@@ -424,13 +675,15 @@ void udp_register(UDPPort p, UDPReceiver receiver);
 // do that by calling udp_freePort.
 
 UDPPort udp_allocPort(UDPReceiver receiver);
-// Allocate an unused, dynamic UDP port number and register an up-call
-// handler for it (or use udp_recv if receiver is NULL).
+// Allocate an unused, dynamic UDP port number (49152 .. 65535) and
+// register an up-call handler for it (or use udp_recv if receiver is
+// NULL).  Returns 0 if every dynamic port is in use.
 
 void udp_freePort(UDPPort p);
 // Free a previously allocated dynamic or well-known UDP Port.
 // Subsequent packets addressed to that port will be discarded (with an
 // ICMP "Destination Unreachable" bounce, if appropriate).
+// Packets still queued for udp_recv are discarded.
 
 int udp_recv(IP **buf, UDPPort p, Microsecs microsecs);
 // If a port was provided with a NULL "receiver" call-back, an incoming
@@ -452,6 +705,31 @@ void udp_send(UDP *buf, Uint32 len);
 // Destination address and port and source port have been placed in header
 // fields of "buf".  "udp_send" fills in source IP, checksums, etc.
 
+void udp_fanOut(UDPPort p, unsigned int firstCore, unsigned int nCores);
+// Pass UDP packets for port "p" that arrive from the Ethernet to
+// application cores firstCore .. firstCore+nCores-1 instead of delivering
+// them here, by enet_forward.  The core is chosen by a hash of the source
+// and destination addresses and ports, so packets of a flow always go to
+// the same core.  Packets are passed on unchecked: see udp_coreCheck.
+// Loopback packets are delivered here as usual.  "nCores" 0 stops it.
+//
+// This is fan-out in software, by core 1, not steering by the controller:
+// every frame for the shared MAC address still arrives at core 1, which
+// parses its IP and UDP headers and forwards it, so core 1's receive path
+// limits the packet rate.  TCP isn't fanned out: it all runs on core 1.
+// The controller can't do better as it stands, since EthWriter.v gives
+// its RISC only the first 16 bytes of a frame, which end before the IP
+// addresses, and it chooses the frame's receive ring from those.
+
+int udp_coreCheck(EnetFrame *f);
+// On an application core: return the UDP payload length of the packet in
+// "f", or -1 if it isn't a valid UDP packet.
+
+void udp_coreReply(EnetFrame *req, UDP *buf, Uint32 len);
+// On an application core: send "len" bytes of UDP payload in "buf" back
+// to the sender of the UDP packet in "req", from the address and port it
+// was sent to.  "req" must not have been a broadcast.
+
 
 ////////////////////////////////////////////////////////////////////////////
 //                                                                        //
@@ -509,9 +787,10 @@ TCP tcp_connect(TCPPort localPort, IPAddr remoteAddr, TCPPort remotePort,
     Microsecs microsecs);
 // Establish a TCP connection from localPort to the given (non-zero)
 // remoteAddr and remotePort.  If localPort is 0, a dynamically allocated
-// purt number is used.  Returns the connection, or NULL if the connection
-// attempt fails (by the timeout expiring, by rejection from the other
-// end).  Use microsecs==0 for an infinite timeout (but why?)
+// purt number (49152 .. 65535) is used.  Returns the connection, or NULL
+// if the connection attempt fails (by the timeout expiring, by rejection
+// from the other end, or for want of a dynamic port).  Use microsecs==0
+// for an infinite timeout (but why?)
 //
 // This provides the semantics of "active open" in RFC 793, or of "connect"
 // in the BSD socket interface.
@@ -592,6 +871,90 @@ void tcp_close(TCP tcp);
 // This has no direct equivalent in RFC 793, but matches (I believe) the
 // default semantics of "close" in the BSD socket interface. 
 
+typedef struct TCPStats {
+  Uint32 segments;            // received with a valid checksum
+  unsigned long long receiveCycles; // processing them, lookup included
+  Uint32 retransmits;         // segments sent again on timeout
+  Uint32 fastRetransmits;     // segments sent again on duplicate ACKs
+  Uint32 sackBlocks;          // SACK blocks received
+  Uint32 badSackBlocks;       // of those, empty or beyond what we sent
+} TCPStats;
+
+void tcp_stats(TCPStats *stats, int reset);
+// Copy the TCP statistics for all connections into *stats, then reset
+// them to zero if "reset"
+
+#define tcpRttBuckets 6
+
+typedef struct TCPConnStats {
+  Uint32 retransmits;         // segments sent again on timeout
+  Microsecs srtt;             // smoothed round trip time; 0 if unmeasured
+  Microsecs rttvar;           // round trip time variation
+  Microsecs rto;              // current retransmission timeout
+  Uint32 fastRetransmits;     // segments sent again on duplicate ACKs
+  Uint32 cwnd;                // congestion window, in bytes
+  Uint32 ssthresh;            // slow start threshold, in bytes
+  int sendScale;              // window scale shifts (RFC 7323) for the
+  int recvScale;              // other end's windows and ours; 0 if unused
+  Uint32 rttSamples[tcpRttBuckets]; // round trip times measured: under
+                              // 100us, 1ms, 10ms, 100ms, 1s, and longer
+} TCPConnStats;
+
+void tcp_connStats(TCP tcp, TCPConnStats *stats);
+// Copy the retransmission statistics and round trip time estimates of the
+// given connection into *stats.
+//
+// Round trip times are measured from the acknowledgement of segments that
+// were transmitted once, and smoothed as in RFC 6298.  Each connection
+// has its own retransmission timeout, doubled on each expiry until an
+// acknowledgement gives a new measurement.
+
+typedef struct TCPCongestion {
+  Uint32 (*ssthresh)(Uint32 cwnd, Uint32 flight, Uint32 mss);
+  void (*acked)(Uint32 *cwnd, Uint32 ssthresh, Uint32 acked, Uint32 mss);
+} TCPCongestion;
+// A congestion control algorithm.  "ssthresh" returns the slow start
+// threshold to use after a loss, given the congestion window and the
+// bytes in flight.  "acked" grows *cwnd when "acked" bytes are newly
+// acknowledged, outside loss recovery.  All sizes are in bytes, and "mss"
+// is the size of a full segment.
+//
+// Loss detection and recovery are common to all algorithms: fast
+// retransmit after 3 duplicate ACKs, then fast recovery until everything
+// then outstanding is acknowledged, retransmitting on each partial ACK
+// (NewReno, RFC 6582).  If both ends agree to selective acknowledgement
+// (SACK, RFC 2018), recovery resends only the segments the other end
+// lacks.  A retransmission timeout sets the window to one segment.
+
+void tcp_setCongestion(TCP tcp, const TCPCongestion *cc);
+// Use the given congestion control algorithm for "tcp", or if "tcp" is
+// NULL for connections created from now on.  A NULL "cc" selects the
+// default, Reno (RFC 5681).
+
+void tcp_setRecvBuffer(TCP tcp, Uint32 bytes);
+// Set the receive buffer size of "tcp", or if "tcp" is NULL the size for
+// connections created from now on.  The default is 32000 bytes; sizes
+// are limited to the range 2 KB to 16 MB.
+//
+// The window we advertise is the free space in this buffer.  Windows
+// over 64 KB need the window scale option (RFC 7323), which is negotiated
+// when the connection is made, to suit the buffer size then.  So a
+// buffer can later grow only as far as that allows (no further than
+// 65535 bytes if it was at most that); and it never shrinks below the
+// data it holds plus the window already advertised.
+
+void tcp_setListenerRecvBuffer(TCPPort localPort, Uint32 bytes);
+// Set the receive buffer size for connections accepted from now on by the
+// listener on localPort, overriding tcp_setRecvBuffer's.  Call this after
+// tcp_listen.
+
+void tcp_setWindowScaling(int offer);
+// Set whether connections created from now on offer the window scale
+// option; a listener's connections follow the setting in force when
+// tcp_listen was called.  The default is true.  Without the option at
+// both ends, windows are limited to 65535 bytes, so this is for testing
+// against peers that don't implement it.
+
 
 ////////////////////////////////////////////////////////////////////////////
 //                                                                        //
@@ -607,6 +970,8 @@ void tcp_close(TCP tcp);
 #define dnsServerRefused (-6)
 #define dnsNameHasNoAddress (-7)
 #define dnsMalformedResponse (-8)
+#define dnsNoBuffer (-9)
+#define dnsNoPort (-10)
 
 int dns_lookup(char *name, IPAddr *res);
 // Assigns an IP address for domain name "name" *res, if available.
@@ -0,0 +1,139 @@
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+// portmap.c                                                              //
+//                                                                        //
+// Small tables keyed by 16-bit numbers, and dynamic port allocation      //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "intercore.h"
+#include "network.h"
+#include "portmap.h"
+
+#define portMapInitialSize 16
+// Slots in a new map; always a power of 2
+
+typedef struct PortMapSlot {
+  Uint32 key;
+  void * value;            // NULL iff the slot is empty
+} PortMapSlot;
+
+struct PortMap {
+  unsigned int size;       // slots, a power of 2
+  unsigned int shift;      // 32 - log2(size)
+  unsigned int count;      // slots in use; at most 3/4 of size
+  PortMapSlot * slots;
+};
+
+#define portSetWords ((65536 - portFirstEphemeral) / 32)
+
+struct PortSet {
+  Uint32 inUse[portSetWords]; // bit i%32 of word i/32: port first+i
+};
+
+static unsigned int portMapHash(PortMap m, Uint16 key) {
+  // Private: home slot of "key", by Fibonacci hashing
+  return (key * 2654435769u) >> m->shift;
+}
+
+static void portMapResize(PortMap m, unsigned int size) {
+  // Private: re-hash m's entries into "size" slots
+  PortMapSlot * old = m->slots;
+  unsigned int oldSize = m->size;
+  m->slots = malloc(size * sizeof(PortMapSlot));
+  memset(m->slots, 0, size * sizeof(PortMapSlot));
+  m->size = size;
+  m->shift = 32;
+  while (size > 1) {
+    m->shift--;
+    size >>= 1;
+  }
+  m->count = 0;
+  for (unsigned int i = 0; i < oldSize; i++) {
+    if (old[i].value) portmap_set(m, old[i].key, old[i].value);
+  }
+  if (old) free(old);
+}
+
+PortMap portmap_create() {
+  // Public: create an empty map
+  PortMap m = malloc(sizeof(*m));
+  m->size = 0;
+  m->slots = NULL;
+  portMapResize(m, portMapInitialSize);
+  return m;
+}
+
+void * portmap_get(PortMap m, Uint16 key) {
+  // Public: return the value for "key", or NULL
+  unsigned int mask = m->size - 1;
+  for (unsigned int i = portMapHash(m, key); ; i = (i + 1) & mask) {
+    PortMapSlot * slot = &m->slots[i];
+    if (!slot->value || slot->key == key) return slot->value;
+  }
+}
+
+void portmap_set(PortMap m, Uint16 key, void * value) {
+  // Public: set or remove the value for "key"
+  unsigned int mask = m->size - 1;
+  unsigned int i = portMapHash(m, key);
+  while (m->slots[i].value && m->slots[i].key != key) i = (i + 1) & mask;
+  PortMapSlot * slot = &m->slots[i];
+  if (value) {
+    if (!slot->value) m->count++;
+    slot->key = key;
+    slot->value = value;
+    if (m->count * 4 > m->size * 3) portMapResize(m, m->size * 2);
+  } else if (slot->value) {
+    // Close the gap, so that every key stays reachable from its home slot
+    // without tombstones: move back any later entry of the run whose home
+    // slot is not between the gap and itself.
+    m->count--;
+    for (unsigned int j = (i + 1) & mask; m->slots[j].value;
+         j = (j + 1) & mask) {
+      unsigned int home = portMapHash(m, m->slots[j].key);
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        m->slots[i] = m->slots[j];
+        i = j;
+      }
+    }
+    m->slots[i].value = NULL;
+  }
+}
+
+PortSet portset_create() {
+  // Public: create a set with no port in use
+  PortSet s = malloc(sizeof(*s));
+  memset(s, 0, sizeof(*s));
+  return s;
+}
+
+Uint16 portset_alloc(PortSet s, unsigned int seed) {
+  // Public: allocate a dynamic port, or return 0
+  unsigned int start = seed % portSetWords;
+  for (unsigned int n = 0; n < portSetWords; n++) {
+    unsigned int w = (start + n) % portSetWords;
+    Uint32 bits = s->inUse[w];
+    if (bits != 0xffffffff) {
+      unsigned int b = 0;
+      while (bits & (1u << b)) b++;
+      s->inUse[w] |= 1u << b;
+      return portFirstEphemeral + w * 32 + b;
+    }
+  }
+  return 0;
+}
+
+void portset_mark(PortSet s, Uint16 port, int inUse) {
+  // Public: note whether "port" is in use
+  if (port < portFirstEphemeral) return;
+  unsigned int i = port - portFirstEphemeral;
+  if (inUse) {
+    s->inUse[i / 32] |= 1u << (i % 32);
+  } else {
+    s->inUse[i / 32] &= ~(1u << (i % 32));
+  }
+}
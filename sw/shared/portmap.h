@@ -0,0 +1,50 @@
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+// portmap.h                                                              //
+//                                                                        //
+// Small tables keyed by 16-bit numbers, for protocol and port dispatch,  //
+// and a bitmap allocator for dynamic ("ephemeral") port numbers.         //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef _PORTMAP_H
+#define _PORTMAP_H
+
+typedef struct PortMap * PortMap;
+//
+// A map from 16-bit keys to non-NULL pointers: an open-addressing hash
+// table, with linear probing, sized for the keys actually present rather
+// than for all 65536.  A lookup is a multiply, a shift and usually one
+// probe.
+//
+// Like a slab, a map takes no locks, and must not be shared between cores.
+
+PortMap portmap_create();
+// Create an empty map
+
+void * portmap_get(PortMap m, Uint16 key);
+// Return the value for "key", or NULL if it has none.
+
+void portmap_set(PortMap m, Uint16 key, void * value);
+// Set the value for "key"; NULL removes it.
+
+#define portFirstEphemeral 49152
+// Dynamic port numbers are 49152 ..  65535 (RFC 6335)
+
+typedef struct PortSet * PortSet;
+//
+// The dynamic port numbers in use, one bit each.  Like a map, a set takes
+// no locks.
+
+PortSet portset_create();
+// Create a set with no port in use
+
+Uint16 portset_alloc(PortSet s, unsigned int seed);
+// Mark in use and return an unused dynamic port, searching from a point
+// chosen by "seed"; 0 if all are in use.
+
+void portset_mark(PortSet s, Uint16 port, int inUse);
+// Note whether "port" is in use.  Ignores ports below portFirstEphemeral,
+// so callers may pass any port they register or free.
+
+#endif
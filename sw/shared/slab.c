@@ -0,0 +1,58 @@
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+// slab.c                                                                 //
+//                                                                        //
+// Pools of fixed-size objects                                            //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+#include <stdlib.h>
+#include "intercore.h"
+#include "slab.h"
+
+#define slabChunkSize 4096
+// Memory is requested from malloc at least this much at a time
+
+struct Slab {
+  unsigned int size;       // object size, a multiple of the cache line
+  unsigned int perChunk;   // objects carved from each malloc
+  void * free;             // free objects, linked through their first word
+};
+
+Slab slab_create(unsigned int size) {
+  // Public: create a slab for objects of "size" bytes
+  Slab s = malloc(sizeof(*s));
+  if (size < sizeof(void *)) size = sizeof(void *);
+  s->size = cacheMultiple(size);
+  s->perChunk = slabChunkSize / s->size;
+  if (s->perChunk == 0) s->perChunk = 1;
+  s->free = NULL;
+  return s;
+}
+
+static void slabGrow(Slab s) {
+  // Private: add a chunk's worth of objects to the free list
+  char * chunk = malloc(s->perChunk * s->size + 31);
+  if (!chunk) return;
+  chunk = cacheAlign(chunk);
+  for (int i = 0; i < s->perChunk; i++) {
+    void ** obj = (void **)(chunk + i * s->size);
+    *obj = s->free;
+    s->free = obj;
+  }
+}
+
+void * slab_alloc(Slab s) {
+  // Public: return an object from s
+  if (!s->free) slabGrow(s);
+  void ** obj = s->free;
+  if (obj) s->free = *obj;
+  return obj;
+}
+
+void slab_free(Slab s, void * obj) {
+  // Public: return obj to s
+  *(void **)obj = s->free;
+  s->free = obj;
+}
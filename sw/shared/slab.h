@@ -0,0 +1,34 @@
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+// slab.h                                                                 //
+//                                                                        //
+// Pools of fixed-size objects, for control blocks that are allocated     //
+// and freed frequently.                                                  //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+typedef struct Slab * Slab;
+//
+// A pool of objects of a single size.  Objects are carved several at a
+// time from malloc'd memory, and freed objects are kept on the slab's
+// free list for re-use; memory is never returned to malloc.
+//
+// A slab takes no locks.  Within one core's non-preemptive threads,
+// slab_alloc and slab_free are atomic.  A slab must not be shared between
+// cores.
+
+Slab slab_create(unsigned int size);
+// Create a slab for objects of "size" bytes.  Each object is cache line
+// aligned and occupies a whole number of cache lines.
+
+void * slab_alloc(Slab s);
+// Return an object from s, or NULL if memory is exhausted.  The object's
+// contents are undefined.
+
+void slab_free(Slab s, void * obj);
+// Return to s an object previously obtained from slab_alloc(s).
+
+#endif
@@ -14,6 +14,8 @@
 #include <stdio.h>
 #include "intercore.h"
 #include "network.h"
+#include "slab.h"
+#include "portmap.h"
 
 #define stateSynSent 1
 #define stateSynReceived 2
@@ -55,15 +57,57 @@ typedef struct MSSOption {
   Uint16 mss;             // Maximum receive segment size.
 } MSSOption;
 
-#define maxRecvWindow 32000
+typedef struct ScaleOption {
+  Octet nop;              // Option-kind = 1, padding
+  Octet scaleKind;        // Option-kind = 3, window scale (RFC 7323)
+  Octet scaleLen;         // Option-length = 3
+  Octet shift;            // Our advertised windows are shifted this far
+} ScaleOption;
+
+typedef struct SackPermittedOption {
+  Octet nop1;             // Option-kind = 1, padding
+  Octet nop2;
+  Octet sackPermittedKind; // Option-kind = 4, SACK-permitted (RFC 2018)
+  Octet sackPermittedLen; // Option-length = 2
+} SackPermittedOption;
+
+#define tcpMaxSackBlocks 4       // as many as fit with no other options
+
+typedef struct SackOption {
+  Octet nop1;             // Option-kind = 1, padding
+  Octet nop2;
+  Octet sackKind;         // Option-kind = 5, SACK (RFC 2018)
+  Octet sackLen;          // Option-length = 2 + 8 per block
+  Uint32 edges[2 * tcpMaxSackBlocks]; // left and right edges of blocks
+} SackOption;
+
+#define tcpDefaultRecvBuf 32000
+#define tcpMinRecvBuf 2048       // limits for tcp_setRecvBuffer
+#define tcpMaxRecvBuf (1 << 24)
+#define tcpMaxScale 14           // largest window scale shift (RFC 7323)
+#define tcpInitialRto 1000000    // before any RTT sample, as in RFC 6298
+#define tcpMinRto 50000          // allows for delayed ACKs at the other end
+#define tcpMaxRto 60000000
+#define tcpGiveUp 20000000       // abort if unacknowledged for this long
+#define tcpBufferWait 10000      // tcp_send's wait when enet_alloc fails
+#define tcpMss (ipPayloadSize - sizeof(TCPHeader)) // largest data we send
+#define tcpInitialCwnd (3 * tcpMss) // as in RFC 5681, for our tcpMss
+#define tcpDupAckThreshold 3     // duplicate ACKs that signal a loss
+
+#define recoveryNone 0           // values of tcp->recovery
+#define recoveryFast 1           // after fast retransmit (RFC 6582)
+#define recoveryTimeout 2        // after a retransmission timeout
 
 typedef struct TransmitElem { // (re)transmission queue element
   IP *buf;
   Uint32 len;             // TCP payload bytes currently in buf
   Uint32 seq;             // sequence number of first byte in buf
+  Uint32 sum;             // csum_partial of the "len" payload bytes
   Uint16 flag;            // extra flag for transmission (PUSH or FIN)
   Microsecs sentAt;       // time at which buf was last transmitted
   Microsecs firstSentAt;  // time at which buf was first transmitted
+  int retransmitted;      // bool: buf was sent again, so gives no RTT sample
+  int sacked;             // bool: the other end has it, out of order
   struct TransmitElem *next;
 } TransmitElem;
 
@@ -85,13 +129,40 @@ struct TCP {              // Connection state block
   TransmitElem *transmitHead; // retransmission queue
   TransmitElem *transmitTail; // current, untransmitted, send buffer
   Octet *recvBuf;         // cyclic queue of data not yet consumed by client
+  int recvBufSize;        // size of recvBuf
   int recvBufStart;       // start of data in recvBuf
   int recvBufCount;       // amount of data in recvBuf
   int recvPushed;         // last received byte had the PUSH flag set
-  IP *outOfOrderHead;     // head of ouot-of-order packet queue
+  IP *outOfOrderHead;     // head of out-of-order packet queue, by seq
   IP *outOfOrderTail;     // tail of out-of-order packet queue
+  Uint32 outOfOrderLatest; // seq of the latest arrival on that queue
   TCP nextPending;        // list of not-yet-accepted connections
-  TCP nextActive;         // list of connections for localPort
+  TCP nextActive;         // list of all connections
+  TCP prevActive;
+  TCP nextHash;           // list of connections in the same tcpHash bucket
+  int dynamicPort;        // localPort was allocated from tcpDynamic
+  int windowScaled;       // bool: window scale option offered or agreed
+  int sendScale;          // shift for the other end's advertised windows
+  int recvScale;          // shift for the windows we advertise
+  int sackOk;             // bool: SACK-permitted offered or agreed
+  Uint32 sackHigh;        // end of the highest block SACKed by other end
+  Uint32 highRxt;         // end of data retransmitted in this recovery
+  Microsecs srtt;         // smoothed round trip time; 0 until first sample
+  Microsecs rttvar;       // round trip time variation
+  Microsecs rto;          // retransmission timeout, before backoff
+  int backoff;            // rto is doubled this many times
+  Microsecs synSentAt;    // time at which our SYN was first transmitted
+  Microsecs timerAt;      // when the retransmission timer expires
+  int timerSlot;          // index in tcpTimers, or -1 if not running
+  Uint32 retransmits;     // segments retransmitted on timeout
+  Uint32 rttSamples[tcpRttBuckets]; // RTT distribution, as in TCPConnStats
+  const TCPCongestion *cc; // congestion control algorithm
+  Uint32 cwnd;            // congestion window, relative to sendUnack
+  Uint32 ssthresh;        // slow start threshold
+  int dupAcks;            // consecutive duplicate ACKs
+  int recovery;           // recoveryNone, recoveryFast or recoveryTimeout
+  Uint32 recover;         // recovery ends when this is acknowledged
+  Uint32 fastRetransmits; // segments retransmitted on duplicate/partial ACK
 };
 
 typedef struct Listener {
@@ -101,6 +172,8 @@ typedef struct Listener {
   TCP pending;            // queue of established but not accepted
   TCP pendingTail;
   int pendingCount;       // length of pending
+  int recvBufSize;        // for its connections; 0 for tcpRecvBufSize
+  int windowScaled;       // bool: its connections offer window scaling
 } * Listener;
 
 static Mutex tcpMutex = NULL;
@@ -108,21 +181,80 @@ static Condition tcpAcceptCond = NULL;
 static Condition tcpConnectCond = NULL;
 static Condition tcpRecvCond = NULL;
 static Condition tcpCloseCond = NULL;
-static Condition tcpCreateCond = NULL;
+static Condition tcpTimerCond = NULL;
 static Condition tcpSendCond = NULL;
 static IP *tcpSmallBuf = NULL;   // for transmitting SYN, ACK, RST, etc.
+static Slab transmitElemSlab;    // for TransmitElem
 static TCP tcpActive;            // active connection list
-static Listener *tcpListeners;   // listening state; NULL if not in use
+#define tcpHashBits 10
+#define tcpHashSize (1 << tcpHashBits) // buckets in tcpHash
+static TCP *tcpHash;             // connections, by tcpHashOf their 4-tuple
+static TCPStats tcpStats;
+static const TCPCongestion *tcpDefaultCc; // for new connections
+static TCP *tcpTimers;           // running timers, as a heap on timerAt
+static int tcpTimerCount;        // entries in tcpTimers
+static int tcpTimerSpace;        // allocated size of tcpTimers
+static PortMap tcpListeners;     // Listener, by port; absent if not in use
+static PortSet tcpDynamic;       // dynamic ports allocated by tcp_connect
+static int tcpRecvBufSize;       // recvBufSize for new connections
+static int tcpWindowScaling;     // bool: new connections offer scaling
+static IP *tcpStaged;            // segment whose payload is in its recvBuf
 static unsigned int tcpSeed;     // state for various random numbers
 
 static Uint32 tcpHeaderSize(IP *buf) {
   return (ntohs(((TCPHeader *)ip_payload(buf))->misc) >> 12) << 2;
 }
 
+static Octet *tcpOption(IP *buf, int kind) {
+  // Return the option of the given kind in a received segment, or NULL if
+  // it has none.  The option's length has been checked against the header
+  Uint32 hSize = tcpHeaderSize(buf);
+  if (hSize > ip_payloadSize(buf)) return NULL;
+  Octet *opt = ip_payload(buf) + sizeof(TCPHeader);
+  Octet *end = ip_payload(buf) + hSize;
+  while (opt < end && opt[0] != 0) { // kind 0 is end of options
+    if (opt[0] == 1) { // NOP
+      opt++;
+    } else {
+      if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) break;
+      if (opt[0] == kind) return opt;
+      opt += opt[1];
+    }
+  }
+  return NULL;
+}
+
+static Uint32 tcpWindow(TCP tcp, IP *buf) {
+  // The window advertised by a received segment, in bytes
+  TCPHeader *tcpHeader = (TCPHeader *)ip_payload(buf);
+  Uint32 window = ntohs(tcpHeader->window);
+  if (ntohs(tcpHeader->misc) & flagSyn) return window; // never scaled
+  return window << tcp->sendScale;
+}
+
 static Octet * tcpPayload(IP *buf) {
   return ip_payload(buf) + tcpHeaderSize(buf);
 }
 
+static Uint32 segSeq(IP *buf) {
+  // Sequence number of a received segment's first data byte
+  TCPHeader *tcpHeader = (TCPHeader *)ip_payload(buf);
+  Uint32 seq = ntoh(tcpHeader->seq);
+  return (ntohs(tcpHeader->misc) & flagSyn ? seq + 1 : seq);
+}
+
+static Uint32 segEnd(IP *buf) {
+  // Sequence number just beyond a received segment's data and FIN
+  TCPHeader *tcpHeader = (TCPHeader *)ip_payload(buf);
+  Uint32 end = segSeq(buf) + ip_payloadSize(buf) - tcpHeaderSize(buf);
+  return (ntohs(tcpHeader->misc) & flagFin ? end + 1 : end);
+}
+
+static Uint32 elemEnd(TransmitElem *elem) {
+  // Sequence number just beyond a transmission buffer's data and FIN
+  return elem->seq + elem->len + (elem->flag == flagFin ? 1 : 0);
+}
+
 static int seqComp(Uint32 a, Uint32 b) {
   // Compare sequence numbers, with appropriate wrapping at 2^32,
   // i.e., such that seqComp(1, 2^32-1) == 1.
@@ -136,11 +268,60 @@ static int seqComp(Uint32 a, Uint32 b) {
 Uint16 payloadChecksum(IP *buf, Uint32 len);
 static void tcpInit();
 
-static void tcpSend(TCP tcp, IP *buf, Uint32 len, Uint32 bufSeq,
-                    Uint16 flags) {
-  // Transmit the buffer as a TCP packet.
-  // "len" is TCP payload length.
+static IP *outOfOrderRange(IP *this, Uint32 *left, Uint32 *right) {
+  // Set [*left, *right) to the range covered by "this" and any following
+  // segments of the out-of-order queue that overlap or abut it; return the
+  // first segment after that range
+  *left = segSeq(this);
+  *right = segEnd(this);
+  for (this = this->next; this && seqComp(segSeq(this), *right) <= 0;
+       this = this->next) {
+    if (seqComp(segEnd(this), *right) > 0) *right = segEnd(this);
+  }
+  return this;
+}
+
+static int sackBlocks(TCP tcp, SackOption *opt) {
+  // Describe our out-of-order queue in a SACK option; return the option's
+  // size, or 0 if there's nothing to report.  As RFC 2018 asks, the first
+  // block holds the latest arrival; the rest follow in sequence order.
+  int n = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    IP *this = tcp->outOfOrderHead;
+    while (this && n < tcpMaxSackBlocks) {
+      Uint32 left, right;
+      this = outOfOrderRange(this, &left, &right);
+      if (seqComp(left, tcp->recvNext) <= 0) continue; // not beyond a hole
+      int latest = (seqComp(left, tcp->outOfOrderLatest) <= 0 &&
+                    seqComp(tcp->outOfOrderLatest, right) < 0);
+      if (latest == (pass == 0)) {
+        opt->edges[2*n] = hton(left);
+        opt->edges[2*n + 1] = hton(right);
+        n++;
+      }
+    }
+  }
+  if (n == 0) return 0;
+  opt->nop1 = 1;
+  opt->nop2 = 1;
+  opt->sackKind = 5;
+  opt->sackLen = 2 + 8 * n;
+  return 4 + 8 * n;
+}
+
+static int tcpSend(TCP tcp, IP *buf, Uint32 len, Uint32 sum, Uint32 bufSeq,
+                   Uint16 flags) {
+  // Transmit the buffer as a TCP packet, and return true; or false if
+  // it's still being sent from a previous call.
+  // "len" is TCP payload length, and "sum" its partial checksum.
   // Assumes tcpMutex is held
+  //
+  // Data segments stay on the transmission queue until acked, so they're
+  // sent without copying; tcpSmallBuf is reused at once, so it's copied.
+  // A segment still being sent from a previous call is left alone: it's
+  // about to go out anyway, and rewriting its header now could corrupt it.
+  int copy = (buf == tcpSmallBuf);
+  if (!copy && enet_busy((Enet *)buf)) return 0;
   buf->ip.dest = hton(tcp->remoteAddr);
   buf->ip.protocol = ipProtocolTCP;
   buf->ip.versionAndLen = 0x45; // IPv4, 5 words in header
@@ -154,22 +335,209 @@ static void tcpSend(TCP tcp, IP *buf, Uint32 len, Uint32 bufSeq,
     mssOption->mssLen = 4;
     mssOption->mss = htons(ipPayloadSize - sizeof(TCPHeader));
     hSize += sizeof(MSSOption);
+    if (tcp->windowScaled) {
+      ScaleOption *scaleOption = (ScaleOption *)(ip_payload(buf) + hSize);
+      scaleOption->nop = 1;
+      scaleOption->scaleKind = 3;
+      scaleOption->scaleLen = 3;
+      scaleOption->shift = tcp->recvScale;
+      hSize += sizeof(ScaleOption);
+    }
+    if (tcp->sackOk) {
+      SackPermittedOption *sackPermittedOption =
+        (SackPermittedOption *)(ip_payload(buf) + hSize);
+      sackPermittedOption->nop1 = 1;
+      sackPermittedOption->nop2 = 1;
+      sackPermittedOption->sackPermittedKind = 4;
+      sackPermittedOption->sackPermittedLen = 2;
+      hSize += sizeof(SackPermittedOption);
+    }
+  } else if (copy && tcp->sackOk && tcp->outOfOrderHead &&
+             !(flags & (flagSyn | flagReset))) {
+    // Data segments have no room for options, so only plain ACKs carry
+    // SACK blocks; but those are what we send on out-of-order arrivals
+    hSize += sackBlocks(tcp, (SackOption *)(ip_payload(buf) + hSize));
   }
   tcpHeader->srce = htons(tcp->localPort);
   tcpHeader->dest = htons(tcp->remotePort);
   tcpHeader->seq = hton(bufSeq);
   tcpHeader->ack = hton(tcp->recvNext);
   tcpHeader->misc = htons(flags | ((hSize >> 2) << 12));
-  tcpHeader->window = htons(tcp->recvWindow);
+  // The window in a SYN is never scaled
+  Uint32 window = tcp->recvWindow >> (flags & flagSyn ? 0 : tcp->recvScale);
+  tcpHeader->window = htons(window > 65535 ? 65535 : window);
   tcpHeader->checksum = 0;
-  tcpHeader->checksum = payloadChecksum((IP *)buf, len + tcpHeaderSize(buf));
-  ip_send(buf, len + tcpHeaderSize(buf), 0, 0);
+  if (!ip_isLoopback(tcp->remoteAddr)) {
+    // Only the header needs summing: the payload was summed as it was
+    // copied in, and is summed once however often it's retransmitted.
+    Uint32 res = csum_pseudo(buf, len + hSize);
+    res = csum_partial(tcpHeader, hSize, res);
+    tcpHeader->checksum = csum_fold(csum_add(res, sum, hSize));
+  }
+  if (copy) {
+    ip_send(buf, len + tcpHeaderSize(buf), 0, 0);
+  } else {
+    ip_sendNoCopy(buf, len + tcpHeaderSize(buf), 0, 0);
+  }
+  return 1;
+}
+
+static IP *smallBuf() {
+  // Return tcpSmallBuf, allocating it if need be; NULL if enet_alloc fails.
+  // Assumes tcpMutex is held
+  if (!tcpSmallBuf) tcpSmallBuf = (IP *)enet_alloc();
+  return tcpSmallBuf;
 }
 
 static void sendSmall(TCP tcp, Uint32 seq, Uint16 flags) {
-  // Send a SYN and/or ACK using tcpSmallBuf
+  // Send a SYN and/or ACK using tcpSmallBuf.  Without a buffer the
+  // segment is dropped, and recovered from as if lost.
   // Assumes tcpMutex is held
-  tcpSend(tcp, tcpSmallBuf, 0, seq, flags);
+  IP *buf = smallBuf();
+  if (buf) tcpSend(tcp, buf, 0, 0, seq, flags);
+}
+
+static Uint32 tcpHashOf(TCPPort localPort, IPAddr remoteAddr,
+                        TCPPort remotePort) {
+  // Bucket in tcpHash for a connection's 4-tuple (our own address being
+  // the same for all)
+  Uint32 h = remoteAddr ^ ((remotePort << 16) | localPort);
+  return (h * 2654435769u) >> (32 - tcpHashBits);
+}
+
+static void timerSwap(int i, int j) {
+  // Exchange two entries of tcpTimers
+  TCP t = tcpTimers[i];
+  tcpTimers[i] = tcpTimers[j];
+  tcpTimers[j] = t;
+  tcpTimers[i]->timerSlot = i;
+  tcpTimers[j]->timerSlot = j;
+}
+
+static void timerSift(int i) {
+  // Restore the heap order of tcpTimers after entry i has changed
+  while (i > 0 && tcpTimers[i]->timerAt < tcpTimers[(i-1)/2]->timerAt) {
+    timerSwap(i, (i-1)/2);
+    i = (i-1)/2;
+  }
+  for (;;) {
+    int least = i;
+    int child = 2*i + 1;
+    for (int c = child; c < child + 2 && c < tcpTimerCount; c++) {
+      if (tcpTimers[c]->timerAt < tcpTimers[least]->timerAt) least = c;
+    }
+    if (least == i) break;
+    timerSwap(i, least);
+    i = least;
+  }
+}
+
+static void timerCancel(TCP tcp) {
+  // Stop tcp's retransmission timer, if it's running.
+  // Assumes tcpMutex is held.
+  int i = tcp->timerSlot;
+  if (i < 0) return;
+  tcp->timerSlot = -1;
+  tcpTimerCount--;
+  if (i < tcpTimerCount) {
+    tcpTimers[i] = tcpTimers[tcpTimerCount];
+    tcpTimers[i]->timerSlot = i;
+    timerSift(i);
+  }
+}
+
+static void timerSet(TCP tcp, Microsecs at) {
+  // (Re)start tcp's retransmission timer, to expire at the given time.
+  // Assumes tcpMutex is held.
+  if (tcp->timerSlot < 0) {
+    if (tcpTimerCount == tcpTimerSpace) {
+      tcpTimerSpace = (tcpTimerSpace ? 2 * tcpTimerSpace : 64);
+      TCP *timers = malloc(tcpTimerSpace * sizeof(TCP));
+      if (tcpTimers) {
+        bcopy(tcpTimers, timers, tcpTimerCount * sizeof(TCP));
+        free(tcpTimers);
+      }
+      tcpTimers = timers;
+    }
+    tcp->timerSlot = tcpTimerCount++;
+    tcpTimers[tcp->timerSlot] = tcp;
+  }
+  tcp->timerAt = at;
+  timerSift(tcp->timerSlot);
+  if (tcpTimers[0] == tcp) condition_signal(tcpTimerCond);
+}
+
+static Microsecs tcpRto(TCP tcp) {
+  // Current retransmission timeout, including exponential backoff
+  Microsecs rto = tcp->rto << tcp->backoff;
+  return (rto > tcpMaxRto ? tcpMaxRto : rto);
+}
+
+static void tcpTimerUpdate(TCP tcp, int restart) {
+  // Run the retransmission timer iff something we sent is unacknowledged,
+  // starting it afresh if "restart".  Assumes tcpMutex is held.
+  if (tcp->state == stateClosed || tcp->sendUnack == tcp->transmitted) {
+    timerCancel(tcp);
+  } else if (restart || tcp->timerSlot < 0) {
+    timerSet(tcp, thread_now() + tcpRto(tcp));
+  }
+}
+
+static void tcpRttSample(TCP tcp, Microsecs rtt) {
+  // Update the round trip estimates from one measurement, per Jacobson
+  // and Karels (RFC 6298).  A valid sample also ends any backoff.
+  if (tcp->srtt == 0) {
+    tcp->srtt = rtt;
+    tcp->rttvar = rtt / 2;
+  } else {
+    Microsecs err = rtt - tcp->srtt;
+    tcp->srtt += err / 8;
+    tcp->rttvar += ((err < 0 ? -err : err) - tcp->rttvar) / 4;
+  }
+  tcp->rto = tcp->srtt + 4 * tcp->rttvar;
+  if (tcp->rto < tcpMinRto) tcp->rto = tcpMinRto;
+  if (tcp->rto > tcpMaxRto) tcp->rto = tcpMaxRto;
+  tcp->backoff = 0;
+  int i = 0;
+  for (Microsecs bound = 100; i < tcpRttBuckets - 1 && rtt >= bound;
+       bound *= 10) i++;
+  tcp->rttSamples[i]++;
+}
+
+static Uint32 renoSsthresh(Uint32 cwnd, Uint32 flight, Uint32 mss) {
+  // Reno's slow start threshold after a loss: half the data in flight
+  return (flight / 2 > 2 * mss ? flight / 2 : 2 * mss);
+}
+
+static void renoAcked(Uint32 *cwnd, Uint32 ssthresh, Uint32 acked,
+                      Uint32 mss) {
+  // Reno's window growth: by up to one segment per ACK in slow start, and
+  // by about one segment per window in congestion avoidance (RFC 5681)
+  if (*cwnd < ssthresh) {
+    *cwnd += (acked < mss ? acked : mss);
+  } else {
+    // mss * acked / *cwnd, without overflowing for large windows
+    Uint32 segments = *cwnd / mss;
+    Uint32 more = (segments ? acked / segments : acked);
+    *cwnd += (more ? more : 1);
+  }
+}
+
+static const TCPCongestion tcpReno = { renoSsthresh, renoAcked };
+
+static int tcpScaleFor(int size) {
+  // The window scale shift needed to advertise a receive buffer this big
+  int shift = 0;
+  while (shift < tcpMaxScale && (size >> shift) > 65535) shift++;
+  return shift;
+}
+
+static void setRecvBufSize(TCP tcp, int size) {
+  // Set the receive buffer size of a connection that hasn't yet sent or
+  // received a SYN, and the window scale it will offer to match
+  tcp->recvBufSize = size;
+  tcp->recvWindow = size;
+  tcp->recvScale = tcpScaleFor(size);
 }
 
 static TCP createTcp(TCPPort localPort, IPAddr remoteAddr, 
@@ -192,7 +560,13 @@ static TCP createTcp(TCPPort localPort, IPAddr remoteAddr,
   tcp->transmitted = tcp->sendNext;
   tcp->recvInit = 0;
   tcp->recvNext = 0;
-  tcp->recvWindow = maxRecvWindow;
+  setRecvBufSize(tcp, tcpRecvBufSize);
+  tcp->windowScaled = tcpWindowScaling;
+  tcp->sendScale = 0;
+  tcp->sackOk = 1;
+  tcp->sackHigh = tcp->sendInit;
+  tcp->highRxt = tcp->sendInit;
+  tcp->outOfOrderLatest = 0;
   tcp->transmitHead = tcp->transmitTail = NULL;
   tcp->recvBuf = NULL;
   tcp->recvBufStart = 0;
@@ -200,35 +574,55 @@ static TCP createTcp(TCPPort localPort, IPAddr remoteAddr,
   tcp->recvPushed = 0;
   tcp->outOfOrderHead = tcp->outOfOrderTail = NULL;
   tcp->nextPending = NULL;
-  if (!tcpActive) condition_broadcast(tcpCreateCond);
+  tcp->dynamicPort = 0;
+  tcp->srtt = 0;
+  tcp->rttvar = 0;
+  tcp->rto = tcpInitialRto;
+  tcp->backoff = 0;
+  tcp->synSentAt = 0;
+  tcp->timerSlot = -1;
+  tcp->retransmits = 0;
+  for (int i = 0; i < tcpRttBuckets; i++) tcp->rttSamples[i] = 0;
+  tcp->cc = tcpDefaultCc;
+  tcp->cwnd = tcpInitialCwnd;
+  tcp->ssthresh = 0xffffffff;
+  tcp->dupAcks = 0;
+  tcp->recovery = recoveryNone;
+  tcp->recover = tcp->sendInit;
+  tcp->fastRetransmits = 0;
   tcp->nextActive = tcpActive;
+  tcp->prevActive = NULL;
+  if (tcpActive) tcpActive->prevActive = tcp;
   tcpActive = tcp;
+  // A new connection goes first in its bucket, so it hides any closed one
+  // with the same 4-tuple (see tcpRejectUnknown)
+  TCP *bucket = &tcpHash[tcpHashOf(localPort, remoteAddr, remotePort)];
+  tcp->nextHash = *bucket;
+  *bucket = tcp;
   return tcp;
 }
 
 static void deleteTcp(TCP tcp) {
-  // Remove tcb from the active list, and free it
+  // Remove tcb from the active list and tcpHash, and free it
   // Assumes tcpMutex is locked
-  TCP prev = NULL;
-  TCP this;
-  for (this = tcpActive; this != NULL; this = this->nextActive) {
-    if (this == tcp) {
-      if (prev) {
-        prev->nextActive = this->nextActive;
-      } else {
-        tcpActive = this->nextActive;
-      }
-      break;
+  TCP this = tcp;
+  if (this) {
+    if (this->prevActive) {
+      this->prevActive->nextActive = this->nextActive;
     } else {
-      prev = this;
+      tcpActive = this->nextActive;
     }
-  }
-  if (this) {
+    if (this->nextActive) this->nextActive->prevActive = this->prevActive;
+    timerCancel(this);
+    TCP *link = &tcpHash[tcpHashOf(this->localPort, this->remoteAddr,
+                                   this->remotePort)];
+    while (*link != this) link = &(*link)->nextHash;
+    *link = this->nextHash;
     TransmitElem *elem = this->transmitHead;
     while (elem) {
       TransmitElem *next = elem->next;
-      enet_free((Enet *)elem->buf);
-      free(elem);
+      if (elem->buf) enet_free((Enet *)elem->buf);
+      slab_free(transmitElemSlab, elem);
       elem = next;
     }
     this->transmitHead = NULL;
@@ -239,6 +633,7 @@ static void deleteTcp(TCP tcp) {
       enet_free((Enet *)oooBuf);
       oooBuf = next;
     }
+    if (this->dynamicPort) portset_mark(tcpDynamic, this->localPort, 0);
     free(this);
   }
 }
@@ -247,9 +642,8 @@ static TCP findTcp(TCPPort localPort, IPAddr remoteAddr,
                    TCPPort remotePort) {
   // Find existing connection, if any.
   // Assumes tcpMutex is held.
-  // TEMP: a hash table would be a good idea.
-  TCP tcp;
-  for (tcp = tcpActive; tcp != NULL; tcp = tcp->nextActive) {
+  TCP tcp = tcpHash[tcpHashOf(localPort, remoteAddr, remotePort)];
+  for (; tcp != NULL; tcp = tcp->nextHash) {
     if (tcp->localPort == localPort &&
         tcp->remoteAddr == remoteAddr &&
         tcp->remotePort == remotePort) break;
@@ -258,14 +652,19 @@ static TCP findTcp(TCPPort localPort, IPAddr remoteAddr,
 }
 
 static void appendTransmitElem(TCP tcp) {
-  // Append an element to our transmission queue.
+  // Append an element to our transmission queue.  Its buffer is
+  // allocated when data is first put in it (tcp_send), so an element
+  // that stays empty (SYN, FIN, or a bare PUSH) never needs one.
   // Assumes tcpMutex is held.
-  TransmitElem *elem = malloc(sizeof(TransmitElem));
-  elem->buf = (IP *)enet_alloc();
+  TransmitElem *elem = slab_alloc(transmitElemSlab);
+  elem->buf = NULL;
   elem->len = 0;
+  elem->sum = 0;
   elem->seq = tcp->sendNext;
   elem->flag = 0;
   elem->sentAt = 0;
+  elem->retransmitted = 0;
+  elem->sacked = 0;
   elem->next = NULL;
   if (tcp->transmitHead) {
     tcp->transmitTail->next = elem;
@@ -278,15 +677,20 @@ static void appendTransmitElem(TCP tcp) {
 static void pruneTransmitQueue(TCP tcp) {
   // Remove acknowledged data from the transmission queue.
   // Assumes tcpMutex is held.
+  // The newest element acknowledged gives an RTT sample, unless it was
+  // retransmitted, when the ACK might be for either copy (Karn's rule).
   Uint32 ack = tcp->sendUnack;
+  Microsecs sentAt = 0;
   while (tcp->transmitHead != tcp->transmitTail) {
     TransmitElem *elem = tcp->transmitHead;
     Uint32 contents = elem->len + (elem->flag == flagFin ? 1 : 0);
     if (seqComp(ack, elem->seq + contents) < 0) break;
+    sentAt = (elem->retransmitted ? 0 : elem->sentAt);
     tcp->transmitHead = elem->next;
-    enet_free((Enet *)elem->buf);
-    free(elem);
+    if (elem->buf) enet_free((Enet *)elem->buf);
+    slab_free(transmitElemSlab, elem);
   }
+  if (sentAt) tcpRttSample(tcp, thread_now() - sentAt);
 }
 
 void tcp_listen(TCPPort localPort, IPAddr remoteAddr, TCPPort remotePort,
@@ -295,19 +699,22 @@ void tcp_listen(TCPPort localPort, IPAddr remoteAddr, TCPPort remotePort,
   mutex_acquire(tcpMutex);
   Listener listener;
   TCP abandoned = NULL; // Queue of abandoned connections
-  if (!(listener = tcpListeners[localPort])) {
-    listener = tcpListeners[localPort] = malloc(sizeof(struct Listener));
+  if (!(listener = portmap_get(tcpListeners, localPort))) {
+    listener = malloc(sizeof(struct Listener));
+    portmap_set(tcpListeners, localPort, listener);
     listener->pending = NULL;
     listener->pendingTail = NULL;
     listener->pendingCount = 0;
+    listener->recvBufSize = 0;
   }
+  listener->windowScaled = tcpWindowScaling;
   listener->remoteAddr = remoteAddr;
   listener->remotePort = remotePort;
   listener->backlog = backlog;
   if (backlog < 0) {
     abandoned = listener->pending;
     free(listener);
-    tcpListeners[localPort] = NULL;
+    portmap_set(tcpListeners, localPort, NULL);
   }
   mutex_release(tcpMutex);
   while (abandoned != NULL) {
@@ -325,7 +732,7 @@ TCP tcp_accept(TCPPort localPort, IPAddr *remoteAddr, TCPPort *remotePort,
   mutex_acquire(tcpMutex);
   while (!tcp) {
     Listener listener;
-    while ((listener = tcpListeners[localPort]) &&
+    while ((listener = portmap_get(tcpListeners, localPort)) &&
            (!listener->pending ||
             listener->pending->state == stateSynReceived)) {
       if (condition_timedWait(tcpAcceptCond, tcpMutex, microsecs)) {
@@ -356,19 +763,23 @@ TCP tcp_connect(TCPPort localPort, IPAddr remoteAddr, TCPPort remotePort,
   if (remoteAddr == 0 || remotePort == 0) return NULL;
   // TEMP: should also reject broadcast and multicast addresses
   mutex_acquire(tcpMutex);
-  if (localPort == 0) {
-    for (;;) {
-      localPort = rand_r(&tcpSeed) & 65535;
-      if (localPort > 1024 &&
-          !findTcp(localPort, remoteAddr, remotePort)) break;
+  int dynamicPort = (localPort == 0);
+  if (dynamicPort) {
+    localPort = portset_alloc(tcpDynamic, rand_r(&tcpSeed));
+    if (localPort == 0) {
+      mutex_release(tcpMutex);
+      return NULL;
     }
   }
   TCP tcp = createTcp(localPort, remoteAddr, remotePort);
+  tcp->dynamicPort = dynamicPort;
   sendSmall(tcp, tcp->sendNext, flagSyn);
+  tcp->synSentAt = thread_now();
   tcp->sendNext++;
   tcp->transmitted = tcp->sendNext;
   tcp->state = stateSynSent;
   appendTransmitElem(tcp);
+  tcpTimerUpdate(tcp, 0);
   while (tcp->state == stateSynSent || tcp->state == stateSynReceived) {
     if (condition_timedWait(tcpConnectCond, tcpMutex, microsecs)) {
       tcp->state = stateClosed;
@@ -383,10 +794,16 @@ TCP tcp_connect(TCPPort localPort, IPAddr remoteAddr, TCPPort remotePort,
   return tcp;
 }
 
-static void transmitElemNow(TCP tcp, TransmitElem *elem) {
-  // Transmit given buffer now.
-  tcpSend(tcp, elem->buf, elem->len, elem->seq, flagAck | elem->flag);
+static int transmitElemNow(TCP tcp, TransmitElem *elem) {
+  // Transmit given buffer now, and return true; or false if it's still
+  // being sent from before, so hasn't been sent again.  An empty element
+  // may have no buffer of its own, so it goes from tcpSmallBuf; if
+  // there's neither, it's treated as sent and lost.
+  IP *buf = (elem->buf ? elem->buf : smallBuf());
+  if (buf && !tcpSend(tcp, buf, elem->len, elem->sum, elem->seq,
+                      flagAck | elem->flag)) return 0;
   elem->sentAt = thread_now();
+  return 1;
 }
 
 static void abortInner(TCP tcp) {
@@ -408,38 +825,78 @@ static void abortInner(TCP tcp) {
   condition_broadcast(tcpCloseCond);
 }
 
+static void tcpTimeout(TCP tcp) {
+  // tcp's retransmission timer has expired: send the oldest unacknowledged
+  // segment again, and restart the timer with the timeout doubled.  If
+  // that segment is still being sent, it isn't lost: just wait again.
+  // Assumes tcpMutex is held.
+  switch (tcp->state) {
+  case stateSynSent:
+    sendSmall(tcp, tcp->sendInit, flagSyn);
+    break;
+  case stateSynReceived:
+    sendSmall(tcp, tcp->sendInit, flagSyn | flagAck);
+    break;
+  case stateClosed:
+    return;
+  default: {
+    TransmitElem *elem = tcp->transmitHead;
+    if (elem == tcp->transmitTail) return;
+    if (elem->sentAt - elem->firstSentAt > tcpGiveUp) {
+      abortInner(tcp);
+      return;
+    }
+    if (!transmitElemNow(tcp, elem)) {
+      timerSet(tcp, thread_now() + tcpRto(tcp));
+      return;
+    }
+    if (tcp->recovery != recoveryTimeout) {
+      // Repeated timeouts for the same loss don't reduce ssthresh again
+      tcp->ssthresh = tcp->cc->ssthresh(tcp->cwnd,
+                                        tcp->transmitted - tcp->sendUnack,
+                                        tcpMss);
+    }
+    tcp->cwnd = tcpMss;
+    tcp->recovery = recoveryTimeout;
+    tcp->recover = tcp->transmitted;
+    tcp->dupAcks = 0;
+    // The other end may have discarded what it SACKed (RFC 2018), so
+    // forget that, and start again from the oldest data
+    for (TransmitElem *e = elem; e != tcp->transmitTail; e = e->next) {
+      e->sacked = 0;
+    }
+    tcp->sackHigh = tcp->sendUnack;
+    elem->retransmitted = 1;
+    tcp->highRxt = elemEnd(elem);
+    break;
+    }
+  }
+  tcp->retransmits++;
+  tcpStats.retransmits++;
+  if (tcpRto(tcp) < tcpMaxRto) tcp->backoff++;
+  timerSet(tcp, thread_now() + tcpRto(tcp));
+}
+
 static void retransmitter(void *arg) {
   // Our retransmission thread.  The transmitted packets are listed
   // starting at transmitHead; transmitTail has not been transmitted;
   // both are always valid any time we can see them.
   //
-  // TEMP: we make no attempt at sensible timing decisions
+  // Each connection with unacknowledged data has a timer in tcpTimers;
+  // we sleep until the earliest of them expires.
   //
   mutex_acquire(tcpMutex);
   for (;;) {
-    while (!tcpActive) condition_wait(tcpCreateCond, tcpMutex);
-    condition_timedWait(tcpCreateCond, tcpMutex, 2000000);
-    for (TCP tcp = tcpActive; tcp != NULL; tcp = tcp->nextActive) {
-      switch (tcp->state) {
-      case stateSynSent:
-        sendSmall(tcp, tcp->sendInit, flagSyn);
-        break;
-      case stateSynReceived:
-        sendSmall(tcp, tcp->sendInit, flagSyn | flagAck);
-        break;
-      case stateClosed:
-        break;
-      default: {
-        TransmitElem *elem = tcp->transmitHead;
-        if (elem != tcp->transmitTail) {
-          if (elem->sentAt - elem->firstSentAt > 20 * 1000 * 1000) {
-            abortInner(tcp);
-            break; // from loop
-          }
-          transmitElemNow(tcp, elem);
-        }
-        break;
-        }
+    if (tcpTimerCount == 0) {
+      condition_wait(tcpTimerCond, tcpMutex);
+    } else {
+      TCP tcp = tcpTimers[0];
+      Microsecs wait = tcp->timerAt - thread_now();
+      if (wait > 0) {
+        condition_timedWait(tcpTimerCond, tcpMutex, wait);
+      } else {
+        timerCancel(tcp);
+        tcpTimeout(tcp);
       }
     }
   }
@@ -457,6 +914,7 @@ static void sendData(TCP tcp) {
   if (elem->flag == flagFin) tcp->transmitted++;
   tcp->sendNagled = 0;
   appendTransmitElem(tcp);
+  tcpTimerUpdate(tcp, 0);
 }
 
 int tcp_send(TCP tcp, Octet *buf, Uint32 len) {
@@ -475,19 +933,29 @@ int tcp_send(TCP tcp, Octet *buf, Uint32 len) {
       TransmitElem *elem = tcp->transmitTail;
       Uint32 offset = sizeof(TCPHeader) + elem->len;
       Uint32 amount = ipPayloadSize - offset;
-      if (amount == 0) {
+      if (!elem->buf) elem->buf = (IP *)enet_alloc();
+      if (!elem->buf) {
+        // Out of buffers: wait a while for acks to free some
+        condition_timedWait(tcpSendCond, tcpMutex, tcpBufferWait);
+      } else if (amount == 0) {
         sendData(tcp);
       } else {
         if (amount > len) amount = len;
         Uint32 limit = elem->seq + elem->len + amount;
-        if (seqComp(limit, tcp->sendUnack + tcp->sendWindow) > 0) {
-          printf("Send blocked at %d for %d\n",
-          tcp->sendUnack + tcp->sendWindow - tcp->sendInit,
-          limit - tcp->sendInit);
+        Uint32 window = tcp->sendWindow;
+        if (window > tcp->cwnd) window = tcp->cwnd;
+        if (seqComp(limit, tcp->sendUnack + window) > 0) {
+          if (window == tcp->sendWindow) {
+            printf("Send blocked at %d for %d\n",
+            tcp->sendUnack + tcp->sendWindow - tcp->sendInit,
+            limit - tcp->sendInit);
+          }
           // TEMP: we need to do zero-window probing
           condition_wait(tcpSendCond, tcpMutex);
         } else {
-          bcopy(buf, (Octet *)&(elem->buf->data) + offset, amount);
+          Uint32 sum = csum_copy((Octet *)&(elem->buf->data) + offset, buf,
+                                 amount, 0);
+          elem->sum = csum_add(elem->sum, sum, elem->len);
           len -= amount;
           buf += amount;
           elem->len += amount;
@@ -567,20 +1035,20 @@ int tcp_recv(TCP tcp, Octet *buf, Uint32 len) {
         break; // from switch, not loop
       }
     } else {
-      if (tcp->recvBufStart + amount > maxRecvWindow) {
-        amount = maxRecvWindow - tcp->recvBufStart;
+      if (tcp->recvBufStart + amount > tcp->recvBufSize) {
+        amount = tcp->recvBufSize - tcp->recvBufStart;
       }
       bcopy(tcp->recvBuf + tcp->recvBufStart, buf, amount);
       tcp->recvBufStart += amount;
-      if (tcp->recvBufStart == maxRecvWindow) tcp->recvBufStart = 0;
+      if (tcp->recvBufStart == tcp->recvBufSize) tcp->recvBufStart = 0;
       tcp->recvBufCount -= amount;
       buf += amount;
       len -= amount;
       recvd += amount;
-      if (tcp->recvWindow < 1460 &&
-          maxRecvWindow - tcp->recvBufCount >= 1460) {
+      if (tcp->recvWindow < tcpMss &&
+          tcp->recvBufSize - tcp->recvBufCount >= tcpMss) {
         // update the other end's transmit window if it was too small
-        tcp->recvWindow = maxRecvWindow - tcp->recvBufCount;
+        tcp->recvWindow = tcp->recvBufSize - tcp->recvBufCount;
         sendSmall(tcp, tcp->transmitted, flagAck);
       }
     }
@@ -679,27 +1147,31 @@ static int tcpProcessData(TCP tcp, IP *buf) {
   if (seqComp(seq, tcp->recvNext) <= 0) {
     int base = tcp->recvNext - seq; // first useful byte
     int amount = payloadLen - base; // number of useful bytes
-    if (tcp->recvBufCount + amount > maxRecvWindow) {
+    if (tcp->recvBufCount + amount > tcp->recvBufSize) {
       // Don't overflow recvBuf
-      amount = maxRecvWindow - tcp->recvBufCount;
+      amount = tcp->recvBufSize - tcp->recvBufCount;
     }
     if (amount > 0) {
       // Copy the bytes, wrapping at end of recvBuf
-      if (!tcp->recvBuf) tcp->recvBuf = malloc(maxRecvWindow);
+      if (!tcp->recvBuf) tcp->recvBuf = malloc(tcp->recvBufSize);
       int dest1 = tcp->recvBufStart + tcp->recvBufCount;
-      if (dest1 >= maxRecvWindow) dest1 -= maxRecvWindow;
+      if (dest1 >= tcp->recvBufSize) dest1 -= tcp->recvBufSize;
       int part1 = amount;
-      if (dest1 + part1 > maxRecvWindow) {
-        part1 = maxRecvWindow - dest1;
+      if (dest1 + part1 > tcp->recvBufSize) {
+        part1 = tcp->recvBufSize - dest1;
       }
       Octet *data = tcpPayload(buf) + base;
-      bcopy(data, tcp->recvBuf + dest1, part1);
-      if (part1 < amount) {
-        bcopy(data + part1, tcp->recvBuf, amount - part1);
+      if (buf == tcpStaged) {
+        // Already copied by tcpCheck
+      } else {
+        bcopy(data, tcp->recvBuf + dest1, part1);
+        if (part1 < amount) {
+          bcopy(data + part1, tcp->recvBuf, amount - part1);
+        }
       }
       tcp->recvBufCount += amount;
       tcp->recvNext += amount;
-      tcp->recvWindow = maxRecvWindow - tcp->recvBufCount;
+      tcp->recvWindow = tcp->recvBufSize - tcp->recvBufCount;
     }
     if ((flags & flagPush) && amount == payloadLen - base) {
       // PUSH and we accepted the last byte
@@ -728,6 +1200,160 @@ static int tcpProcessData(TCP tcp, IP *buf) {
   return seqComp(seq, tcp->recvNext) <= 0;
 }
 
+static void sackUpdate(TCP tcp, IP *buf) {
+  // Mark the transmission buffers covered by the SACK blocks in "buf".
+  // Assumes tcpMutex is held.
+  Octet *opt = tcpOption(buf, 5);
+  if (!opt) return;
+  for (int i = 2; i + 8 <= opt[1]; i += 8) {
+    Uint32 left = ntohCopy(opt + i);
+    Uint32 right = ntohCopy(opt + i + 4);
+    tcpStats.sackBlocks++;
+    if (seqComp(right, tcp->transmitted) > 0 ||
+        seqComp(left, right) >= 0) {
+      tcpStats.badSackBlocks++;
+      continue;
+    }
+    if (seqComp(left, tcp->sendUnack) < 0) continue; // stale
+    if (seqComp(right, tcp->sackHigh) > 0) tcp->sackHigh = right;
+    for (TransmitElem *elem = tcp->transmitHead;
+         elem != tcp->transmitTail && seqComp(elem->seq, right) < 0;
+         elem = elem->next) {
+      if (seqComp(elem->seq, left) >= 0 &&
+          seqComp(elemEnd(elem), right) <= 0) elem->sacked = 1;
+    }
+  }
+}
+
+static int retransmitNext(TCP tcp, int force) {
+  // Send again, on the evidence of duplicate or partial ACKs, the first
+  // segment known to be missing: one that isn't SACKed, but is followed
+  // by SACKed data, and hasn't already been resent in this recovery.
+  // Failing that, if "force", send the oldest unacknowledged segment
+  // again, unless already resent.  Without SACK, "force" is all there is.
+  // Returns true iff a segment was sent: not if it's still being sent.
+  // Assumes tcpMutex is held.
+  TransmitElem *elem = tcp->transmitHead;
+  if (elem == tcp->transmitTail) return 0;
+  if (tcp->sackOk) {
+    TransmitElem *hole = elem;
+    while (hole != tcp->transmitTail &&
+           seqComp(hole->seq, tcp->sackHigh) < 0 &&
+           (hole->sacked || seqComp(hole->seq, tcp->highRxt) < 0)) {
+      hole = hole->next;
+    }
+    if (hole != tcp->transmitTail && seqComp(hole->seq, tcp->sackHigh) < 0) {
+      elem = hole;
+    } else if (!force || seqComp(elem->seq, tcp->highRxt) < 0) {
+      return 0;
+    }
+  } else if (!force) {
+    return 0;
+  }
+  if (!transmitElemNow(tcp, elem)) return 0;
+  elem->retransmitted = 1;
+  if (seqComp(elemEnd(elem), tcp->highRxt) > 0) tcp->highRxt = elemEnd(elem);
+  tcp->fastRetransmits++;
+  tcpStats.fastRetransmits++;
+  return 1;
+}
+
+static void tcpNewAck(TCP tcp, Uint32 acked) {
+  // Adjust the congestion window for "acked" newly acknowledged bytes.
+  // During recovery, a partial ACK (one short of tcp->recover) shows that
+  // the next segment was lost too, and we send it at once (NewReno).
+  // Assumes tcpMutex is held, and tcp->sendUnack has been updated.
+  Uint32 flight = tcp->transmitted - tcp->sendUnack;
+  tcp->dupAcks = 0;
+  if (tcp->recovery == recoveryNone) {
+    tcp->cc->acked(&tcp->cwnd, tcp->ssthresh, acked, tcpMss);
+  } else if (seqComp(tcp->sendUnack, tcp->recover) >= 0) {
+    // Full ACK: recovery is over
+    if (tcp->recovery == recoveryFast) {
+      tcp->cwnd = (flight + tcpMss < tcp->ssthresh ?
+                   flight + tcpMss : tcp->ssthresh);
+    }
+    tcp->recovery = recoveryNone;
+  } else {
+    retransmitNext(tcp, 1);
+    if (tcp->recovery == recoveryFast) {
+      // Deflate by the amount acknowledged, less the segment just sent
+      tcp->cwnd = (tcp->cwnd > acked ? tcp->cwnd - acked : 0);
+      if (acked >= tcpMss) tcp->cwnd += tcpMss;
+      if (tcp->cwnd < tcpMss) tcp->cwnd = tcpMss;
+    } else {
+      tcp->cc->acked(&tcp->cwnd, tcp->ssthresh, acked, tcpMss);
+    }
+  }
+}
+
+static void tcpDupAck(TCP tcp) {
+  // A duplicate ACK: the other end has received a segment beyond a hole.
+  // The third one starts fast retransmit and fast recovery (RFC 5681);
+  // later ones each let another segment leave: a hole revealed by SACK
+  // if there is one, otherwise new data, by inflating the window.  So a
+  // retransmission is charged against the window, as RFC 6675's pipe
+  // would charge it.
+  // Assumes tcpMutex is held.
+  tcp->dupAcks++;
+  if (tcp->recovery == recoveryFast) {
+    if (!retransmitNext(tcp, 0)) tcp->cwnd += tcpMss;
+  } else if (tcp->recovery == recoveryNone &&
+             tcp->dupAcks == tcpDupAckThreshold) {
+    tcp->ssthresh = tcp->cc->ssthresh(tcp->cwnd,
+                                      tcp->transmitted - tcp->sendUnack,
+                                      tcpMss);
+    tcp->cwnd = tcp->ssthresh + tcpDupAckThreshold * tcpMss;
+    tcp->recovery = recoveryFast;
+    tcp->recover = tcp->transmitted;
+    tcp->highRxt = tcp->sendUnack;
+    retransmitNext(tcp, 1);
+  }
+}
+
+static void queueOutOfOrder(TCP tcp, IP *buf) {
+  // Put a copy of "buf" on the out-of-order queue, which is kept in order
+  // of starting sequence number.  Segments that "buf" covers entirely are
+  // dropped, as is "buf" if one of them covers it, or if there's no
+  // buffer for the copy.  An empty segment (a pure ACK or window update
+  // sent while there's a hole) is never queued: it has nothing to
+  // deliver, and would make an empty SACK block, which RFC 2018 forbids.
+  // Assumes tcpMutex is held.
+  Uint32 seq = segSeq(buf);
+  Uint32 end = segEnd(buf);
+  if (seq == end) return;
+  IP *prev = NULL;
+  IP *this = tcp->outOfOrderHead;
+  if (this && seqComp(segSeq(tcp->outOfOrderTail), seq) <= 0) {
+    prev = tcp->outOfOrderTail; // the usual case: it goes at the end
+    this = NULL;
+  }
+  while (this && seqComp(segSeq(this), seq) <= 0) {
+    prev = this;
+    this = this->next;
+  }
+  if (prev && seqComp(segEnd(prev), end) >= 0) {
+    tcp->outOfOrderLatest = seq;
+    return;
+  }
+  IP *ooo = (IP *)enet_alloc();
+  if (!ooo) return;
+  *ooo = *buf;
+  tcp->outOfOrderLatest = seq;
+  while (this && seqComp(segEnd(this), end) <= 0) {
+    IP *next = this->next;
+    enet_free((Enet *)this);
+    this = next;
+  }
+  ooo->next = this;
+  if (prev) {
+    prev->next = ooo;
+  } else {
+    tcp->outOfOrderHead = ooo;
+  }
+  if (!this) tcp->outOfOrderTail = ooo;
+}
+
 static int tcpProcessIncoming(TCP tcp, IP *buf) {
   // Process incoming packet for this connection.
   //
@@ -748,8 +1374,27 @@ static int tcpProcessIncoming(TCP tcp, IP *buf) {
     //
     if (seqComp(tcp->sendUnack, ack) <= 0 &&
       seqComp(ack, tcp->transmitted) <= 0) {
+      int advanced = (ack != tcp->sendUnack);
+      Uint32 acked = ack - tcp->sendUnack;
+      if (advanced && tcp->sendUnack == tcp->sendInit) {
+        // Our SYN is acknowledged; unless it was retransmitted, that's an
+        // RTT sample
+        acked--;
+        if (tcp->backoff == 0) {
+          tcpRttSample(tcp, thread_now() - tcp->synSentAt);
+        }
+      }
       tcp->sendUnack = ack;
       pruneTransmitQueue(tcp);
+      if (tcp->sackOk) sackUpdate(tcp, buf);
+      if (advanced) {
+        if (acked) tcpNewAck(tcp, acked);
+        tcpTimerUpdate(tcp, 1);
+      } else if (payloadLen == 0 && !(flags & (flagSyn | flagFin)) &&
+                 tcpWindow(tcp, buf) == tcp->sendWindow &&
+                 tcp->transmitHead != tcp->transmitTail) {
+        tcpDupAck(tcp);
+      }
     } else if (tcp->state == stateSynSent ||
                tcp->state == stateSynReceived) {
       // Unacceptable ack while not yet synchronized: reset and ignore
@@ -787,6 +1432,17 @@ static int tcpProcessIncoming(TCP tcp, IP *buf) {
     tcp->recvNext = seq + 1;
     if (tcp->state == stateSynSent) {
       tcp->recvInit = seq;
+      // Windows are scaled only if both SYNs have the option (RFC 7323),
+      // and likewise for SACK (RFC 2018).  We offer them (scaling unless
+      // tcp_setWindowScaling says not), and answer in kind.
+      Octet *scale = tcpOption(buf, 3);
+      if (!tcp->windowScaled || !scale || scale[1] != 3) {
+        tcp->windowScaled = 0;
+        tcp->recvScale = 0;
+      } else {
+        tcp->sendScale = (scale[2] > tcpMaxScale ? tcpMaxScale : scale[2]);
+      }
+      tcp->sackOk = (tcpOption(buf, 4) != NULL);
       if (tcp->sendUnack == tcp->sendInit) {
         // Either we've sent our SYN but it hasn't yet been acked (active
         // open with simultaneous open from the other end), or we've made
@@ -794,6 +1450,7 @@ static int tcpProcessIncoming(TCP tcp, IP *buf) {
         // responding to an incoming SYN.  In either case, (re)transmit our
         // SYN, piggy-backing an ACK.
         sendSmall(tcp, tcp->sendInit, flagAck | flagSyn);
+        if (!tcp->synSentAt) tcp->synSentAt = thread_now();
         shouldAck = 0;
       }
       tcp->state = stateSynReceived;
@@ -850,7 +1507,7 @@ static int tcpProcessIncoming(TCP tcp, IP *buf) {
     switch (tcp->state) {
     case stateEstablished:
     case stateCloseWait:
-      tcp->sendWindow = ntohs(tcpHeader->window);
+      tcp->sendWindow = tcpWindow(tcp, buf);
       condition_broadcast(tcpSendCond);
       break;
     }
@@ -863,24 +1520,54 @@ static int tcpProcessIncoming(TCP tcp, IP *buf) {
     case stateEstablished:
     case stateFinWait1:
     case stateFinWait2:
-      if (!tcpProcessData(tcp, buf)) {
-        // Enqueue a copy on outOfOrderHead, in arrival order.
-        IP *ooo = (IP *)enet_alloc();
-        *ooo = *buf;
-        ooo->next = NULL;
-        if (tcp->outOfOrderHead) {
-          tcp->outOfOrderTail->next = ooo;
-        } else {
-          tcp->outOfOrderHead = ooo;
-        }
-        tcp->outOfOrderTail = ooo;
-      }
+      if (!tcpProcessData(tcp, buf)) queueOutOfOrder(tcp, buf);
       break;
     }
   }
   return (tcp && shouldAck);
 }
 
+static int tcpCheck(TCP tcp, IP *buf, Uint32 len) {
+  // Return true iff the TCP checksum of "buf" is correct.
+  // Assumes tcpMutex is held.
+  //
+  // If "tcp" is ready for this segment's payload, and has room for all of
+  // it, the payload is copied into the free space of tcp->recvBuf as it's
+  // summed, so that each byte is read once.  The copy becomes part of the
+  // received data only when tcpProcessData accepts the segment, which it
+  // then doesn't copy again: see tcpStaged.
+  //
+  TCPHeader *tcpHeader = (TCPHeader *)ip_payload(buf);
+  Uint32 hSize = tcpHeaderSize(buf);
+  Uint32 payloadLen = len - hSize;
+  int flags = ntohs(tcpHeader->misc);
+  tcpStaged = NULL;
+  if (ip_isLooped(buf)) return 1; // loopback carries no checksum
+  if (!tcp || payloadLen == 0 || hSize > len || (flags & flagSyn) ||
+      ntoh(tcpHeader->seq) != tcp->recvNext ||
+      tcp->recvBufCount + payloadLen > tcp->recvBufSize ||
+      (tcp->state != stateEstablished && tcp->state != stateFinWait1 &&
+       tcp->state != stateFinWait2)) {
+    return (payloadChecksum(buf, len) == 0xffff);
+  }
+  if (!tcp->recvBuf) tcp->recvBuf = malloc(tcp->recvBufSize);
+  int dest1 = tcp->recvBufStart + tcp->recvBufCount;
+  if (dest1 >= tcp->recvBufSize) dest1 -= tcp->recvBufSize;
+  int part1 = payloadLen;
+  if (dest1 + part1 > tcp->recvBufSize) part1 = tcp->recvBufSize - dest1;
+  Octet *data = tcpPayload(buf);
+  Uint32 res = csum_partial(tcpHeader, hSize, csum_pseudo(buf, len));
+  Uint32 sum = csum_copy(tcp->recvBuf + dest1, data, part1, 0);
+  res = csum_add(res, sum, hSize);
+  if (part1 < payloadLen) {
+    sum = csum_copy(tcp->recvBuf, data + part1, payloadLen - part1, 0);
+    res = csum_add(res, sum, hSize + part1);
+  }
+  if (csum_fold(res) != 0xffff) return 0;
+  tcpStaged = buf;
+  return 1;
+}
+
 static void tcpReceiver(IP *buf, Uint32 len, int broadcast) {
   // Up-call from IP when a TCP or ICMP packet has been received.
   //
@@ -888,30 +1575,36 @@ static void tcpReceiver(IP *buf, Uint32 len, int broadcast) {
   // process this packet;
   // re-consider queued out-of-order packets on this connection.
   //
+  unsigned int start = *cycleCounter;
   TCPHeader *tcpHeader = (TCPHeader *)ip_payload(buf);
   if (buf->ip.protocol == ipProtocolICMP) {
     // TEMP: we should pay attention to "no such port", etc.
     return;
   }
-  if (payloadChecksum(buf, len) != 0xffff) {
-    printf("Bad TCP checksum %04x, len %d\n", payloadChecksum(buf, len), len);
-    return;
-  }
   TCPPort localPort = ntohs(tcpHeader->dest);
   IPAddr remoteAddr = ntoh(buf->ip.srce);
   TCPPort remotePort = ntohs(tcpHeader->srce);
   mutex_acquire(tcpMutex);
   TCP tcp = findTcp(localPort, remoteAddr, remotePort); 
+  if (!tcpCheck(tcp, buf, len)) {
+    mutex_release(tcpMutex);
+    printf("Bad TCP checksum %04x, len %d\n", payloadChecksum(buf, len), len);
+    return;
+  }
 
   if (!tcp) {
     int flags = ntohs(tcpHeader->misc) & 0x3f;
     if (flags == flagSyn) {
-      Listener listener = tcpListeners[localPort];
+      Listener listener = portmap_get(tcpListeners, localPort);
       if (listener) {
         // Create a TCP in stateSynSent, as if we had sent a SYN already;
         // this will make tcpProcessIncoming send a SYN-ACK and move to
         // stateSynReceived.
         tcp = createTcp(localPort, remoteAddr, remotePort);
+        if (listener->recvBufSize) {
+          setRecvBufSize(tcp, listener->recvBufSize);
+        }
+        tcp->windowScaled = listener->windowScaled;
         tcp->sendNext++;
         tcp->transmitted = tcp->sendNext;
         tcp->state = stateSynSent;
@@ -932,34 +1625,22 @@ static void tcpReceiver(IP *buf, Uint32 len, int broadcast) {
   if (tcp) {
     Uint32 prePktSeq = tcp->recvNext;
     int shouldAck = tcpProcessIncoming(tcp, buf);
-    // If this packet advanced our state, reconsider out-of-order packets.
-    // On outOfOrderHead they are in arrival order.  This is usually, but
-    // not certainly, also sequence number order; hence the outer loop.
-    int progress = (tcp->recvNext != prePktSeq);
-    while (progress) {
-      progress = 0;
-      if (tcp->state == stateEstablished ||
-          tcp->state == stateFinWait1 ||
-          tcp->state == stateFinWait2) {
+    tcpStaged = NULL;
+    // If this packet advanced our state, take what we can from the
+    // out-of-order queue.  That's in sequence order, so only its head can
+    // have become usable.
+    if (tcp->recvNext != prePktSeq) {
+      while (tcp->outOfOrderHead &&
+             seqComp(segSeq(tcp->outOfOrderHead), tcp->recvNext) <= 0 &&
+             (tcp->state == stateEstablished ||
+              tcp->state == stateFinWait1 ||
+              tcp->state == stateFinWait2)) {
         IP *this = tcp->outOfOrderHead;
-        IP *prev = NULL;
-        while (this) {
-          IP *next = this->next;
-          if (tcpProcessData(tcp, this)) {
-            if (prev) {
-              prev->next = this->next;
-            } else {
-              tcp->outOfOrderHead = this->next;
-            }
-            if (this == tcp->outOfOrderTail) tcp->outOfOrderTail = prev;
-            enet_free((Enet *)this);
-            shouldAck = 1;
-            progress = 1;
-          } else {
-            prev = this;
-          }
-          this = next;
-        }
+        if (!tcpProcessData(tcp, this)) break; // recvBuf is full
+        tcp->outOfOrderHead = this->next;
+        if (!this->next) tcp->outOfOrderTail = NULL;
+        enet_free((Enet *)this);
+        shouldAck = 1;
       }
     }
     if (tcp->sendNagled && tcp->sendUnack == tcp->transmitted) {
@@ -967,8 +1648,110 @@ static void tcpReceiver(IP *buf, Uint32 len, int broadcast) {
     } else if (shouldAck) {
       sendSmall(tcp, tcp->transmitted, flagAck);
     }
+    tcpTimerUpdate(tcp, 0);
+  }
+
+  tcpStats.segments++;
+  tcpStats.receiveCycles += *cycleCounter - start;
+  mutex_release(tcpMutex);
+}
+
+void tcp_stats(TCPStats *stats, int reset) {
+  tcpInit();
+  mutex_acquire(tcpMutex);
+  *stats = tcpStats;
+  if (reset) memset(&tcpStats, 0, sizeof(tcpStats));
+  mutex_release(tcpMutex);
+}
+
+void tcp_connStats(TCP tcp, TCPConnStats *stats) {
+  mutex_acquire(tcpMutex);
+  stats->retransmits = tcp->retransmits;
+  stats->srtt = tcp->srtt;
+  stats->rttvar = tcp->rttvar;
+  stats->rto = tcpRto(tcp);
+  stats->fastRetransmits = tcp->fastRetransmits;
+  stats->cwnd = tcp->cwnd;
+  stats->ssthresh = tcp->ssthresh;
+  stats->sendScale = (tcp->windowScaled ? tcp->sendScale : 0);
+  stats->recvScale = (tcp->windowScaled ? tcp->recvScale : 0);
+  for (int i = 0; i < tcpRttBuckets; i++) {
+    stats->rttSamples[i] = tcp->rttSamples[i];
   }
+  mutex_release(tcpMutex);
+}
 
+void tcp_setCongestion(TCP tcp, const TCPCongestion *cc) {
+  tcpInit();
+  if (!cc) cc = &tcpReno;
+  mutex_acquire(tcpMutex);
+  if (tcp) {
+    tcp->cc = cc;
+  } else {
+    tcpDefaultCc = cc;
+  }
+  mutex_release(tcpMutex);
+}
+
+void tcp_setRecvBuffer(TCP tcp, Uint32 bytes) {
+  tcpInit();
+  if (bytes < tcpMinRecvBuf) bytes = tcpMinRecvBuf;
+  if (bytes > tcpMaxRecvBuf) bytes = tcpMaxRecvBuf;
+  mutex_acquire(tcpMutex);
+  if (!tcp) {
+    tcpRecvBufSize = bytes;
+  } else {
+    // The window scale is fixed by now, and we mustn't take back window
+    // we've already offered
+    int size = bytes;
+    if (size > (65535 << tcp->recvScale)) size = 65535 << tcp->recvScale;
+    if (size < tcp->recvBufCount + (int)tcp->recvWindow) {
+      size = tcp->recvBufCount + tcp->recvWindow;
+    }
+    if (tcp->recvBuf && size != tcp->recvBufSize) {
+      // Move the contents to the start of a new buffer
+      Octet *recvBuf = malloc(size);
+      int part1 = tcp->recvBufCount;
+      if (tcp->recvBufStart + part1 > tcp->recvBufSize) {
+        part1 = tcp->recvBufSize - tcp->recvBufStart;
+      }
+      bcopy(tcp->recvBuf + tcp->recvBufStart, recvBuf, part1);
+      bcopy(tcp->recvBuf, recvBuf + part1, tcp->recvBufCount - part1);
+      free(tcp->recvBuf);
+      tcp->recvBuf = recvBuf;
+      tcp->recvBufStart = 0;
+    }
+    int grown = (tcp->recvWindow < tcpMss &&
+                 size - tcp->recvBufCount >= tcpMss);
+    tcp->recvBufSize = size;
+    tcp->recvWindow = size - tcp->recvBufCount;
+    if (grown) {
+      switch (tcp->state) {
+      case stateEstablished:
+      case stateFinWait1:
+      case stateFinWait2:
+        sendSmall(tcp, tcp->transmitted, flagAck);
+        break;
+      }
+    }
+  }
+  mutex_release(tcpMutex);
+}
+
+void tcp_setWindowScaling(int offer) {
+  tcpInit();
+  mutex_acquire(tcpMutex);
+  tcpWindowScaling = offer;
+  mutex_release(tcpMutex);
+}
+
+void tcp_setListenerRecvBuffer(TCPPort localPort, Uint32 bytes) {
+  tcpInit();
+  if (bytes < tcpMinRecvBuf) bytes = tcpMinRecvBuf;
+  if (bytes > tcpMaxRecvBuf) bytes = tcpMaxRecvBuf;
+  mutex_acquire(tcpMutex);
+  Listener listener = portmap_get(tcpListeners, localPort);
+  if (listener) listener->recvBufSize = bytes;
   mutex_release(tcpMutex);
 }
 
@@ -980,12 +1763,21 @@ static void tcpInit() {
     tcpConnectCond = condition_create();
     tcpRecvCond = condition_create();
     tcpCloseCond = condition_create();
-    tcpCreateCond = condition_create();
+    tcpTimerCond = condition_create();
     tcpSendCond = condition_create();
-    tcpSmallBuf = (IP *)enet_alloc();
+    tcpSmallBuf = NULL; // see smallBuf
+    transmitElemSlab = slab_create(sizeof(TransmitElem));
     tcpActive = NULL;
-    tcpListeners = malloc(65536 * sizeof(Listener *));
-    for (int i = 0; i < 65536; i++) tcpListeners[i] = NULL;
+    tcpHash = malloc(tcpHashSize * sizeof(TCP));
+    for (int i = 0; i < tcpHashSize; i++) tcpHash[i] = NULL;
+    tcpTimers = NULL;
+    tcpTimerCount = 0;
+    tcpTimerSpace = 0;
+    tcpDefaultCc = &tcpReno;
+    tcpRecvBufSize = tcpDefaultRecvBuf;
+    tcpWindowScaling = 1;
+    tcpListeners = portmap_create();
+    tcpDynamic = portset_create();
     tcpSeed = *cycleCounter;
     ip_register(ipProtocolTCP, tcpReceiver);
     thread_fork(retransmitter, NULL);
@@ -47,7 +47,12 @@ void appendStr(UDP *sendBuf, Uint32 *pos, char * str) {
 char * tftp_get(IPAddr server, char * file,
     void(*receiver)(Octet *, Uint32)) {
   UDP *sendBuf = (UDP *)enet_alloc();
+  if (!sendBuf) return "No buffer";
   UDPPort local = udp_allocPort(NULL);
+  if (!local) {
+    enet_free((Enet *)sendBuf);
+    return "No port";
+  }
   sendBuf->ip.dest = hton(server);
   sendBuf->udp.dest = htons(tftpPort);
   sendBuf->udp.srce = htons(local);
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "threads.h"
+#include "slab.h"
 
 // #define assert(b, s) if (!(b)) { printf("Bug: %s\n", (s)); abort(); }
 #define assert(b, s)
@@ -29,8 +30,9 @@ struct Thread {
   void * sp;               // saved SP when not running
   Queue q;                 // thread queue this is on, or NULL
   Thread next;             // thread queue link
-  Thread tqNext;           // timer queue link
-  Thread tqPrev;           // timer queue back-pointer
+  Thread prev;             // thread queue back-link
+  Thread tqNext;           // timer wheel slot link
+  Thread tqPrev;           // timer wheel slot back-pointer
   Cycles tqWakeup;         // value of "now" when timer expires; 0 if none
   int timedOut;            // true iff woken up by a timeout
   void (* forkee)(void *); // target of "fork" call
@@ -38,6 +40,8 @@ struct Thread {
   int id;                  // unique ID assigned by "fork"
   void * stackBase;        // allocated stack (NULL for initial thread)
   void * stackTop;         // top of stack; the thread's initial SP
+  int stackClass;          // index of stack pool; -1 for initial thread
+  Thread classNext;        // link in the list of all stacks of this class
   int status;              // result status from thread_exit, default 0
   int detached;            // true iff nobody will ever join this thread
   Semaphore joiner;        // block here in Join until thread terminates
@@ -86,10 +90,49 @@ static unsigned int clockFrequency() {
   return (*rs232 >> 18) & 127;
 }
 
-static struct Queue dead;     // Threads that have terminated, for re-use
+// The timer wheel.  Threads waiting for a timed wakeup are hashed into
+// tqSlots slots by the tick (tqTickShift bits of cycles) in which they
+// expire, rounded up.  Each slot is a doubly-linked list through tqNext
+// and tqPrev, and tqOccupied has a bit set for each non-empty slot.
+// Threads whose expiry is more than one revolution away share a slot with
+// nearer ones, and are skipped until their own revolution comes round.
+//
+// tqNextDue is a lower bound on the earliest expiry, so the scheduler need
+// only look at the wheel when "now" reaches it.
+#define tqTickShift 10
+#define tqSlots 512
+#define tqNever 0x7fffffffffffffffLL
+
+// Stacks come in power-of-two sizes, from 1 << stackMinShift bytes to
+// 1 << stackMaxShift.  Dead threads are recycled only into forks asking
+// for the same class.  Stacks smaller than a pool chunk are carved several
+// to a malloc.  New stacks are painted with stackPaint, so that
+// thread_stackReport can find how deep each one has been used.
+#define stackMinShift 12
+#define stackMaxShift 20
+#define stackClasses (stackMaxShift - stackMinShift + 1)
+#define stackChunkSize (1 << 17)
+#define stackPaint 0x57ac57ac
+#define defaultStackSize (1 << 17)
+
+static struct Queue dead[stackClasses]; // Terminated threads, by class
+static Thread stacks[stackClasses];     // All forked threads, by class
+static int stackCounts[stackClasses];   // Length of "stacks" lists
+static char *stackChunk = NULL;         // Unused part of current chunk
+static unsigned int stackChunkLeft = 0; // Bytes left in stackChunk
+
+static Slab threadSlab;       // Thread control blocks
+static Slab semSlab;          // Semaphores
+static Slab mutexSlab;        // Mutexes
+static Slab conditionSlab;    // Condition variables
 static struct Queue ready;    // Threads ready to run
 static Thread running = NULL; // Currently executing thread
-static struct Queue tq;       // Queue of threads waiting for timed wakeup
+static Thread tqWheel[tqSlots]; // Threads waiting for timed wakeup
+static unsigned int tqOccupied[tqSlots / 32]; // bitmap of non-empty slots
+static int tqCount = 0;       // number of threads on the timer wheel
+static Cycles tqTick = 0;     // first tick not yet examined by tqExpire
+static Cycles tqNextDue = tqNever; // no timer expires before this
+static void (* poller)() = NULL; // Event poller, from thread_setPoller
 static int forkCount = 0;     // UID generator for forked threads
 static int xferCount = 0;     // performance counter
 static unsigned int prevCycles; // last cycle counter seen by timer stuff
@@ -99,19 +142,35 @@ static void thread_init() {
   // Initialize our globals, if needed.  Idempotent.
   // Called implicitly from the top-level entry points.
   if (running == NULL) {
-    Thread target = malloc(sizeof(struct Thread));
+    threadSlab = slab_create(sizeof(struct Thread));
+    semSlab = slab_create(sizeof(struct Semaphore));
+    mutexSlab = slab_create(sizeof(struct Mutex));
+    conditionSlab = slab_create(sizeof(struct Condition));
+    Thread target = slab_alloc(threadSlab);
     running = target; // prevent recursive calls of "init"
-    queue_init(&dead);
+    for (int i = 0; i < stackClasses; i++) {
+      queue_init(&dead[i]);
+      stacks[i] = NULL;
+      stackCounts[i] = 0;
+    }
     queue_init(&ready);
-    queue_init(&tq);
+    for (int i = 0; i < tqSlots; i++) tqWheel[i] = NULL;
+    for (int i = 0; i < tqSlots / 32; i++) tqOccupied[i] = 0;
+    tqCount = 0;
+    tqTick = 0;
+    tqNextDue = tqNever;
     prevCycles = *cycles;
     now = 1; // "0" in tqWakeup means not on tq.
+    target->q = NULL;
     target->next = NULL;
+    target->prev = NULL;
     target->tqNext = NULL;
     target->tqPrev = NULL;
     target->tqWakeup = 0;
     target->joiner = sem_create();
     // Don't need stackBase, stackTop, forkee, forkArg
+    target->stackClass = -1;
+    target->classNext = NULL;
     target->id = 0;
     target->status = 0;
     target->detached = 0;
@@ -129,6 +188,8 @@ static inline void enqueue(Queue q, Thread t) {
   // Private: append given thread to given queue
   assert(q, "Enqueue on null");
   assert(!t->q, "Double enqueue");
+  t->next = NULL;
+  t->prev = q->tail;
   if (q->head) {
     assert(q->tail, "mangled queue tail");
     q->tail->next = t;
@@ -139,24 +200,23 @@ static inline void enqueue(Queue q, Thread t) {
   t->q = q;
 }
 
-static void dequeueOne(Thread t) {
+static inline void dequeueOne(Thread t) {
   // Private: remove T from whatever queue it is on.
-  // Use only for timeout wakeups.
   assert(t->q, "Improper dequeue");
-  Thread this = t->q->head;
-  Thread prev = NULL;
-  while (this != t) {
-    assert(this, "Not on queue");
-    prev = this;
-    this = this->next;
+  Queue q = t->q;
+  if (t->prev) {
+    t->prev->next = t->next;
+  } else {
+    q->head = t->next;
   }
-  if (prev) {
-    prev->next = this->next;
+  if (t->next) {
+    t->next->prev = t->prev;
   } else {
-    t->q->head = this->next;
+    q->tail = t->prev;
   }
-  this->q = NULL;
-  this->next = NULL;
+  t->q = NULL;
+  t->next = NULL;
+  t->prev = NULL;
 }
 
 static Thread dequeue(Queue q) {
@@ -164,9 +224,7 @@ static Thread dequeue(Queue q) {
   assert(q, "Dequeue from null");
   assert(q->head, "Empty queue");
   Thread res = q->head;
-  q->head = res->next;
-  res->q = NULL;
-  res->next = NULL;
+  dequeueOne(res);
   return res;
 }
 
@@ -182,6 +240,13 @@ int queue_isEmpty(Queue q) {
   return (!(q->head));
 }
 
+static int queueLength(Queue q) {
+  // Private: number of threads on q
+  int n = 0;
+  for (Thread t = q->head; t; t = t->next) n++;
+  return n;
+}
+
 static void readClock() {
   // Update "now" based on change in the cycle counter.
   //
@@ -195,53 +260,120 @@ static void readClock() {
   prevCycles = c;
 }
 
+static inline unsigned int tqSlotOf(Cycles wakeup) {
+  // Private: the wheel slot for a given expiry time
+  return ((wakeup + (1 << tqTickShift) - 1) >> tqTickShift) & (tqSlots - 1);
+}
+
 static void tqEnqueue(Thread t, Microsecs microsecs) {
-  // Private: place t on the timer queue
+  // Private: place t on the timer wheel
   assert(!t->tqWakeup, "Double tq enqueue");
   readClock();
   t->tqWakeup = now + clockFrequency() * microsecs;
-  if (tq.head) {
-    assert(tq.tail, "mangled tq queue tail");
-    t->tqPrev = tq.tail;
-    tq.tail->tqNext = t;
-  } else {
-    tq.head = t;
-  }
-  tq.tail = t;
+  // A wakeup in a tick that tqExpire has already examined belongs in the
+  // next one it will examine, not in a slot it reaches a revolution later
+  if (t->tqWakeup < tqTick << tqTickShift) t->tqWakeup = tqTick << tqTickShift;
+  unsigned int slot = tqSlotOf(t->tqWakeup);
+  t->tqPrev = NULL;
+  t->tqNext = tqWheel[slot];
+  if (t->tqNext) t->tqNext->tqPrev = t;
+  tqWheel[slot] = t;
+  tqOccupied[slot >> 5] |= 1u << (slot & 31);
+  tqCount++;
+  Cycles due = ((t->tqWakeup + (1 << tqTickShift) - 1) >> tqTickShift) <<
+    tqTickShift;
+  if (due < tqNextDue) tqNextDue = due;
 }
 
 static void tqDequeue(Thread t) {
-  // Private: remove t from the timer queue
+  // Private: remove t from the timer wheel
+  //
+  // Leaves tqNextDue alone: it is only a lower bound, and tqExpire will
+  // correct it if t was the earliest.
   assert(t->tqWakeup, "Improper tq dequeue");
-  if (t == tq.head) tq.head = t->tqNext;
-  if (t == tq.tail) tq.tail = t->tqPrev;
-  if (t->tqPrev) t->tqPrev->tqNext = t->tqNext;
+  unsigned int slot = tqSlotOf(t->tqWakeup);
+  if (t->tqPrev) {
+    t->tqPrev->tqNext = t->tqNext;
+  } else {
+    tqWheel[slot] = t->tqNext;
+    if (!t->tqNext) tqOccupied[slot >> 5] &= ~(1u << (slot & 31));
+  }
   if (t->tqNext) t->tqNext->tqPrev = t->tqPrev;
   t->tqNext = NULL;
   t->tqPrev = NULL;
   t->tqWakeup = 0;
+  tqCount--;
+}
+
+static Cycles tqFindNext() {
+  // Private: return the start of the first tick at or after tqTick whose
+  // slot is non-empty, or tqNever if the wheel is empty.
+  if (tqCount == 0) return tqNever;
+  unsigned int first = tqTick & (tqSlots - 1);
+  unsigned int slot = first;
+  unsigned int dist = 0;
+  while (dist < tqSlots) {
+    unsigned int bits = tqOccupied[slot >> 5] >> (slot & 31);
+    if (bits == 0) {
+      // Skip the rest of this bitmap word
+      dist += 32 - (slot & 31);
+      slot = (slot + 32 - (slot & 31)) & (tqSlots - 1);
+    } else {
+      while (!(bits & 1)) {
+        bits >>= 1;
+        dist++;
+      }
+      break;
+    }
+  }
+  if (dist >= tqSlots) return tqNever; // unreachable: tqCount > 0
+  return (tqTick + dist) << tqTickShift;
+}
+
+static void tqExpire() {
+  // Private: make ready the threads whose timers have expired, examining
+  // each slot between tqTick and now (at most one revolution), then
+  // recompute tqNextDue.
+  Cycles nowTick = now >> tqTickShift;
+  Cycles last = nowTick;
+  if (last - tqTick >= tqSlots) last = tqTick + tqSlots - 1;
+  for (Cycles tick = tqTick; tick <= last; tick++) {
+    unsigned int slot = tick & (tqSlots - 1);
+    if (!(tqOccupied[slot >> 5] & (1u << (slot & 31)))) continue;
+    Thread this = tqWheel[slot];
+    while (this) {
+      Thread next = this->tqNext;
+      if (this->tqWakeup <= now) {
+        assert(this->q, "Timeout target not on a queue");
+        dequeueOne(this);
+        tqDequeue(this);
+        this->timedOut = 1;
+        enqueue(&ready, this);
+      }
+      this = next;
+    }
+  }
+  tqTick = nowTick + 1;
+  tqNextDue = tqFindNext();
 }
 
-static void checkTimeout() {
-  // Private: check for a timed-out thread.
-  Thread this = tq.head;
+static inline void checkTimeout() {
+  // Private: check for timed-out threads.
   readClock();
-  while (this) {
-    if (this->tqWakeup <= now) {
-      assert(this->q, "Timeout target not on a queue");
-      dequeueOne(this);
-      tqDequeue(this);
-      this->timedOut = 1;
-      enqueue(&ready, this);
-    }
-    this = this->tqNext;
-  }
+  if (now >= tqNextDue) tqExpire();
 }
 
+static inline void checkEvents() {
+  // Private: check for timed-out threads, and let the poller look for
+  // other events.
+  checkTimeout();
+  if (poller) poller();
+}
 
 static void schedule() {
   // Private: spin until there's a ready thread, and make it running
-  while (queue_isEmpty(&ready)) checkTimeout();
+  if (poller) poller();
+  while (queue_isEmpty(&ready)) checkEvents();
   running = dequeue(&ready);
 }
 
@@ -267,6 +399,51 @@ void queue_unblock(Queue q) {
   enqueue(&ready, t);
 }
 
+void queue_unblockFirst(Queue q) {
+  // Public: move a thread from "q" to the front of "ready"
+  Thread t = dequeue(q);
+  if (t->tqWakeup) tqDequeue(t);
+  t->prev = NULL;
+  t->next = ready.head;
+  if (ready.head) {
+    ready.head->prev = t;
+  } else {
+    ready.tail = t;
+  }
+  ready.head = t;
+  t->q = &ready;
+}
+
+void queue_unblockThread(Queue q, Thread t) {
+  // Public: move the given thread from "q" to "ready"
+  assert(t->q == q, "Thread not on queue");
+  dequeueOne(t);
+  if (t->tqWakeup) tqDequeue(t);
+  enqueue(&ready, t);
+}
+
+void queue_unblockAll(Queue q) {
+  // Public: move every thread on "q" to "ready", preserving their order
+  //
+  // The list is spliced onto "ready" as a whole; each thread still has
+  // its queue pointer updated and any timer cancelled.
+  Thread head = q->head;
+  if (!head) return;
+  for (Thread t = head; t; t = t->next) {
+    t->q = &ready;
+    if (t->tqWakeup) tqDequeue(t);
+  }
+  if (ready.head) {
+    ready.tail->next = head;
+    head->prev = ready.tail;
+  } else {
+    ready.head = head;
+  }
+  ready.tail = q->tail;
+  q->head = NULL;
+  q->tail = NULL;
+}
+
 
 ////////////////////////////////////////////////////////////////////////////
 //                                                                        //
@@ -285,23 +462,66 @@ int thread_id(Thread t) {
   return t->id;
 }
 
-Thread thread_fork(void forkee(void *), void * forkArg) {
-  // Public: create a thread executing "forkee(forkArg)"
+static int stackClassOf(unsigned int stackBytes) {
+  // Private: the smallest stack class holding at least stackBytes, or -1
+  // if even the largest is too small
+  int class = 0;
+  while (class < stackClasses &&
+         (1 << (class + stackMinShift)) < stackBytes) class++;
+  return (class < stackClasses ? class : -1);
+}
+
+static void * stackAlloc(int class) {
+  // Private: allocate and paint a stack of the given class
+  unsigned int size = 1 << (class + stackMinShift);
+  unsigned int *stack;
+  if (size >= stackChunkSize) {
+    stack = malloc(size);
+  } else {
+    if (stackChunkLeft < size) {
+      // Abandon the remnant; it's smaller than any stack we'd want.
+      stackChunk = malloc(stackChunkSize);
+      stackChunkLeft = stackChunkSize;
+    }
+    stack = (unsigned int *)stackChunk;
+    stackChunk += size;
+    stackChunkLeft -= size;
+  }
+  for (int i = 0; i < size / sizeof(unsigned int); i++) stack[i] = stackPaint;
+  return stack;
+}
+
+Thread thread_fork_sized(void forkee(void *), void * forkArg,
+                         unsigned int stackBytes) {
+  // Public: create a thread executing "forkee(forkArg)", with a stack of
+  // at least stackBytes
   thread_init();
   Thread target;
-  if (queue_isEmpty(&dead)) {
+  int class = stackClassOf(stackBytes);
+  if (class < 0) {
+    printf("thread_fork_sized: no stack class holds %u bytes\n",
+           stackBytes);
+    return NULL;
+  }
+  if (queue_isEmpty(&dead[class])) {
     // allocate a new one
-    target = malloc(sizeof(*target));
+    target = slab_alloc(threadSlab);
+    target->q = NULL;
     target->next = NULL;
+    target->prev = NULL;
     target->tqNext = NULL;
     target->tqPrev = NULL;
     target->tqWakeup = 0;
-    target->stackBase = malloc(100000);
-    target->stackTop = target->stackBase + 100000;
+    target->stackBase = stackAlloc(class);
+    target->stackTop = target->stackBase + (1 << (class + stackMinShift));
+    target->stackClass = class;
+    target->classNext = stacks[class];
+    stacks[class] = target;
+    stackCounts[class]++;
     target->joiner = sem_create();
   } else {
     // recycle an old one
-    target = dequeue(&dead);
+    target = dequeue(&dead[class]);
   }
   forkCount++;
   target->id = forkCount;
@@ -317,6 +537,11 @@ Thread thread_fork(void forkee(void *), void * forkArg) {
   return target;
 }
 
+Thread thread_fork(void forkee(void *), void * forkArg) {
+  // Public: create a thread executing "forkee(forkArg)"
+  return thread_fork_sized(forkee, forkArg, defaultStackSize);
+}
+
 void thread_exit(int status) {
   // Public: terminate this thread, abandoning the call-stack.
   thread_init();
@@ -343,7 +568,7 @@ int thread_join(Thread t) {
   if (t->id > 0) {
     // Not the initial thread
     t->id = -1;
-    enqueue(&dead, t);
+    enqueue(&dead[t->stackClass], t);
   }
   return t->status;
 }
@@ -357,7 +582,7 @@ void thread_detach(Thread t) {
 void thread_yield() {
   // Public: if there's something else ready to run, run it instead
   thread_init();
-  checkTimeout();
+  checkEvents();
   if (!queue_isEmpty(&ready)) queue_block(&ready, 0);
 }
 
@@ -370,6 +595,12 @@ void thread_sleep(Microsecs microsecs) {
   queue_block(&q, microsecs);
 }
 
+void thread_setPoller(void newPoller()) {
+  // Public: install the scheduler's event poller
+  thread_init();
+  poller = newPoller;
+}
+
 Microsecs thread_now() {
   return now / clockFrequency();
 }
@@ -380,6 +611,25 @@ int thread_xfers() {
   return xferCount;
 }
 
+void thread_stackReport() {
+  // Public: print, for each stack class in use, how many stacks there are
+  // and the greatest depth any of them has reached.
+  thread_init();
+  for (int class = 0; class < stackClasses; class++) {
+    if (stackCounts[class] == 0) continue;
+    unsigned int size = 1 << (class + stackMinShift);
+    unsigned int deepest = 0;
+    for (Thread t = stacks[class]; t; t = t->classNext) {
+      unsigned int *p = t->stackBase;
+      while ((void *)p < t->stackTop && *p == stackPaint) p++;
+      unsigned int depth = t->stackTop - (void *)p;
+      if (depth > deepest) deepest = depth;
+    }
+    printf("Stack class %7u: %4d stacks, %4d free, deepest %7u bytes\n",
+           size, stackCounts[class], queueLength(&dead[class]), deepest);
+  }
+}
+
 
 ////////////////////////////////////////////////////////////////////////////
 //                                                                        //
@@ -388,7 +638,8 @@ int thread_xfers() {
 ////////////////////////////////////////////////////////////////////////////
 
 Semaphore sem_create() {
-  Semaphore s = malloc(sizeof(*s));
+  thread_init();
+  Semaphore s = slab_alloc(semSlab);
   queue_init(&(s->q));
   s->count = 0;
   return s;
@@ -420,7 +671,8 @@ void sem_V(Semaphore s) {
 ////////////////////////////////////////////////////////////////////////////
 
 Mutex mutex_create() {
-  Mutex m = malloc(sizeof(*m));
+  thread_init();
+  Mutex m = slab_alloc(mutexSlab);
   queue_init(&(m->q));
   m->unlocked = 1;
   return m;
@@ -452,7 +704,8 @@ void mutex_release(Mutex m) {
 ////////////////////////////////////////////////////////////////////////////
 
 Condition condition_create() {
-  Condition c = malloc(sizeof(*c));
+  thread_init();
+  Condition c = slab_alloc(conditionSlab);
   queue_init(&(c->q));
   return c;
 }
@@ -473,5 +726,5 @@ void condition_signal(Condition c) {
 
 void condition_broadcast(Condition c) {
   assert(c, "Null condition in broadcast");
-  while (!queue_isEmpty(&(c->q))) queue_unblock(&(c->q));
+  queue_unblockAll(&(c->q));
 }
@@ -73,9 +73,19 @@ Thread thread_fork(void forkee(void *), void * forkArg);
 // Create a thread executing "forkee(forkArg)".
 //
 // The forked thread calls thread_exit(0) if forkee ever returns.
+// Its stack is 128K bytes.
 //
 // Might cause a context switch.
 
+Thread thread_fork_sized(void forkee(void *), void * forkArg,
+                         unsigned int stackBytes);
+// Like thread_fork, but with a stack of at least stackBytes.
+//
+// Stack sizes are rounded up to a power of two, from 4K to 1M bytes,
+// and stacks are recycled only between threads of the same size.
+// Returns NULL, creating no thread, if stackBytes is over 1M.
+// Use thread_stackReport to see how much of each size is being used.
+
 void thread_exit(int status);
 // Terminate this thread, with status to be returned from thread_join.
 //
@@ -109,10 +119,22 @@ void thread_sleep(Microsecs microsecs);
 
 Microsecs thread_now();
 // Elapsed microseconds since start of time
+
+void thread_setPoller(void poller());
+// Install a function that the scheduler calls at each context switch,
+// from thread_yield, and repeatedly while no thread is ready to run.
+// It lets an event source (such as the inter-core message queue) make a
+// thread ready without that thread having to busy-wait.  The poller must
+// not block; it usually calls queue_unblock or queue_unblockFirst.
+// NULL removes the poller.
   
 int thread_xfers();
 // Returns a count of context switches.
 
+void thread_stackReport();
+// Print, for each stack size in use, the number of stacks and the
+// deepest any of them has been used.
+
 
 ////////////////////////////////////////////////////////////////////////////
 //                                                                        //
@@ -141,6 +163,23 @@ void queue_unblock(Queue q);
 //
 // Might cause a context switch.
 
+void queue_unblockFirst(Queue q);
+// Like queue_unblock, but the thread goes to the front of the ready
+// queue, so it runs at the next context switch.
+//
+// Might cause a context switch.
+
+void queue_unblockThread(Queue q, Thread t);
+// Remove the given thread from q, wherever it is in the queue, and make
+// it ready to run.  Illegal if t is not on q.
+//
+// Might cause a context switch.
+
+void queue_unblockAll(Queue q);
+// Remove all threads from q and make them ready to run, in queue order.
+//
+// Might cause a context switch.
+
 
 ////////////////////////////////////////////////////////////////////////////
 //                                                                        //
@@ -0,0 +1,82 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "lib/lib.h"
+#include "lib/barrier.h"
+
+// Allocation throughput of the per-core arenas against the RPC allocator
+// in core #1, with the number of allocating cores growing from 1 (core 2)
+// to all of cores 2..n.
+
+#define NOPS    2000
+#define NBLOCKS 16
+
+void mc_init(void);
+void mc_main(void);
+
+// The allocator that mcLibc used before arenas
+void *mc_rpcMalloc(size_t size);
+void mc_rpcFree(void *ptr);
+
+static const size_t kSizes[8] = { 8, 24, 40, 100, 256, 60, 500, 1500 };
+
+DEFINE_PER_CORE(unsigned int, elapsed);
+
+static void run(int useArena, unsigned int last)
+{
+  hw_barrier();
+  if (corenum() <= last) {
+    void *blocks[NBLOCKS];
+    for (int i = 0; i < NBLOCKS; i++) blocks[i] = NULL;
+    unsigned int start = *cycleCounter;
+    for (int i = 0; i < NOPS; i++) {
+      int slot = i % NBLOCKS;
+      size_t size = kSizes[(i + corenum()) % 8];
+      if (useArena) {
+        if (blocks[slot]) free(blocks[slot]);
+        blocks[slot] = malloc(size);
+      } else {
+        if (blocks[slot]) mc_rpcFree(blocks[slot]);
+        blocks[slot] = mc_rpcMalloc(size);
+      }
+      assert(blocks[slot] != NULL);
+    }
+    for (int i = 0; i < NBLOCKS; i++) {
+      if (useArena) {
+        free(blocks[i]);
+      } else {
+        mc_rpcFree(blocks[i]);
+      }
+    }
+    my(elapsed) = *cycleCounter - start;
+    cache_flushMem(&my(elapsed), sizeof(unsigned int));
+  }
+  hw_barrier();
+  if (corenum() == 2) {
+    unsigned int slowest = 0;
+    for (unsigned int core = 2; core <= last; core++) {
+      cache_invalidateMem(&per_core(elapsed, core), sizeof(unsigned int));
+      if (per_core(elapsed, core) > slowest) slowest = per_core(elapsed, core);
+    }
+    unsigned int ops = 2 * (NOPS + NBLOCKS) * (last - 1);
+    xprintf("[%02u]: %s %2u cores: %6u ops in %9u cycles, %5u ops/Mcycle\n",
+            corenum(), (useArena ? "arena" : "rpc  "), last - 1, ops,
+            slowest, ops / (slowest / 1000 + 1) * 1000);
+  }
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+}
+
+void mc_main(void)
+{
+  for (unsigned int last = 2; last <= nCores(); last++) {
+    run(0, last);
+    run(1, last);
+  }
+}
@@ -0,0 +1,125 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "lib/lib.h"
+#include "lib/barrier.h"
+#include "lib/chan.h"
+#include "lib/lmsg.h"
+
+// Producer/consumer throughput from core 2 to core 3 in MB/s, for buffers
+// of 1 KB to 64 KB: through a channel, where the producer writes into the
+// ring and the consumer reads in place, and through lmsg, where the data
+// is copied through the message queue.  In both cases the producer writes
+// every word and the consumer reads every word.
+
+#define RINGSIZE (1 << 18)
+#define MAXSIZE  (1 << 16)
+#define VOLUME   (1 << 22)   // bytes per measurement
+
+void mc_init(void);
+void mc_main(void);
+
+static const unsigned int kSizes[5] = {
+  1 << 10, 1 << 12, 1 << 14, 1 << 15, 1 << 16
+};
+
+static Chan benchChan CACHELINE;
+static unsigned int benchSum CACHELINE;
+static unsigned int elapsed CACHELINE;
+
+static void fill(unsigned int *buf, unsigned int len, unsigned int seed)
+{
+  for (unsigned int i = 0; i < len / 4; i++) buf[i] = seed + i;
+}
+
+static unsigned int sum(const unsigned int *buf, unsigned int len)
+{
+  unsigned int s = 0;
+  for (unsigned int i = 0; i < len / 4; i++) s += buf[i];
+  return s;
+}
+
+static void producer(int useChan, unsigned int size, unsigned int *buf)
+{
+  for (unsigned int i = 0; i < VOLUME / size; i++) {
+    if (useChan) {
+      void *p = chan_alloc(benchChan, size);
+      fill(p, size, i);
+      chan_send(benchChan, p, size);
+    } else {
+      fill(buf, size, i);
+      lmsg_send(3, 0, buf, size);
+    }
+  }
+}
+
+static void consumer(int useChan, unsigned int size, unsigned int *buf)
+{
+  unsigned int s = 0;
+  unsigned int start = *cycleCounter;
+  for (unsigned int i = 0; i < VOLUME / size; i++) {
+    if (useChan) {
+      void *p;
+      unsigned int len;
+      chan_recv(benchChan, &p, &len);
+      assert(len == size);
+      s += sum(p, len);
+      chan_release(benchChan);
+    } else {
+      unsigned int src = 2;
+      unsigned int type;
+      unsigned int len = lmsg_recv(&src, &type, buf, size);
+      assert(len == size);
+      s += sum(buf, len);
+    }
+  }
+  elapsed = *cycleCounter - start;
+  benchSum = s;
+  cache_flushMem(&elapsed, sizeof(elapsed));
+  cache_flushMem(&benchSum, sizeof(benchSum));
+}
+
+static void run(int useChan, unsigned int size, unsigned int *buf)
+{
+  hw_barrier();
+  if (corenum() == 2) producer(useChan, size, buf);
+  if (corenum() == 3) consumer(useChan, size, buf);
+  hw_barrier();
+  if (corenum() == 2) {
+    cache_invalidateMem(&elapsed, sizeof(elapsed));
+    cache_invalidateMem(&benchSum, sizeof(benchSum));
+    unsigned int n = VOLUME / size;
+    unsigned int words = size / 4;
+    unsigned int expected = n * (words * (words - 1) / 2) +
+      words * (n * (n - 1) / 2);
+    unsigned int usecs = elapsed / clockFrequency() + 1;
+    xprintf("[%02u]: %s %5u bytes: %5u MB/s%s\n", corenum(),
+            (useChan ? "chan" : "lmsg"), size, VOLUME / size * size / usecs,
+            (benchSum == expected ? "" : ", bad data"));
+  }
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+}
+
+void mc_main(void)
+{
+  if (nCores() < 3) return;
+  unsigned int *buf = malloc(MAXSIZE);
+  assert(buf);
+  if (corenum() == 2) {
+    benchChan = chan_create(2, 3, RINGSIZE);
+    cache_flushMem(&benchChan, sizeof(benchChan));
+  }
+  hw_barrier();
+  cache_invalidateMem(&benchChan, sizeof(benchChan));
+  for (int i = 0; i < 5; i++) {
+    run(1, kSizes[i], buf);
+    run(0, kSizes[i], buf);
+  }
+}
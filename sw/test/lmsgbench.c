@@ -0,0 +1,114 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "lib/lib.h"
+#include "lib/barrier.h"
+#include "lib/lmsg.h"
+
+// Throughput of lib/lmsg.c in MB/s, for messages of 1 KB to 1 MB: first
+// from core 2 to core 3 alone, then all-to-all between cores 2..n.  In
+// each all-to-all round every core exchanges one message with a partner,
+// the lower numbered core of each pair sending first.
+
+#define MAXSIZE (1 << 20)
+#define VOLUME  (1 << 20)   // bytes per measurement and partner
+
+void mc_init(void);
+void mc_main(void);
+
+static const unsigned int kSizes[6] = {
+  1 << 10, 1 << 12, 1 << 14, 1 << 16, 1 << 18, 1 << 20
+};
+
+DEFINE_PER_CORE(unsigned int, elapsed);
+DEFINE_PER_CORE(char *, sendBuf);
+DEFINE_PER_CORE(char *, recvBuf);
+
+static void sendTo(unsigned int core, unsigned int size)
+{
+  for (unsigned int i = 0; i < VOLUME / size; i++) {
+    lmsg_send(core, 0, my(sendBuf), size);
+  }
+}
+
+static void recvFrom(unsigned int core, unsigned int size)
+{
+  for (unsigned int i = 0; i < VOLUME / size; i++) {
+    unsigned int src = core;
+    unsigned int type;
+    unsigned int len = lmsg_recv(&src, &type, my(recvBuf), size);
+    assert(len == size && src == core);
+    assert(my(recvBuf)[0] == (char)core && my(recvBuf)[size - 1] == (char)core);
+  }
+}
+
+static void report(const char *what, unsigned int size, unsigned int bytes,
+                   unsigned int first, unsigned int last)
+{
+  // Print MB/s for 'bytes' moved in the time of the slowest core
+  unsigned int slowest = 0;
+  for (unsigned int core = first; core <= last; core++) {
+    cache_invalidateMem(&per_core(elapsed, core), sizeof(unsigned int));
+    if (per_core(elapsed, core) > slowest) slowest = per_core(elapsed, core);
+  }
+  unsigned int usecs = slowest / clockFrequency() + 1;
+  xprintf("[%02u]: %s %7u bytes: %5u MB/s\n",
+          corenum(), what, size, bytes / usecs);
+}
+
+static void pair(unsigned int size)
+{
+  hw_barrier();
+  unsigned int start = *cycleCounter;
+  if (corenum() == 2) sendTo(3, size);
+  if (corenum() == 3) recvFrom(2, size);
+  my(elapsed) = *cycleCounter - start;
+  cache_flushMem(&my(elapsed), sizeof(unsigned int));
+  hw_barrier();
+  if (corenum() == 2) report("pair      ", size, VOLUME / size * size, 2, 3);
+}
+
+static void allToAll(unsigned int size)
+{
+  unsigned int n = nCores() - 1;     // cores 2..n
+  unsigned int me = corenum() - 2;
+  hw_barrier();
+  unsigned int start = *cycleCounter;
+  for (unsigned int round = 0; round < n; round++) {
+    unsigned int partner = (round + n - me) % n;
+    if (partner == me) continue;
+    if (me < partner) {
+      sendTo(partner + 2, size);
+      recvFrom(partner + 2, size);
+    } else {
+      recvFrom(partner + 2, size);
+      sendTo(partner + 2, size);
+    }
+  }
+  my(elapsed) = *cycleCounter - start;
+  cache_flushMem(&my(elapsed), sizeof(unsigned int));
+  hw_barrier();
+  if (corenum() == 2) {
+    report("all-to-all", size, n * (n - 1) * (VOLUME / size * size), 2,
+           nCores());
+  }
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init, window %u frames\n", corenum(), lmsg_window());
+}
+
+void mc_main(void)
+{
+  my(sendBuf) = malloc(MAXSIZE);
+  my(recvBuf) = malloc(MAXSIZE);
+  assert(my(sendBuf) && my(recvBuf));
+  memset(my(sendBuf), corenum(), MAXSIZE);
+  if (nCores() < 3) return;
+  for (int i = 0; i < 6; i++) pair(kSizes[i]);
+  for (int i = 0; i < 6; i++) allToAll(kSizes[i]);
+}
@@ -0,0 +1,62 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "lib/lib.h"
+
+// Fragmentation stress for the core #1 heap: keeps NLIVE blocks of mixed
+// sizes allocated, replacing a random one at each step, and reports the
+// mean and worst malloc and free latency in cycles.
+
+#define NLIVE 1000
+#define NOPS  20000
+
+void mc_init(void);
+void mc_main(void);
+
+static size_t randomSize(unsigned int *seed)
+{
+  // Mostly small control blocks, some packet buffers, a few big ones
+  int r = rand_r(seed) % 100;
+  if (r < 70) return 8 + rand_r(seed) % 200;
+  if (r < 95) return 1500 + rand_r(seed) % 100;
+  return 4000 + rand_r(seed) % 60000;
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+  void **live = malloc(NLIVE * sizeof(void *));
+  unsigned int seed = 2010;
+  for (int i = 0; i < NLIVE; i++) live[i] = malloc(randomSize(&seed));
+
+  unsigned int mallocTotal = 0, mallocWorst = 0;
+  unsigned int freeTotal = 0, freeWorst = 0;
+  for (int i = 0; i < NOPS; i++) {
+    int slot = rand_r(&seed) % NLIVE;
+    size_t size = randomSize(&seed);
+    unsigned int t0 = *cycleCounter;
+    free(live[slot]);
+    unsigned int t1 = *cycleCounter;
+    live[slot] = malloc(size);
+    unsigned int t2 = *cycleCounter;
+    assert(live[slot] != NULL);
+    freeTotal += t1 - t0;
+    if (t1 - t0 > freeWorst) freeWorst = t1 - t0;
+    mallocTotal += t2 - t1;
+    if (t2 - t1 > mallocWorst) mallocWorst = t2 - t1;
+  }
+  for (int i = 0; i < NLIVE; i++) free(live[i]);
+  free(live);
+
+  xprintf("[%02u]: malloc: mean %u cycles, worst %u cycles\n",
+          corenum(), mallocTotal / NOPS, mallocWorst);
+  xprintf("[%02u]: free:   mean %u cycles, worst %u cycles\n",
+          corenum(), freeTotal / NOPS, freeWorst);
+}
+
+void mc_main(void)
+{
+}
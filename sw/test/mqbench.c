@@ -0,0 +1,85 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "shared/network.h"
+#include "lib/lib.h"
+#include "lib/msg.h"
+
+// Message round-trip latency between a thread in core 1, blocked in
+// mq_wait, and core 2, which echoes each message straight back.  Measured
+// with the receive thread woken by the scheduler's poller, and with the
+// receive thread busy-polling as it used to, each with 0, 4 and 16
+// background threads that are always ready to run.
+
+#define NROUNDS 1000
+
+void mc_init(void);
+void mc_main(void);
+
+static const unsigned int kPingType = msgTypeDefault;
+static int stopping;
+
+static void spinner(void *arg)
+{
+  while (!stopping) thread_yield();
+}
+
+static unsigned int roundTrip(void)
+{
+  // Mean cycles for one ping-pong with core 2
+  IntercoreMessage msg;
+  unsigned int start = *cycleCounter;
+  for (int i = 0; i < NROUNDS; i++) {
+    msg[0] = i;
+    message_send(2, kPingType, &msg, 1);
+    mq_wait(2, kPingType, &msg, 0);
+  }
+  return (*cycleCounter - start) / NROUNDS;
+}
+
+static void bench(void *arg)
+{
+  IntercoreMessage msg;
+  mq_wait(2, kPingType, &msg, 0); // core 2 is running
+  const int kBackground[3] = { 0, 4, 16 };
+  for (int busy = 0; busy <= 1; busy++) {
+    mq_busyPoll(busy);
+    for (int i = 0; i < 3; i++) {
+      Thread spinners[16];
+      stopping = 0;
+      for (int j = 0; j < kBackground[i]; j++) {
+        spinners[j] = thread_fork_sized(spinner, NULL, 4096);
+      }
+      unsigned int cycles = roundTrip();
+      stopping = 1;
+      for (int j = 0; j < kBackground[i]; j++) thread_join(spinners[j]);
+      xprintf("[%02u]: %s, %2d background threads: %u cycles/round trip\n",
+              corenum(), (busy ? "busy-poll" : "event    "),
+              kBackground[i], cycles);
+    }
+  }
+  mq_busyPoll(0);
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+  thread_fork(bench, NULL); // runs once the other cores have started
+}
+
+void mc_main(void)
+{
+  if (corenum() != 2) return;
+  IntercoreMessage msg;
+  message_send(1, kPingType, &msg, 1);
+  for (;;) {
+    unsigned int status;
+    while ((status = message_recv(&msg)) == 0) {}
+    if (message_type(status) == kPingType) {
+      message_send(1, kPingType, &msg, message_len(status));
+    }
+  }
+}
@@ -0,0 +1,91 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "shared/network.h"
+#include "lib/lib.h"
+
+// TCP receive cost on core 1, in cycles per segment, with 1, 100 and 1000
+// connections open: NSEGMENTS one-byte pushed segments go over one
+// loopback connection while the others sit idle, and tcp_stats gives the
+// time spent in TCP's receive up-call, connection lookup included.
+
+#define NSEGMENTS 2000
+#define BENCH_PORT 5002
+#define MAXCONNS 1000
+
+void mc_init(void);
+void mc_main(void);
+
+static const int kCounts[3] = { 1, 100, MAXCONNS };
+
+static TCP accepted[MAXCONNS];
+static int nAccepted;
+static unsigned int received;
+
+static void reader(void *arg)
+{
+  TCP tcp = arg;
+  Octet buf[64];
+  for (;;) {
+    int n = tcp_recv(tcp, buf, sizeof(buf));
+    if (n <= 0) break;
+    received += n;
+  }
+}
+
+static void acceptor(void *arg)
+{
+  tcp_listen(BENCH_PORT, 0, 0, 16);
+  while (nAccepted < MAXCONNS) {
+    TCP tcp = tcp_accept(BENCH_PORT, NULL, NULL, 0);
+    if (nAccepted == 0) thread_fork(reader, tcp);
+    accepted[nAccepted++] = tcp;
+  }
+}
+
+static void bench(void *arg)
+{
+  TCP first = NULL;
+  int open = 0;
+  Octet byte = 0x5a;
+  for (int i = 0; i < 3; i++) {
+    while (open < kCounts[i]) {
+      TCP tcp = tcp_connect(0, ip_fromQuad(127, 0, 0, 1), BENCH_PORT,
+                            1000000);
+      if (!tcp) {
+        xprintf("[%02u]: connect failed with %d open\n", corenum(), open);
+        return;
+      }
+      if (!first) first = tcp;
+      open++;
+    }
+    TCPStats stats;
+    tcp_stats(&stats, 1);
+    unsigned int before = received;
+    for (int j = 0; j < NSEGMENTS; j++) {
+      tcp_send(first, &byte, 1);
+      tcp_push(first);
+      thread_yield();
+    }
+    while (received - before < NSEGMENTS) thread_yield();
+    tcp_stats(&stats, 0);
+    if (stats.segments == 0) stats.segments = 1;
+    xprintf("[%02u]: %4d connections: %u segments, %u cycles each\n",
+            corenum(), open, stats.segments,
+            (unsigned int)(stats.receiveCycles / stats.segments));
+  }
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+  thread_fork(acceptor, NULL);
+  thread_fork(bench, NULL);
+}
+
+void mc_main(void)
+{
+}
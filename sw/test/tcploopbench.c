@@ -0,0 +1,81 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "shared/network.h"
+#include "lib/lib.h"
+
+// TCP throughput over loopback on core 1, in Mb/s: one thread sends
+// VOLUME bytes to 127.0.0.1 in tcp_send calls of 1 KB, 8 KB and 64 KB,
+// another receives them.  Both ends are on this core, so this measures
+// the protocol path (no checksums, no copies at the IP layer), not the
+// network.
+
+#define VOLUME (1 << 22)
+#define MAXSIZE (1 << 16)
+#define LOOP_PORT 5001
+
+void mc_init(void);
+void mc_main(void);
+
+static const Uint32 kSizes[3] = { 1 << 10, 1 << 13, MAXSIZE };
+
+static void receiver(void *arg)
+{
+  Octet *buf = malloc(MAXSIZE);
+  tcp_listen(LOOP_PORT, 0, 0, 4);
+  for (int i = 0; i < 3; i++) {
+    TCP tcp = tcp_accept(LOOP_PORT, NULL, NULL, 0);
+    unsigned int total = 0;
+    unsigned int start = *cycleCounter;
+    for (;;) {
+      int n = tcp_recv(tcp, buf, MAXSIZE);
+      if (n <= 0) break;
+      total += n;
+    }
+    unsigned int usecs = (*cycleCounter - start) / clockFrequency() + 1;
+    xprintf("[%02u]: %5u byte sends: %4u Mb/s%s\n", corenum(), kSizes[i],
+            (unsigned int)(total * 8LL / usecs),
+            (total == VOLUME ? "" : ", data lost"));
+    tcp_close(tcp);
+  }
+  free(buf);
+}
+
+static void sender(void *arg)
+{
+  Octet *buf = malloc(MAXSIZE);
+  memset(buf, 0x5a, MAXSIZE);
+  for (int i = 0; i < 3; i++) {
+    TCP tcp = tcp_connect(0, ip_fromQuad(127, 0, 0, 1), LOOP_PORT, 0);
+    if (!tcp) {
+      xprintf("[%02u]: loopback connect failed\n", corenum());
+      break;
+    }
+    for (unsigned int sent = 0; sent < VOLUME; sent += kSizes[i]) {
+      tcp_send(tcp, buf, kSizes[i]);
+    }
+    tcp_shutdown(tcp);
+    while (tcp_recv(tcp, buf, MAXSIZE) > 0) ; // until the receiver's FIN
+    TCPConnStats stats;
+    tcp_connStats(tcp, &stats);
+    xprintf("[%02u]: srtt %u us, rto %u us, %u retransmits\n", corenum(),
+            (unsigned int)stats.srtt, (unsigned int)stats.rto,
+            stats.retransmits);
+    tcp_close(tcp);
+  }
+  free(buf);
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+  thread_fork(receiver, NULL);
+  thread_fork(sender, NULL);
+}
+
+void mc_main(void)
+{
+}
@@ -0,0 +1,79 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "shared/network.h"
+#include "lib/lib.h"
+
+// TCP goodput over a lossy loopback path on core 1, in Mb/s: one thread
+// sends VOLUME bytes to 127.0.0.1 while ip_setLoopbackLoss drops 0, 0.1%,
+// 1%, 2% and 5% of the packets (data and ACKs alike), another receives
+// them.  Also shows how the losses were repaired: by fast retransmit and
+// recovery, or by retransmission timeouts.
+
+#define VOLUME (1 << 21)
+#define SENDSIZE 8192
+#define LOSS_PORT 5003
+#define NRATES 5
+
+void mc_init(void);
+void mc_main(void);
+
+static const Uint32 kLoss[NRATES] = { 0, 1000, 10000, 20000, 50000 };
+
+static void receiver(void *arg)
+{
+  Octet *buf = malloc(SENDSIZE);
+  tcp_listen(LOSS_PORT, 0, 0, 4);
+  for (int i = 0; i < NRATES; i++) {
+    TCP tcp = tcp_accept(LOSS_PORT, NULL, NULL, 0);
+    while (tcp_recv(tcp, buf, SENDSIZE) > 0) ;
+    tcp_close(tcp);
+  }
+  free(buf);
+}
+
+static void sender(void *arg)
+{
+  Octet *buf = malloc(SENDSIZE);
+  memset(buf, 0x5a, SENDSIZE);
+  for (int i = 0; i < NRATES; i++) {
+    ip_setLoopbackLoss(kLoss[i]);
+    unsigned int start = *cycleCounter;
+    TCP tcp = tcp_connect(0, ip_fromQuad(127, 0, 0, 1), LOSS_PORT, 0);
+    if (!tcp) {
+      xprintf("[%02u]: loopback connect failed\n", corenum());
+      break;
+    }
+    int ok = 1;
+    for (unsigned int sent = 0; ok && sent < VOLUME; sent += SENDSIZE) {
+      ok = (tcp_send(tcp, buf, SENDSIZE) == SENDSIZE);
+    }
+    tcp_shutdown(tcp);
+    while (tcp_recv(tcp, buf, SENDSIZE) > 0) ; // until the receiver's FIN
+    unsigned int usecs = (*cycleCounter - start) / clockFrequency() + 1;
+    TCPConnStats stats;
+    tcp_connStats(tcp, &stats);
+    tcp_close(tcp);
+    ip_setLoopbackLoss(0);
+    xprintf("[%02u]: %2u.%u%% loss: %4u Mb/s, %u fast retransmits, "
+            "%u timeouts%s\n", corenum(), kLoss[i] / 10000,
+            kLoss[i] / 1000 % 10, (unsigned int)(VOLUME * 8LL / usecs),
+            stats.fastRetransmits, stats.retransmits,
+            (ok ? "" : ", connection failed"));
+  }
+  free(buf);
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+  thread_fork(receiver, NULL);
+  thread_fork(sender, NULL);
+}
+
+void mc_main(void)
+{
+}
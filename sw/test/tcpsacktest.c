@@ -0,0 +1,113 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "shared/network.h"
+#include "lib/lib.h"
+
+// Randomized test of TCP's out-of-order queue and SACK, on core 1: ROUNDS
+// transfers over loopback, each with a random loss rate and random write
+// sizes, so holes open and fill in every order.  The receiver checks that
+// every byte arrives once and in order, which it can only do if the
+// out-of-order queue is kept in sequence and drained correctly; the
+// sender's SACK counters show that no block was empty or reached beyond
+// what it sent.  The seed is printed, and srand with it repeats a run.
+
+#define ROUNDS 20
+#define VOLUME (1 << 19)
+#define SENDMAX 6000
+#define SACK_PORT 5005
+
+void mc_init(void);
+void mc_main(void);
+
+static const Uint32 kLoss[5] = { 5000, 10000, 20000, 50000, 100000 };
+
+static unsigned int received;   // bytes in the current round
+static unsigned int wrong;      // of those, with the wrong value
+
+static Octet pattern(unsigned int offset, int round)
+{
+  // The byte at "offset" in round "round"'s stream
+  return ((offset * 2654435761u) >> 24) ^ round;
+}
+
+static void receiver(void *arg)
+{
+  Octet *buf = malloc(SENDMAX);
+  tcp_listen(SACK_PORT, 0, 0, 4);
+  for (int i = 0; i < ROUNDS; i++) {
+    TCP tcp = tcp_accept(SACK_PORT, NULL, NULL, 0);
+    received = 0;
+    wrong = 0;
+    for (;;) {
+      int n = tcp_recv(tcp, buf, SENDMAX);
+      if (n <= 0) break;
+      for (int j = 0; j < n; j++) {
+        if (buf[j] != pattern(received + j, i)) wrong++;
+      }
+      received += n;
+    }
+    tcp_close(tcp);
+  }
+  free(buf);
+}
+
+static void sender(void *arg)
+{
+  Octet *buf = malloc(SENDMAX);
+  unsigned int seed = *cycleCounter;
+  int failures = 0;
+  xprintf("[%02u]: seed %u\n", corenum(), seed);
+  srand(seed);
+  TCPStats stats;
+  tcp_stats(&stats, 1);
+  for (int i = 0; i < ROUNDS; i++) {
+    Uint32 loss = kLoss[rand() % 5];
+    ip_setLoopbackLoss(loss);
+    TCP tcp = tcp_connect(0, ip_fromQuad(127, 0, 0, 1), SACK_PORT, 0);
+    if (!tcp) {
+      xprintf("[%02u]: loopback connect failed\n", corenum());
+      failures++;
+      break;
+    }
+    unsigned int sent = 0;
+    while (sent < VOLUME) {
+      int len = 1 + rand() % SENDMAX;
+      if (len > VOLUME - sent) len = VOLUME - sent;
+      for (int j = 0; j < len; j++) buf[j] = pattern(sent + j, i);
+      if (tcp_send(tcp, buf, len) != len) break;
+      sent += len;
+    }
+    tcp_shutdown(tcp);
+    while (tcp_recv(tcp, buf, SENDMAX) > 0) ; // until the receiver's FIN
+    tcp_close(tcp);
+    ip_setLoopbackLoss(0);
+    int ok = (sent == VOLUME && received == VOLUME && wrong == 0);
+    if (!ok) failures++;
+    xprintf("[%02u]: round %2d, %2u.%u%% loss: %u sent, %u received, "
+            "%u wrong%s\n", corenum(), i, loss / 10000, loss / 1000 % 10,
+            sent, received, wrong, (ok ? "" : " FAILED"));
+  }
+  tcp_stats(&stats, 0);
+  if (stats.sackBlocks == 0 || stats.badSackBlocks != 0) failures++;
+  xprintf("[%02u]: %u SACK blocks, %u bad, %u fast retransmits, "
+          "%u timeouts\n", corenum(), stats.sackBlocks,
+          stats.badSackBlocks, stats.fastRetransmits, stats.retransmits);
+  xprintf("[%02u]: tcpsacktest %s\n", corenum(),
+          (failures ? "FAILED" : "passed"));
+  free(buf);
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+  thread_fork(receiver, NULL);
+  thread_fork(sender, NULL);
+}
+
+void mc_main(void)
+{
+}
@@ -0,0 +1,121 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "shared/network.h"
+#include "lib/lib.h"
+
+// Checks the window scale handshake (RFC 7323) over loopback on core 1,
+// with 1 MB receive buffers at both ends.  When both ends offer the
+// option, each must use the shift the other announced, and it must be
+// large enough to advertise the buffer.  When either end doesn't offer it
+// (tcp_setWindowScaling), neither may scale.  Each connection then
+// carries VOLUME bytes from client to server, which stalls or loses data
+// if the two ends disagree about the scale.
+
+#define VOLUME (1 << 20)
+#define BUFSIZE 8192
+#define RECVBUF (1 << 20)
+#define SCALE_PORT 5006
+#define NOSCALE_PORT 5007
+
+void mc_init(void);
+void mc_main(void);
+
+static int failures;
+
+static void drain(void *arg)
+{
+  // Receive everything the other end sends, then close our half
+  TCP tcp = arg;
+  Octet *buf = malloc(BUFSIZE);
+  unsigned int total = 0;
+  for (;;) {
+    int n = tcp_recv(tcp, buf, BUFSIZE);
+    if (n <= 0) break;
+    total += n;
+  }
+  if (total != VOLUME) {
+    xprintf("[%02u]: received %u of %u bytes\n", corenum(), total, VOLUME);
+    failures++;
+  }
+  tcp_shutdown(tcp);
+  free(buf);
+}
+
+static void transfer(TCP a, TCP b)
+{
+  // Send VOLUME bytes from "a" to "b", then wait for b's FIN
+  Octet *buf = malloc(BUFSIZE);
+  memset(buf, 0x5a, BUFSIZE);
+  thread_fork(drain, b);
+  for (unsigned int sent = 0; sent < VOLUME; sent += BUFSIZE) {
+    if (tcp_send(a, buf, BUFSIZE) != BUFSIZE) break;
+  }
+  tcp_shutdown(a);
+  unsigned int total = 0;
+  for (;;) {
+    int n = tcp_recv(a, buf, BUFSIZE);
+    if (n <= 0) break;
+    total += n;
+  }
+  free(buf);
+  if (total != 0) failures++; // "b" sends nothing but its FIN
+}
+
+static void check(char *name, int offerConnect, int offerListen,
+                  TCPPort port)
+{
+  // Make a connection with the given ends offering the option, and check
+  // the shifts that each end ends up with
+  tcp_setWindowScaling(offerListen);
+  tcp_listen(port, 0, 0, 1);
+  tcp_setWindowScaling(offerConnect);
+  TCP client = tcp_connect(0, ip_fromQuad(127, 0, 0, 1), port, 1000000);
+  if (!client) {
+    xprintf("[%02u]: %s: connect failed\n", corenum(), name);
+    failures++;
+    return;
+  }
+  TCP server = tcp_accept(port, NULL, NULL, 0);
+  TCPConnStats c, s;
+  tcp_connStats(client, &c);
+  tcp_connStats(server, &s);
+  int want = 0;
+  if (offerConnect && offerListen) {
+    while (want < 14 && (RECVBUF >> want) > 65535) want++;
+  }
+  int ok = (c.recvScale == want && s.recvScale == want &&
+            c.sendScale == s.recvScale && s.sendScale == c.recvScale);
+  xprintf("[%02u]: %s: client %d/%d, server %d/%d, expected %d: %s\n",
+          corenum(), name, c.sendScale, c.recvScale, s.sendScale,
+          s.recvScale, want, (ok ? "ok" : "FAILED"));
+  if (!ok) failures++;
+  transfer(client, server);
+  tcp_close(client);
+  tcp_close(server);
+  tcp_listen(port, 0, 0, -1);
+}
+
+static void test(void *arg)
+{
+  tcp_setRecvBuffer(NULL, RECVBUF);
+  check("both offer", 1, 1, SCALE_PORT);
+  check("client doesn't", 0, 1, NOSCALE_PORT);
+  check("server doesn't", 1, 0, SCALE_PORT);
+  tcp_setWindowScaling(1);
+  xprintf("[%02u]: tcpscaletest %s\n", corenum(),
+          (failures ? "FAILED" : "passed"));
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+  thread_fork(test, NULL);
+}
+
+void mc_main(void)
+{
+}
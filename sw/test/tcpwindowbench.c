@@ -0,0 +1,86 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "shared/network.h"
+#include "lib/lib.h"
+
+// TCP throughput over loopback on core 1, in Mb/s, with 32 KB, 256 KB and
+// 1 MB receive buffers: the receiver connects with tcp_setRecvBuffer's
+// size in force, so the window scale is negotiated to suit, and the
+// accepting end sends it VOLUME bytes.  Each run is done twice: over
+// plain loopback, which has no bandwidth-delay product to speak of and
+// so shows the cost of the larger windows, and with ip_setLoopbackDelay
+// giving a DELAY_RTT round trip, where a window limits throughput to
+// window / RTT (26 Mb/s for 32 KB at 10 ms) and the gain shows.
+
+#define VOLUME (1 << 23)
+#define SENDSIZE (1 << 14)
+#define WINDOW_PORT 5004
+#define DELAY_RTT 10000
+#define NRUNS 6
+
+void mc_init(void);
+void mc_main(void);
+
+static const Uint32 kBuffers[3] = { 1 << 15, 1 << 18, 1 << 20 };
+
+static void sender(void *arg)
+{
+  Octet *buf = malloc(SENDSIZE);
+  memset(buf, 0x5a, SENDSIZE);
+  tcp_listen(WINDOW_PORT, 0, 0, 4);
+  for (int i = 0; i < NRUNS; i++) {
+    TCP tcp = tcp_accept(WINDOW_PORT, NULL, NULL, 0);
+    for (unsigned int sent = 0; sent < VOLUME; sent += SENDSIZE) {
+      if (tcp_send(tcp, buf, SENDSIZE) < 0) break;
+    }
+    tcp_close(tcp);
+  }
+  free(buf);
+}
+
+static void receiver(void *arg)
+{
+  Octet *buf = malloc(SENDSIZE);
+  for (int i = 0; i < NRUNS; i++) {
+    Microsecs rtt = (i < 3 ? 0 : DELAY_RTT);
+    ip_setLoopbackDelay(rtt / 2);
+    tcp_setRecvBuffer(NULL, kBuffers[i % 3]);
+    TCP tcp = tcp_connect(0, ip_fromQuad(127, 0, 0, 1), WINDOW_PORT, 0);
+    if (!tcp) {
+      xprintf("[%02u]: loopback connect failed\n", corenum());
+      break;
+    }
+    unsigned int total = 0;
+    unsigned int start = *cycleCounter;
+    for (;;) {
+      int n = tcp_recv(tcp, buf, SENDSIZE);
+      if (n <= 0) break;
+      total += n;
+    }
+    unsigned int usecs = (*cycleCounter - start) / clockFrequency() + 1;
+    TCPConnStats stats;
+    tcp_connStats(tcp, &stats);
+    xprintf("[%02u]: %4u KB buffer, %2u ms RTT: %4u Mb/s, scale %d%s\n",
+            corenum(), kBuffers[i % 3] >> 10, (unsigned int)(rtt / 1000),
+            (unsigned int)(total * 8LL / usecs), stats.recvScale,
+            (total == VOLUME ? "" : ", data lost"));
+    tcp_close(tcp);
+  }
+  ip_setLoopbackDelay(0);
+  free(buf);
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+  thread_fork(sender, NULL);
+  thread_fork(receiver, NULL);
+}
+
+void mc_main(void)
+{
+}
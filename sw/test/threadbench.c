@@ -0,0 +1,126 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "shared/threads.h"
+#include "lib/lib.h"
+
+// Measures the cost of thread_yield and of a timed wait that is satisfied
+// by a signal, with 10, 100 and 1000 threads sleeping in timed waits in
+// the background.  All of this runs in core 1, which has the threads.
+
+#define NROUNDS 10000
+
+void mc_init(void);
+void mc_main(void);
+
+static Mutex benchMutex;
+static Condition sleepCond;   // background sleepers wait here
+static Condition pingCond;    // timed-wait round trips
+static Condition pongCond;
+static int sleepersDone;      // tells the sleepers to finish
+static int stopping;          // tells the partner thread to finish
+static int pings;             // round trips requested of the partner
+
+static void sleeper(void *arg)
+{
+  // Wait repeatedly with a long timeout, different for each sleeper so
+  // that the timers are spread out.
+  Microsecs timeout = 100000 + 100 * (int)arg;
+  mutex_acquire(benchMutex);
+  while (!sleepersDone) condition_timedWait(sleepCond, benchMutex, timeout);
+  mutex_release(benchMutex);
+}
+
+static void yielder(void *arg)
+{
+  while (!stopping) thread_yield();
+}
+
+static void ponger(void *arg)
+{
+  mutex_acquire(benchMutex);
+  for (;;) {
+    while (!stopping && pings == 0) condition_wait(pongCond, benchMutex);
+    if (stopping) break;
+    pings--;
+    condition_signal(pingCond);
+  }
+  mutex_release(benchMutex);
+}
+
+static unsigned int timeYield(void)
+{
+  // Cycles per thread_yield, with a second ready thread to switch to
+  stopping = 0;
+  Thread partner = thread_fork(yielder, NULL);
+  unsigned int start = *cycleCounter;
+  for (int i = 0; i < NROUNDS; i++) thread_yield();
+  unsigned int elapsed = *cycleCounter - start;
+  stopping = 1;
+  thread_join(partner);
+  return elapsed / NROUNDS;
+}
+
+static unsigned int timeTimedWait(void)
+{
+  // Cycles per timed wait that is ended by a signal, including the two
+  // context switches
+  stopping = 0;
+  pings = 0;
+  Thread partner = thread_fork(ponger, NULL);
+  unsigned int start = *cycleCounter;
+  mutex_acquire(benchMutex);
+  for (int i = 0; i < NROUNDS; i++) {
+    pings++;
+    condition_signal(pongCond);
+    condition_timedWait(pingCond, benchMutex, 1000000);
+  }
+  mutex_release(benchMutex);
+  unsigned int elapsed = *cycleCounter - start;
+  mutex_acquire(benchMutex);
+  stopping = 1;
+  condition_signal(pongCond);
+  mutex_release(benchMutex);
+  thread_join(partner);
+  return elapsed / NROUNDS;
+}
+
+static void bench(int nSleepers)
+{
+  Thread *sleepers = malloc(nSleepers * sizeof(Thread));
+  sleepersDone = 0;
+  for (int i = 0; i < nSleepers; i++) {
+    sleepers[i] = thread_fork_sized(sleeper, (void *)i, 4096);
+  }
+  thread_yield(); // let them all reach their timed wait
+  unsigned int yieldCost = timeYield();
+  unsigned int waitCost = timeTimedWait();
+  xprintf("[%02u]: %4d sleepers: yield %u cycles, timed wait %u cycles\n",
+          corenum(), nSleepers, yieldCost, waitCost);
+  mutex_acquire(benchMutex);
+  sleepersDone = 1;
+  condition_broadcast(sleepCond);
+  mutex_release(benchMutex);
+  for (int i = 0; i < nSleepers; i++) thread_join(sleepers[i]);
+  free(sleepers);
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+  benchMutex = mutex_create();
+  sleepCond = condition_create();
+  pingCond = condition_create();
+  pongCond = condition_create();
+  bench(10);
+  bench(100);
+  bench(1000);
+  thread_stackReport();
+}
+
+void mc_main(void)
+{
+}
@@ -0,0 +1,61 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "shared/network.h"
+#include "lib/lib.h"
+
+// UDP transmit throughput from a thread in core 1, in packets/s and Mb/s
+// of payload, for 64 and 1472 byte payloads, with 1, 4 and 16 transmit
+// requests allowed outstanding in the Ethernet controller.  The packets
+// go to the discard port at BLAST_DEST, by default the local broadcast
+// address, so run this on an isolated network.
+
+#define NPACKETS 20000
+#define BLAST_DEST ip_fromQuad(255, 255, 255, 255)
+#define BLAST_PORT 9    // discard
+
+void mc_init(void);
+void mc_main(void);
+
+static void blast(int depth, Uint32 payload)
+{
+  UDP *buf = (UDP *)enet_alloc();
+  memset(buf->data, 0x5a, payload);
+  buf->ip.dest = hton(BLAST_DEST);
+  buf->udp.dest = htons(BLAST_PORT);
+  buf->udp.srce = htons(BLAST_PORT);
+  enet_setTxDepth(depth);
+  unsigned int rejects = enet_txRejects();
+  unsigned int start = *cycleCounter;
+  for (int i = 0; i < NPACKETS; i++) udp_send(buf, payload);
+  unsigned int usecs = (*cycleCounter - start) / clockFrequency() + 1;
+  xprintf("[%02u]: depth %2d, %4u byte payload: %7u packets/s, %4u Mb/s, "
+          "%u rejects\n", corenum(), depth, payload,
+          (unsigned int)(NPACKETS * 1000000LL / usecs),
+          (unsigned int)(NPACKETS * 8LL * payload / usecs),
+          enet_txRejects() - rejects);
+  enet_free((Enet *)buf);
+}
+
+static void bench(void *arg)
+{
+  const int kDepths[3] = { 1, 4, 16 };
+  const Uint32 kPayloads[2] = { 64, 1472 };
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 2; j++) blast(kDepths[i], kPayloads[j]);
+  }
+  enet_setTxDepth(enetTxMax);
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+  thread_fork(bench, NULL);
+}
+
+void mc_main(void)
+{
+}
@@ -0,0 +1,52 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "shared/network.h"
+#include "lib/lib.h"
+
+// UDP echo server on port 7, spread across cores 2..n: core 1 passes each
+// flow to one of them by udp_fanOut, and they reply directly.  Each core
+// reports its packet rate every REPORT packets.  Drive it from other
+// machines, e.g. with several instances of a UDP echo client.
+
+#define ECHO_PORT 7
+#define REPORT 100000
+
+void mc_init(void);
+void mc_main(void);
+
+void mc_init(void)
+{
+  unsigned int n = enetCorenum() - 2;
+  xprintf("[%02u]: mc_init, echo on cores 2..%u\n", corenum(), n + 1);
+  udp_fanOut(ECHO_PORT, 2, n);
+}
+
+void mc_main(void)
+{
+  UDP *reply = cacheAlign(malloc(sizeof(Enet) + 31));
+  assert(reply);
+  unsigned int count = 0;
+  unsigned int start = *cycleCounter;
+  for (;;) {
+    EnetFrame f;
+    if (!enet_corePoll(&f)) continue;
+    int len = udp_coreCheck(&f);
+    if (len >= 0) {
+      memcpy(reply->data, udp_payload((IP *)f.buf), len);
+      udp_coreReply(&f, reply, len);
+      count++;
+    }
+    enet_coreRelease(&f);
+    if (count == REPORT) {
+      unsigned int usecs = (*cycleCounter - start) / clockFrequency() + 1;
+      xprintf("[%02u]: %u packets/s\n", corenum(),
+              (unsigned int)(REPORT * 1000000LL / usecs));
+      count = 0;
+      start = *cycleCounter;
+    }
+  }
+}
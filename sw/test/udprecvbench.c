@@ -0,0 +1,59 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shared/intercore.h"
+#include "shared/network.h"
+#include "lib/lib.h"
+
+// Receive path cost on core 1, in cycles per packet: from the MQ up-call
+// for the packet to its hand-off to the delivery thread, from hand-off to
+// the start of delivery, and in the up-calls to IP and UDP.  Counts UDP
+// packets to the discard port, so run udpblast (or any UDP sender) on
+// another machine on the same network.
+
+#define NPACKETS 20000
+#define RECV_PORT 9     // discard
+
+void mc_init(void);
+void mc_main(void);
+
+static unsigned int received;
+
+static void discard(IP *buf, int len, int broadcast, UDPPort dest)
+{
+  if (len >= 0) received++;
+}
+
+static unsigned int perPacket(unsigned long long cycles, Uint32 packets)
+{
+  return (packets ? (unsigned int)(cycles / packets) : 0);
+}
+
+static void bench(void *arg)
+{
+  EnetRecvStats stats;
+  udp_register(RECV_PORT, discard);
+  for (;;) {
+    enet_recvStats(&stats, 1);
+    received = 0;
+    while (received < NPACKETS) thread_sleep(100000);
+    enet_recvStats(&stats, 1);
+    xprintf("[%02u]: %u packets: receive %u, hand-off %u, up-call %u "
+            "cycles/packet, %u dropped\n", corenum(), stats.packets,
+            perPacket(stats.receiveCycles, stats.packets),
+            perPacket(stats.handoffCycles, stats.packets),
+            perPacket(stats.upcallCycles, stats.packets), stats.dropped);
+  }
+}
+
+void mc_init(void)
+{
+  xprintf("[%02u]: mc_init\n", corenum());
+  thread_fork(bench, NULL);
+}
+
+void mc_main(void)
+{
+}